@@ -7,7 +7,16 @@
 import sys
 import time
 import math
+import itertools
+import threading
+import multiprocessing
+import Queue
+import cStringIO
 import psycopg2
+try:
+    import numpy
+except ImportError:
+    numpy = None # Only needed by aggregation-engine vector
 
 # Event type
 EVENT_LOCAL   = 0
@@ -19,6 +28,11 @@ EVENT_ONLINE  = 7
 EVENT_OFFLINE = 8
 EVENT_TIMEOUT = 9
 
+# Count columns of find_corners(): local, ucast, bcast, mcast, ack
+EVENT_COLUMN = { EVENT_LOCAL: 0, EVENT_UCAST: 1, EVENT_BCAST: 2, EVENT_MCAST: 3, EVENT_ACK: 4 }
+
+VECTOR_CHUNK = 65536  # Rows per numpy chunk of aggregation-engine vector
+
 # Will be defined on runtime
 LAT_PER_METER = 0  # Approx. number of latitude degree per 1 meter
 LON_PER_METER = 0  # Approx. number of longitude degree per 1 meter
@@ -44,6 +58,11 @@ config_keys = ( 'coordinate-boundary',
                 'dbgps-passwd',
                 'dbgps-name',
                 'dbgps-table',
+                'dbgps-schema',
+                'aggregation-engine',
+                'dbgps-fetch-rows',
+                'aggregation-workers',
+                'dbgps-rollup-table',
                 'dbreport-host',
                 'dbreport-port',
                 'dbreport-user',
@@ -90,6 +109,11 @@ def default_config():
     config['dbgps-passwd'] = 'postgres'
     config['dbgps-name'] = 'dbgpsname'
     config['dbgps-table'] = 'gpsdata'
+    config['dbgps-schema'] = '1'
+    config['aggregation-engine'] = 'python'
+    config['dbgps-fetch-rows'] = '0'
+    config['aggregation-workers'] = '1'
+    config['dbgps-rollup-table'] = 'gpsrollup'
     config['dbreport-host'] = 'localhost'
     config['dbreport-port'] = '5432'
     config['dbreport-user'] = 'postgres'
@@ -246,21 +270,40 @@ def dbreport_connect():
         raise BaseException(e.message)
     return conn
 
-def dbgps_query(conn, clients):
-    sql = 'SELECT client_name,client_timestamp,client_lat,client_long,event_type '\
-          'FROM {0} WHERE client_timestamp >= {1} AND client_timestamp <= {2} AND '\
-          'CAST(client_lat AS FLOAT) >= {3} AND CAST(client_lat AS FLOAT) <= {4} AND '\
-          'CAST(client_long AS FLOAT) >= {5} AND CAST(client_long AS FLOAT) <= {6} '\
-          'AND client_lat != \'\' AND client_long != \'\''\
-          .format(config['dbgps-table'], date_range[0], date_range[1], adj_boundary[0][0], 
-          adj_boundary[1][0], adj_boundary[1][1], adj_boundary[0][1])
+# Selected columns (latitude, longitude, event type) and the FROM/WHERE part
+# of the GPS data query for the configured schema, over date_range unless
+# another timestamp range is given, and further limited by where if given
+def dbgps_source(clients, tsp_range=None, where=None):
+    if tsp_range is None:
+        tsp_range = date_range
+    if config['dbgps-schema'] == '2':
+        # Typed columns, range scan on (client_name, client_timestamp)
+        cols = ('client_lat', 'client_long', 'event_type')
+        nonempty = ''
+    else:
+        cols = ('CAST(client_lat AS FLOAT)', 'CAST(client_long AS FLOAT)',
+                'CAST(event_type AS INTEGER)')
+        nonempty = ' AND client_lat != \'\' AND client_long != \'\''
+    sql = 'FROM {0} WHERE client_timestamp >= {1} AND client_timestamp <= {2} AND '\
+          '{3} >= {5} AND {3} <= {6} AND {4} >= {7} AND {4} <= {8}{9}'\
+          .format(config['dbgps-table'], tsp_range[0], tsp_range[1], cols[0], cols[1],
+          adj_boundary[0][0], adj_boundary[1][0], adj_boundary[1][1], adj_boundary[0][1],
+          nonempty)
 
     for i in range(0, len(clients)):
         if i == 0:
             sql = sql + ' AND (client_name=\'{0}\''.format(clients[i])
         else:
             sql = sql + ' OR client_name=\'{0}\''.format(clients[i])
-    sql = sql + ') ORDER BY client_name,client_timestamp'
+    sql += ')'
+    if where is not None:
+        sql += ' AND ({0})'.format(where)
+    return cols, sql
+
+def dbgps_query(conn, clients, tsp_range=None):
+    cols, source = dbgps_source(clients, tsp_range)
+    sql = 'SELECT client_name,client_timestamp,client_lat,client_long,event_type '\
+          '{0} ORDER BY client_name,client_timestamp,uid'.format(source)
 
     cur = conn.cursor()
     try:
@@ -271,6 +314,222 @@ def dbgps_query(conn, clients):
     cur.close()
     return ret
 
+# Stream the rows of dbgps_query() through a server-side cursor, a thread
+# fetches the next chunk of dbgps-fetch-rows rows while the current one is
+# processed. count[0] is the number of rows read so far.
+def dbgps_stream(conn, clients, count):
+    cols, source = dbgps_source(clients)
+    sql = 'SELECT client_name,client_timestamp,client_lat,client_long,event_type '\
+          '{0} ORDER BY client_name,client_timestamp,uid'.format(source)
+    size = int(config['dbgps-fetch-rows'])
+    chunks = Queue.Queue(1)
+
+    def fetch():
+        try:
+            cur = conn.cursor('gpsdata_stream')
+            cur.execute(sql)
+            while True:
+                chunk = cur.fetchmany(size)
+                chunks.put(chunk)
+                if len(chunk) == 0:
+                    break
+            cur.close()
+        # Anything ending the thread must reach the reader waiting on chunks
+        except BaseException as e:
+            chunks.put(e)
+
+    t = threading.Thread(target=fetch)
+    t.daemon = True
+    t.start()
+    while True:
+        chunk = chunks.get()
+        if isinstance(chunk, psycopg2.Error):
+            raise BaseException(chunk.message)
+        if isinstance(chunk, BaseException):
+            raise chunk
+        if len(chunk) == 0:
+            break
+        count[0] += len(chunk)
+        for row in chunk:
+            yield row
+    t.join()
+
+# Grid lines accumulated the way get_boxcorner() walks them, so rows on a
+# line land in the same cell as with find_corners(). Longitudes are negated
+# to keep both lists ascending.
+def grid_lines():
+    grid = int(config['grid-size'])
+    step = (grid * LAT_PER_METER, grid * LON_PER_METER)
+    lines = ([ adj_boundary[0][0] ], [ -adj_boundary[0][1] ])
+    x = adj_boundary[0][0]
+    while x < adj_boundary[1][0]:
+        x += step[0]
+        lines[0].append(x)
+    y = adj_boundary[0][1]
+    while y > adj_boundary[1][1]:
+        y -= step[1]
+        lines[1].append(-y)
+    return lines
+
+# Aggregate in the database instead of find_corners(), only per cell counts
+# are returned. Grid cells are found by binary search over the grid lines, and
+# motionless and pruning rules run as window functions over the same row
+# order find_corners() sees, including state carried from one client to the
+# next. Returns the number of rows matched and the list of find_corners().
+def dbgps_aggregate(conn, clients):
+    lines = grid_lines()
+    total, cells = dbgps_cells(conn, clients, lines)
+    return total, cells_result(cells, lines)
+
+# Number of rows matched and the counts of dbgps_aggregate() per cell,
+# { (x, y): [ local, ucast, bcast, mcast, ack ] } with x and y the indexes
+# of the cell's grid lines. cell replaces the SQL expressions of x and y.
+def dbgps_cells(conn, clients, lines, where=None, cell=None):
+    motionless_max = int(config['motionless-max-second'])
+    pruning_inclusion = config['pruning-inclusion'] == 'yes'
+    cols, source = dbgps_source(clients, where=where)
+    if cell is None:
+        cell = 'width_bucket(lat, CAST(%(xlines)s AS FLOAT[])) - 1,'\
+               'width_bucket(-lon, CAST(%(ylines)s AS FLOAT[])) - 1'
+
+    if motionless_max <= 0 and pruning_inclusion:
+        sql = 'WITH q AS (SELECT {0} AS lat,{1} AS lon,{2} AS ev {3}) '\
+              'SELECT {4},ev,COUNT(*) FROM q WHERE ev IN (0,1,2,3,4) GROUP BY 1,2,3 '\
+              'UNION ALL SELECT NULL,NULL,NULL,COUNT(*) FROM q'\
+              .format(cols[0], cols[1], cols[2], source, cell)
+    else:
+        # m: position unchanged since the previous location event and the time
+        # passed, s: runs of unchanged positions, c: motionless counter, p/q: the
+        # last EVENT_ONLINE or EVENT_TIMEOUT seen
+        sql = 'WITH r AS (SELECT client_timestamp AS t,{0} AS lat,{1} AS lon,{2} AS ev,'\
+              'ROW_NUMBER() OVER (ORDER BY client_name,client_timestamp,uid) AS o {3}), '\
+              'm AS (SELECT o,lat = LAG(lat, 1, CAST(0 AS FLOAT)) OVER w AND '\
+              'lon = LAG(lon, 1, CAST(0 AS FLOAT)) OVER w AS same,'\
+              'ABS(t - LAG(t, 1, 0) OVER w) AS dt FROM r WHERE ev IN (0,1,2,3,4) '\
+              'WINDOW w AS (ORDER BY o)), '\
+              's AS (SELECT o,same,dt,SUM(CASE WHEN same THEN 0 ELSE 1 END) OVER (ORDER BY o) '\
+              'AS run FROM m), '\
+              'c AS (SELECT o,SUM(CASE WHEN same THEN dt ELSE 0 END) '\
+              'OVER (PARTITION BY run ORDER BY o) AS still FROM s), '\
+              'p AS (SELECT r.o,lat,lon,ev,still,COUNT(CASE WHEN ev IN ({4},{5}) THEN 1 END) '\
+              'OVER (ORDER BY r.o) AS seg FROM r LEFT JOIN c ON c.o = r.o), '\
+              'q AS (SELECT lat,lon,ev,still,seg,FIRST_VALUE(ev) OVER (PARTITION BY seg ORDER BY o) '\
+              'AS state FROM p) '\
+              'SELECT {6},ev,COUNT(*) FROM q WHERE ev IN (0,1,2,3,4)'\
+              .format(cols[0], cols[1], cols[2], source, EVENT_ONLINE, EVENT_TIMEOUT, cell)
+        if motionless_max > 0:
+            sql += ' AND still < {0}'.format(motionless_max)
+        if pruning_inclusion is False:
+            sql += ' AND NOT (ev = {0} AND seg > 0 AND state = {1})'\
+                   .format(EVENT_LOCAL, EVENT_TIMEOUT)
+        sql += ' GROUP BY 1,2,3 UNION ALL SELECT NULL,NULL,NULL,COUNT(*) FROM r'
+
+    cur = conn.cursor()
+    try:
+        cur.execute(sql, { 'xlines': lines[0], 'ylines': lines[1] })
+    except psycopg2.ProgrammingError as e:
+        raise BaseException(e.message)
+    rows = cur.fetchall()
+    cur.close()
+
+    total = 0
+    cells = {}
+    for row in rows:
+        if row[0] is None:
+            total = int(row[3])
+            continue
+        key = (int(row[0]), int(row[1]))
+        if key not in cells:
+            cells[key] = [ 0, 0, 0, 0, 0 ]
+        cells[key][EVENT_COLUMN[int(row[2])]] += int(row[3])
+
+    return total, cells
+
+# List of find_corners() from the counts of dbgps_cells()
+def cells_result(cells, lines):
+    grid = int(config['grid-size'])
+    step = (grid * LAT_PER_METER, grid * LON_PER_METER)
+    res = []
+    for key in cells:
+        x = lines[0][key[0]]
+        y = -lines[1][key[1]]
+        res.append([ (float('%.6f' % x), float('%.6f' % y)), (x + step[0], y - step[1]) ]
+                   + cells[key])
+    return res
+
+# Aggregate from the hourly rollup of gpsdata_rollup.py, for
+# motionless-max-second 0 and pruning-inclusion yes only. Whole hours of
+# date_range up to the rollup's watermark are summed from the rollup, the
+# rows before the first whole hour, after the last one or past the watermark
+# are counted in the query. Both are binned to base cells the way
+# gpsdata_rollup.py does, and read in one snapshot so no row is counted from
+# both. The grid must start at the rollup's origin and grid-size must be a
+# multiple of its base grid. Returns the number of events counted, as the
+# rollup keeps no other rows.
+def dbgps_rollup(conn, clients):
+    grid = int(config['grid-size'])
+    table = config['dbgps-rollup-table']
+    conn.commit()
+    cur = conn.cursor()
+    try:
+        cur.execute('SET TRANSACTION ISOLATION LEVEL REPEATABLE READ')
+        cur.execute('SELECT last_uid,base_grid,origin_lat,origin_long FROM {0}_state'\
+                    .format(table))
+    except psycopg2.ProgrammingError as e:
+        raise BaseException(e.message)
+    state = cur.fetchone()
+    if state is None:
+        raise BaseException('{0} is empty, run gpsdata_rollup.py first'.format(table))
+    last_uid = int(state[0])
+    base = int(state[1])
+    if grid % base != 0:
+        raise BaseException('grid-size must be a multiple of {0}m for {1}'.format(base, table))
+    if '%.6f,%.6f' % (state[2], state[3]) != '%.6f,%.6f' % tuple(adj_boundary[0]):
+        raise BaseException('corner1 must be {0:.6f},{1:.6f} for {2}'\
+                            .format(state[2], state[3], table))
+    m = grid // base
+    lines = grid_lines()
+    xmax = min(grid_num[0], len(lines[0]) - 1)
+    ymax = min(grid_num[1], len(lines[1]) - 1)
+
+    # Whole hours inside date_range
+    first = (date_range[0] + 3599) // 3600 * 3600
+    last = (date_range[1] + 1) // 3600 * 3600
+    lat_step = base * LAT_PER_METER
+    long_step = base / (111111 * math.cos(math.radians(state[2])))
+    cell = 'CAST(floor(floor((lat - {0!r}) / {2!r} + 1e-6) / {4}) AS INTEGER),'\
+           'CAST(floor(floor(({1!r} - lon) / {3!r} + 1e-6) / {4}) AS INTEGER)'\
+           .format(float(state[2]), float(state[3]), lat_step, long_step, m)
+    total, cells = dbgps_cells(conn, clients, lines,
+                               'uid > {0} OR client_timestamp < {1} OR client_timestamp >= {2}'\
+                               .format(last_uid, first, last), cell)
+
+    sql = 'SELECT cell_lat / {1},cell_long / {1},event_type,SUM(events) FROM {0} '\
+          'WHERE hour >= {2} AND hour < {3} AND cell_lat >= 0 AND cell_long >= 0 '\
+          'AND ({4}) GROUP BY 1,2,3'\
+          .format(table, m, first, last,
+          ' OR '.join('client_name=\'{0}\''.format(c) for c in clients))
+    try:
+        cur.execute(sql)
+    except psycopg2.ProgrammingError as e:
+        raise BaseException(e.message)
+    for row in cur.fetchall():
+        key = (int(row[0]), int(row[1]))
+        if key not in cells:
+            cells[key] = [ 0, 0, 0, 0, 0 ]
+        cells[key][EVENT_COLUMN[int(row[2])]] += int(row[3])
+    cur.close()
+    conn.commit()
+
+    # Cells outside the grid, on both paths alike
+    total = 0
+    for key in cells.keys():
+        if key[0] < 0 or key[0] >= xmax or key[1] < 0 or key[1] >= ymax:
+            del cells[key]
+        else:
+            total += sum(cells[key])
+    return total, cells_result(cells, lines)
+
 # Get next report id from paramater table
 def dbreport_getid(conn):
     sql = 'SELECT MAX(report_id) FROM {0}'.format(config['dbreport-param-table'])
@@ -287,20 +546,24 @@ def dbreport_getid(conn):
         ret = int(res[0][0]) + 1
     return ret
 
-# Insert reporting data to report table
-def dbreport_insertreport(conn, report_id, res):
-    sql = 'INSERT INTO %s VALUES (%i,%i,%f,%f,%f,%f,%i,%i,%i,%i,%i)' % \
-          (config['dbreport-report-table'], report_id,  int(config['grid-size']),
-           res[0][0], res[0][1], res[1][0], res[1][1], res[2], res[3], res[4], res[5], res[6])
+# Insert reporting data to report table, all cells in one COPY
+def dbreport_insertreport(conn, report_id, report):
+    buf = cStringIO.StringIO()
+    grid = int(config['grid-size'])
+    for res in report:
+        buf.write('%i\t%i\t%f\t%f\t%f\t%f\t%i\t%i\t%i\t%i\t%i\n' %
+                  (report_id, grid, res[0][0], res[0][1], res[1][0], res[1][1],
+                   res[2], res[3], res[4], res[5], res[6]))
+    buf.seek(0)
     cur = conn.cursor()
     try:
-        cur.execute(sql)
+        cur.copy_expert('COPY {0} FROM STDIN'.format(config['dbreport-report-table']), buf)
     except psycopg2.ProgrammingError as e:
         raise BaseException(e.message)
     cur.close()
 
 # Insert parameter data to param table
-def dbreport_insertparam(conn, report_id, reused_report_id):
+def dbreport_insertparam(conn, report_id, reused_report_id, clients):
     client_list = ''
     for i in range(len(clients)):
         if i == 0: client_list = clients[0]
@@ -448,181 +711,475 @@ def find_corners(result):
     return res
 
 
+# Same result as find_corners(), computed over whole columns with numpy.
+# Rows are binned by binary search over the grid lines get_boxcorner() walks,
+# and the motionless and pruning rules, whose state runs through all rows in
+# query order, become running sums and running maximums. Rows are taken in
+# chunks of VECTOR_CHUNK, the state is carried from one chunk to the next.
+def find_corners_vector(result):
+    state = vector_state()
+    vector_feed(state, result)
+    return vector_result(state)
+
+def vector_state():
+    grid = int(config['grid-size'])
+    step = (grid * LAT_PER_METER, grid * LON_PER_METER)
+    xs = [ adj_boundary[0][0] ]
+    while xs[-1] < adj_boundary[1][0]:
+        xs.append(xs[-1] + step[0])
+    ys = [ adj_boundary[0][1] ]
+    while ys[-1] > adj_boundary[1][1]:
+        ys.append(ys[-1] - step[1])
+    return {
+        'step': step,
+        'xs': numpy.array(xs),
+        'ys': numpy.array(ys),
+        'prev': (0.0, 0.0, 0),  # Last location event, latitude, longitude, timestamp
+        'motionless': 0,        # Motionless counter at that event
+        'online': True,
+        'boxes': {}             # Box id -> [ corner, counts ]
+    }
+
+def vector_feed(state, result):
+    rows = iter(result)
+    while True:
+        chunk = list(itertools.islice(rows, VECTOR_CHUNK))
+        if len(chunk) == 0:
+            break
+        find_corners_chunk(state, chunk)
+
+# Add counts per box, a box already present keeps the corner it was first seen with
+def vector_merge(state, boxes):
+    for key in boxes:
+        if key not in state['boxes']:
+            state['boxes'][key] = [ boxes[key][0], list(boxes[key][1]) ]
+        else:
+            total = state['boxes'][key][1]
+            for j in range(5):
+                total[j] += boxes[key][1][j]
+
+def vector_result(state):
+    step = state['step']
+    res = []
+    for b in state['boxes'].values():
+        if sum(b[1]) > 0:
+            c = b[0]
+            res.append([ (float('%.6f' % c[0]), float('%.6f' % c[1])),
+                         (c[0] + step[0], c[1] - step[1]) ] + b[1])
+    return res
+
+def find_corners_chunk(state, chunk):
+    motionless_max = int(config['motionless-max-second'])
+    pruning_inclusion = config['pruning-inclusion'] == 'yes'
+    n = len(chunk)
+    tsp = numpy.fromiter((int(row[1]) for row in chunk), numpy.int64, n)
+    lat = numpy.fromiter((float(row[2]) for row in chunk), numpy.float64, n)
+    lon = numpy.fromiter((float(row[3]) for row in chunk), numpy.float64, n)
+    event = numpy.fromiter((int(row[4]) for row in chunk), numpy.int64, n)
+
+    # Positions inside the adjusted boundary
+    keep = ~((lat < adj_boundary[0][0]) | (lon > adj_boundary[0][1]) |
+             (lat > adj_boundary[1][0]) | (lon < adj_boundary[1][1]))
+    tsp, lat, lon, event = tsp[keep], lat[keep], lon[keep], event[keep]
+    reach = numpy.ones(len(event), dtype=bool)
+    index = numpy.arange(len(event))
+
+    # Motionless counter, reset on each move of the location events
+    location = event <= EVENT_ACK
+    if motionless_max > 0 and location.any():
+        pos = numpy.flatnonzero(location)
+        prev = state['prev']
+        prev_lat = numpy.concatenate(([prev[0]], lat[pos][:-1]))
+        prev_lon = numpy.concatenate(([prev[1]], lon[pos][:-1]))
+        prev_tsp = numpy.concatenate(([prev[2]], tsp[pos][:-1]))
+        same = (lat[pos] == prev_lat) & (lon[pos] == prev_lon)
+        passed = numpy.cumsum(numpy.where(same, numpy.abs(tsp[pos] - prev_tsp), 0))
+        reset = numpy.maximum.accumulate(numpy.where(same, -1, numpy.arange(len(pos))))
+        motionless = numpy.where(reset >= 0, passed - passed[numpy.maximum(reset, 0)],
+                                 state['motionless'] + passed)
+        reach[pos[motionless >= motionless_max]] = False
+        state['prev'] = (lat[pos[-1]], lon[pos[-1]], tsp[pos[-1]])
+        state['motionless'] = motionless[-1]
+
+    # Online state of the last EVENT_ONLINE or EVENT_TIMEOUT
+    if pruning_inclusion is False:
+        toggle = (event == EVENT_ONLINE) | (event == EVENT_TIMEOUT)
+        last = numpy.maximum.accumulate(numpy.where(toggle, index, -1))
+        offline = numpy.where(last >= 0, event[numpy.maximum(last, 0)] == EVENT_TIMEOUT,
+                              not state['online'])
+        reach &= ~(offline & (event == EVENT_LOCAL))
+        if len(event) > 0 and last[-1] >= 0:
+            state['online'] = event[last[-1]] == EVENT_ONLINE
+
+    lat, lon, event = lat[reach], lon[reach], event[reach]
+    if len(event) == 0:
+        return
+
+    # Box corner of each row, exactly as get_boxcorner() finds it
+    step, xs, ys = state['step'], state['xs'], state['ys']
+    i = numpy.searchsorted(xs, lat)
+    online = xs[i] == lat
+    cx = numpy.where(online, xs[i], xs[i] - step[0])
+    ix = numpy.where(online, i, i - 1)
+    i = numpy.searchsorted(-ys, -lon)
+    online = ys[i] == lon
+    cy = numpy.where(online, ys[i], ys[i] + step[1])
+    iy = numpy.where(online, i, i - 1)
+
+    # Count per box, columns local, ucast, bcast, mcast, ack
+    box, first, inverse = numpy.unique(ix * len(ys) + iy, return_index=True,
+                                       return_inverse=True)
+    column = numpy.array([ 0, 1, 3, 2, 4 ])
+    location = event <= EVENT_ACK
+    counts = numpy.bincount(inverse[location] * 5 + column[event[location]],
+                            minlength=len(box) * 5).reshape(len(box), 5)
+    boxes = state['boxes']
+    for b in range(len(box)):
+        key = int(box[b])
+        if key not in boxes:
+            # The first row reaching a box sets its corner
+            boxes[key] = [ (float(cx[first[b]]), float(cy[first[b]])), [ 0, 0, 0, 0, 0 ] ]
+        total = boxes[key][1]
+        for j in range(5):
+            total[j] += int(counts[b][j])
+
+# Connection of a worker process, opened once by the pool initializer
+worker_conn = None
+
+def worker_init():
+    global worker_conn
+    worker_conn = dbgps_connect()
+
+# Aggregate one partition, a list of clients and a timestamp range, in a
+# worker process with its own connection. Only the rows before the first
+# change of position depend on the motionless state left by the previous
+# partition, they are returned as they are. The rest is aggregated for both
+# online states the previous partition may end with. Returns the number of
+# rows, those leading rows and per online state the boxes and the state left.
+def aggregate_partition(part):
+    rows = dbgps_query(worker_conn, part[0], part[1])
+    worker_conn.commit()
+    n = len(rows)
+    if n == 0:
+        return 0, [], {}
+
+    lat = numpy.fromiter((float(row[2]) for row in rows), numpy.float64, n)
+    lon = numpy.fromiter((float(row[3]) for row in rows), numpy.float64, n)
+    event = numpy.fromiter((int(row[4]) for row in rows), numpy.int64, n)
+    keep = ~((lat < adj_boundary[0][0]) | (lon > adj_boundary[0][1]) |
+             (lat > adj_boundary[1][0]) | (lon < adj_boundary[1][1]))
+    start = 0
+    prev = (0.0, 0.0, 0)
+    if int(config['motionless-max-second']) > 0:
+        pos = numpy.flatnonzero(keep & (event <= EVENT_ACK))
+        moved = numpy.flatnonzero((lat[pos][1:] != lat[pos][:-1]) |
+                                  (lon[pos][1:] != lon[pos][:-1]))
+        if len(moved) == 0:
+            return n, rows, {}
+        start = pos[moved[0] + 1]
+        i = pos[moved[0]]
+        prev = (float(lat[i]), float(lon[i]), int(rows[i][1]))
+
+    variants = {}
+    for online in ((True, False) if config['pruning-inclusion'] != 'yes' else (True, )):
+        state = vector_state()
+        state['prev'] = prev
+        state['online'] = online
+        vector_feed(state, rows[start:])
+        variants[online] = (state['boxes'], state['prev'], state['motionless'],
+                            state['online'])
+    return n, rows[:start], variants
+
+# Fan the partitions out to aggregation-workers processes and merge their
+# results in query order. Returns the number of rows and the boxes.
+def aggregate_parallel(clients):
+    workers = int(config['aggregation-workers'])
+    # Partition boundaries must follow the query order, so let the database
+    # order the client names
+    conn = dbgps_connect()
+    cur = conn.cursor()
+    try:
+        cur.execute('SELECT column1 FROM (VALUES {0}) AS v ORDER BY column1'.format(
+                    ','.join([ '(\'{0}\')'.format(c) for c in clients ])))
+    except psycopg2.ProgrammingError as e:
+        raise BaseException(e.message)
+    names = [ r[0] for r in cur.fetchall() ]
+    cur.close()
+    conn.close()
+
+    # Each client's range is cut in slices, about four partitions per worker
+    slices = max(1, (4 * workers + len(names) - 1) // len(names))
+    span = date_range[1] - date_range[0] + 1
+    parts = []
+    for c in names:
+        for i in range(slices):
+            first = date_range[0] + span * i // slices
+            last = date_range[0] + span * (i + 1) // slices - 1
+            if first <= last:
+                parts.append(([ c ], (first, last)))
+
+    pool = multiprocessing.Pool(workers, worker_init)
+    total = 0
+    state = vector_state()
+    try:
+        for n, head, variants in pool.imap(aggregate_partition, parts):
+            total += n
+            vector_feed(state, head)
+            if len(variants) > 0:
+                boxes, state['prev'], state['motionless'], state['online'] = \
+                    variants[state['online'] if len(variants) > 1 else True]
+                vector_merge(state, boxes)
+    finally:
+        pool.terminate()
+        pool.join()
+    return total, vector_result(state)
+
+# Run the client-side aggregation engine over rows
+def process_rows(rows):
+    if config['aggregation-engine'] == 'vector':
+        return find_corners_vector(rows)
+    return find_corners(rows)
+
+# Set degrees per meter at corner1 and adjust the boundary to the grid
+def set_grid():
+    global LAT_PER_METER, LON_PER_METER
+    LAT_PER_METER = 0.00001
+    LON_PER_METER = 1 / (111111 * math.cos(math.radians(float(config['corner1-lat']))))
+    adjust_boundary()
+
+# One query for the reports of several clients over the same boundary and
+# time range. The rows are aggregated for all clients together and for each
+# client alone, as separate runs with those clients would. Returns nrows and
+# res of all clients and a dict of the same per client that has rows. Runs
+# the python or the vector engine in this process, rows are streamed when
+# dbgps-fetch-rows is set. The vector engine feeds every chunk to both
+# aggregations, the python engine holds one client's rows at a time.
+def aggregate_clients(conn, clients):
+    engine = config['aggregation-engine']
+    if engine not in ('python', 'vector') or int(config['aggregation-workers']) > 1:
+        raise BaseException('a single pass needs aggregation-engine python or vector '\
+                            'and aggregation-workers 1')
+    if engine == 'vector' and numpy is None:
+        raise BaseException('aggregation-engine vector requires numpy')
+
+    count = [ 0 ]
+    if int(config['dbgps-fetch-rows']) > 0:
+        rows = dbgps_stream(conn, clients, count)
+    else:
+        rows = dbgps_query(conn, clients)
+        count[0] = len(rows)
+
+    per_client = {}
+    if engine == 'vector':
+        state = vector_state()
+        for name, group in itertools.groupby(rows, lambda row: row[0]):
+            client = vector_state()
+            n = 0
+            while True:
+                chunk = list(itertools.islice(group, VECTOR_CHUNK))
+                if len(chunk) == 0:
+                    break
+                n += len(chunk)
+                find_corners_chunk(state, chunk)
+                find_corners_chunk(client, chunk)
+            per_client[name] = (n, vector_result(client))
+        return (count[0], vector_result(state)), per_client
+
+    # Rows pass to the aggregation of all clients once their client is done
+    def split():
+        for name, group in itertools.groupby(rows, lambda row: row[0]):
+            group = list(group)
+            per_client[name] = (len(group), find_corners(group))
+            for row in group:
+                yield row
+    res = find_corners(split())
+    return (count[0], res), per_client
+
+# Record res as a new report of clients, returns its report id
+def record_report(res, clients, reused_report_id=0):
+    conn = dbreport_connect()
+    report_id = dbreport_getid(conn)
+    dbreport_insertreport(conn, report_id, res)
+    dbreport_insertparam(conn, report_id, reused_report_id, clients)
+    conn.commit()
+    conn.close()
+    return report_id
+
+
 # Main routine
+def main():
+    dbgps_conn = []
+    dbreport_conn = []
+    timing = [0, 0]
+    report_id = 0
+    reused_report_id = 0
 
-dbgps_conn = []
-dbreport_conn = []
-timing = [0, 0]
-report_id = 0
-reused_report_id = 0
-
-# Check arguments
-if len(sys.argv) < 2:
-    progname = sys.argv[0]
-    i = progname.rfind('/')
-    if i >= 0:
-            i += 1
-            progname = progname[i:]
-    print 'Usage: {0} <config-file> [report-id]'.format(progname)
-    sys.exit(-1)
-
-# Set default configuration
-default_config()
-# Read configuration
-if read_config(sys.argv[1]) is False:
-    print 'Unable to read configuration file'
-    sys.exit(-1)
-
-if len(sys.argv) >= 3:
-    r = sys.argv[2].isdigit()
-    if r is False:
-        print 'Invalid report ID for reuse'
+    # Check arguments
+    if len(sys.argv) < 2:
+        progname = sys.argv[0]
+        i = progname.rfind('/')
+        if i >= 0:
+                i += 1
+                progname = progname[i:]
+        print 'Usage: {0} <config-file> [report-id]'.format(progname)
+        sys.exit(-1)
+
+    # Set default configuration
+    default_config()
+    # Read configuration
+    if read_config(sys.argv[1]) is False:
+        print 'Unable to read configuration file'
         sys.exit(-1)
-    r = int(sys.argv[2])
+
+    if len(sys.argv) >= 3:
+        r = sys.argv[2].isdigit()
+        if r is False:
+            print 'Invalid report ID for reuse'
+            sys.exit(-1)
+        r = int(sys.argv[2])
+        try:
+            conn = dbreport_connect()
+            dbreport_getparam(conn, r)
+        except BaseException as e:
+            print e
+            sys.exit(-1)
+        reused_report_id = r
+        conn.close()
+        print 'Reusing report ID {0}\n'.format(r)
+
+    if config['aggregation-engine'] == 'vector' and numpy is None:
+        print 'aggregation-engine vector requires numpy'
+        sys.exit(-1)
+
+    if config['aggregation-engine'] == 'rollup' and \
+       (int(config['motionless-max-second']) > 0 or config['pruning-inclusion'] != 'yes'):
+        print 'aggregation-engine rollup requires motionless-max-second 0 and pruning-inclusion yes'
+        sys.exit(-1)
+
+    # Parse client 
+    clients = config['client-devices'].rsplit(',')
+    if len(clients) == 0:
+        print 'No client was defined'
+        sys.exit(-1)
+
+    # Check boundary
     try:
-        conn = dbreport_connect()
-        dbreport_getparam(conn, r)
+        check_boundary()
     except BaseException as e:
-        print e
+        print 'Invalid boundary: ' + e.message
         sys.exit(-1)
-    reused_report_id = r
-    conn.close()
-    print 'Reusing report ID {0}\n'.format(r)
 
-# Parse client 
-clients = config['client-devices'].rsplit(',')
-if len(clients) == 0:
-    print 'No client was defined'
-    sys.exit(-1)
+    # Set latitude and longitude per meter value and adjust boundary to evenly
+    # contain grid boxes
+    set_grid()
+    print 'Boundary: corner1={0},{1}  corner2={2},{3} length={4}m width={5}m'\
+          .format(config['corner1-lat'], config['corner1-long'], 
+          config['corner2-lat'], config['corner2-long'],
+          boundary_len[0], boundary_len[1])
+    print 'Adjusted Boundary: corner1={0},{1}  corner2={2},{3} length={4}m width={5}m'.\
+          format(adj_boundary[0][0], adj_boundary[0][1], adj_boundary[1][0], 
+          adj_boundary[1][1], adj_boundary_len[0], adj_boundary_len[1])
+    print 'Grid Box: size={0}m x={1} y={2} total={3}'.\
+          format(config['grid-size'], grid_num[0], grid_num[1], grid_num[0] * grid_num[1])
 
-# Check boundary
-try:
-    check_boundary()
-except BaseException as e:
-    print 'Invalid boundary: ' + e.message
-    sys.exit(-1)
-
-# Set latitude and longitude per meter value
-LAT_PER_METER = 0.00001
-LON_PER_METER = 1 / (111111 * math.cos(math.radians(float(config['corner1-lat']))))
-
-# Adjust boundary to evenly contains grid boxes
-adjust_boundary()
-print 'Boundary: corner1={0},{1}  corner2={2},{3} length={4}m width={5}m'\
-      .format(config['corner1-lat'], config['corner1-long'], 
-      config['corner2-lat'], config['corner2-long'],
-      boundary_len[0], boundary_len[1])
-print 'Adjusted Boundary: corner1={0},{1}  corner2={2},{3} length={4}m width={5}m'.\
-      format(adj_boundary[0][0], adj_boundary[0][1], adj_boundary[1][0], 
-      adj_boundary[1][1], adj_boundary_len[0], adj_boundary_len[1])
-print 'Grid Box: size={0}m x={1} y={2} total={3}'.\
-      format(config['grid-size'], grid_num[0], grid_num[1], grid_num[0] * grid_num[1])
-
-# Validate date range
-try:
-    check_date()
-except BaseException as e:
-    print 'Invalid date: ' + e.message
-    sys.exit(-1)
+    # Validate date range
+    try:
+        check_date()
+    except BaseException as e:
+        print 'Invalid date: ' + e.message
+        sys.exit(-1)
 
-print 'Time: mode={0} start={1} end={2}'.format(
-      'hours-range' if config['date-range-use'] == 'yes' else 'last-hours',
-      date_range[0], date_range[1])
+    print 'Time: mode={0} start={1} end={2}'.format(
+          'hours-range' if config['date-range-use'] == 'yes' else 'last-hours',
+          date_range[0], date_range[1])
 
-print 'Clients:',
-for c in clients:
-    print c,
-print ''
+    print 'Clients:',
+    for c in clients:
+        print c,
+    print ''
 
-print 'Max. Motionless: {0} second(s)'.format(config['motionless-max-second'])
-print 'Pruning Inclusion: {0}'.format('yes' if config['pruning-inclusion'] == 'yes' else 'no')
-print ''
+    print 'Max. Motionless: {0} second(s)'.format(config['motionless-max-second'])
+    print 'Pruning Inclusion: {0}'.format('yes' if config['pruning-inclusion'] == 'yes' else 'no')
+    print ''
 
-# Connect to GPS data database
-timing[0] = time.time()
-conn = []
-report = []
-rows = []
+    # Connect to GPS data database
+    timing[0] = time.time()
+    conn = []
+    report = []
+    rows = []
 
-try:
-    conn = dbgps_connect()
-except BaseException as e:
-    print e
-    sys.exit(-1)
-
-print 'Running query...',
-sys.stdout.flush()
-try:
-    rows = dbgps_query(conn, clients)
-except BaseException as e:
-    print e
-    sys.exit(-1)
-print 'done {0} row(s)\n'.format(len(rows))
-sys.stdout.flush()
-
-if len(rows) == 0:
-    print 'Empty row\n'
-    sys.exit(1)
-
-print 'Processing...'
-res = find_corners(rows)
-if len(res) == 0:
-    print 'Empty record\n'
-else:
-    idx = 1
-    total = 0
-    for n in res:
-        print '#{0} corner1={1},{2} corner2={3},{4} local={5} ucast={6} bcast={7} '\
-              'mcast={8} ack={9}'.format(idx, n[0][0], n[0][1], n[1][0], n[1][1], 
-              n[2], n[3], n[4], n[5], n[6])
-        for i in range(2, 7):
-            total += n[i]
-        idx += 1
-        # Append to report
-        report.append(n)
-    print 'Total event: {0}\n'.format(total)
-conn.close()
-timing[1] = time.time()
-print 'Total Time: {0} second(s)'.format(round(timing[1] - timing[0], 2))
-
-# Connect to report database and record report
-if (config['record-report'] == 'yes'):
     try:
-        conn = dbreport_connect()
+        conn = dbgps_connect()
     except BaseException as e:
         print e
         sys.exit(-1)
 
-    # Get report id
+    print 'Running query...',
+    sys.stdout.flush()
+    res = None
     try:
-        report_id = dbreport_getid(conn)
+        if config['aggregation-engine'] == 'sql':
+            nrows, res = dbgps_aggregate(conn, clients)
+        elif config['aggregation-engine'] == 'rollup':
+            nrows, res = dbgps_rollup(conn, clients)
+        elif config['aggregation-engine'] == 'vector' and int(config['aggregation-workers']) > 1:
+            nrows, res = aggregate_parallel(clients)
+        elif int(config['dbgps-fetch-rows']) > 0:
+            # Rows are processed while they arrive
+            print 'streaming\n'
+            print 'Processing...',
+            sys.stdout.flush()
+            count = [ 0 ]
+            res = process_rows(dbgps_stream(conn, clients, count))
+            nrows = count[0]
+        else:
+            rows = dbgps_query(conn, clients)
+            nrows = len(rows)
     except BaseException as e:
         print e
         sys.exit(-1)
+    print 'done {0} row(s)\n'.format(nrows)
+    sys.stdout.flush()
 
-    print '\nReport ID:', report_id
+    if nrows == 0:
+        print 'Empty row\n'
+        sys.exit(1)
 
-    # Insert and insert result
-    print 'Inserting report data...',
-    for res in report:
+    if res is None:
+        print 'Processing...'
+        res = process_rows(rows)
+    if len(res) == 0:
+        print 'Empty record\n'
+    else:
+        idx = 1
+        total = 0
+        for n in res:
+            print '#{0} corner1={1},{2} corner2={3},{4} local={5} ucast={6} bcast={7} '\
+                  'mcast={8} ack={9}'.format(idx, n[0][0], n[0][1], n[1][0], n[1][1], 
+                  n[2], n[3], n[4], n[5], n[6])
+            for i in range(2, 7):
+                total += n[i]
+            idx += 1
+            # Append to report
+            report.append(n)
+        print 'Total event: {0}\n'.format(total)
+    conn.close()
+    timing[1] = time.time()
+    print 'Total Time: {0} second(s)'.format(round(timing[1] - timing[0], 2))
+
+    # Connect to report database and record report
+    if (config['record-report'] == 'yes'):
+        print '\nInserting report...',
         try:
-            dbreport_insertreport(conn, report_id, res)
+            report_id = record_report(report, clients, reused_report_id)
         except BaseException as e:
             print e
             sys.exit(-1)
-    print ''
+        print 'Report ID', report_id
+    else:
+        print 'Not recording reports'
 
-    # Insert parameters
-    print 'Inserting report parameters...',
-    try:
-        dbreport_insertparam(conn, report_id, reused_report_id)
-    except BaseException as e:
-        print e
-        sys.exit(-1)
-    conn.commit()
-    conn.close()
-    print ''
-else:
-    print 'Not recording reports'
+    sys.exit(0)
 
-sys.exit(0)
+if __name__ == '__main__':
+    main()
@@ -8,6 +8,7 @@ import sys
 import os
 import time
 import math
+import imp
 import psycopg2
 from datetime import date, timedelta
 
@@ -49,7 +50,8 @@ config_keys = ( 'aggregator-script',
                 'corner1-lat',
                 'corner1-long',
                 'corner2-lat',
-                'corner2-long' )
+                'corner2-long',
+                'analysis-mode' )
 
 aggrconfig_file = '/tmp/gps-analyzer-aggregator.conf'  # File path for the rewritten aggregator configuration
 config = {}  # Configuration dict
@@ -91,6 +93,7 @@ def default_config():
     config['corner1-long'] = '0.00000'
     config['corner2-lat'] = '0.00000'
     config['corner2-long'] = '0.00000'
+    config['analysis-mode'] = 'exec'
 
 # Read configuration
 def read_config(filename):
@@ -198,12 +201,6 @@ def dbreport_getid(conn):
 
 # Compile reports from GPS data table
 def dbreport_getreport(conn, report_id):
-    loc_total = 0
-    ucast_total = 0
-    bcast_total = 0
-    mcast_total = 0
-    ack_total = 0
-
     sql = 'SELECT * FROM {0} WHERE report_id={1}'.\
           format(config['dbreport-report-table'], report_id)
     cur = conn.cursor()
@@ -213,12 +210,23 @@ def dbreport_getreport(conn, report_id):
         raise BaseException(e.message)
     rows = cur.fetchall()
     cur.close()
-    for r in rows:
-        loc_total += int(r[6])
-        ucast_total += int(r[7])
-        bcast_total += int(r[8])
-        mcast_total += int(r[9])
-        ack_total += int(r[10])
+    return report_totals([ r[6:11] for r in rows ])
+
+# Totals and percentages of a report from the counts of its cells,
+# [ local, ucast, bcast, mcast, ack ] each
+def report_totals(cells):
+    loc_total = 0
+    ucast_total = 0
+    bcast_total = 0
+    mcast_total = 0
+    ack_total = 0
+
+    for r in cells:
+        loc_total += int(r[0])
+        ucast_total += int(r[1])
+        bcast_total += int(r[2])
+        mcast_total += int(r[3])
+        ack_total += int(r[4])
     ucast_pct = float(ucast_total) / loc_total * 100
     bcast_pct = float(bcast_total) / loc_total * 100
     mcast_pct = float(mcast_total) / loc_total * 100
@@ -241,7 +249,7 @@ def dbreport_getrollingavg(conn, client_name=''):
         utc1 = int(time.mktime(time.strptime(s1, '%Y-%m-%d %H:%M:%S')) + time.timezone) # Local to UTC
         utc2 = int(time.mktime(time.strptime(s2, '%Y-%m-%d %H:%M:%S')) + time.timezone) # Local to UTC
         # Query unicast total
-        sql = "SELECT event_type FROM {0} WHERE event_type='{1}' OR event_type='{2}'\
+        sql = "SELECT event_type FROM {0} WHERE (event_type='{1}' OR event_type='{2}')\
               AND client_timestamp >= {3} AND client_timestamp <= {4}".\
               format(config['dbgps-table'], EVENT_LOCAL, EVENT_UCAST, utc1, utc2)
         if client_name != '':
@@ -276,7 +284,7 @@ def dbanalysis_connect():
         raise BaseException(e.message)
     return conn
 
-# Insert geographic analysis data
+# Insert geographic analysis data, committed by the caller
 def insert_geoanalysis(conn, report_id, report_data):
     d = date.today() - timedelta(days=int(config['previous-days']), hours=0, minutes=0)
     date_start = d.strftime('%Y-%m-%d 00:00:00')
@@ -293,10 +301,9 @@ def insert_geoanalysis(conn, report_id, report_data):
         cur.execute(sql)
     except psycopg2.ProgrammingError as e:
         raise BaseException(e.message)
-    conn.commit()
     cur.close()
 
-# Insert client analysis data
+# Insert client analysis data, committed by the caller
 def insert_clientanalysis(conn, report_id, client_name, report_data):
     d = date.today() - timedelta(days=int(config['previous-days']), hours=0, minutes=0)
     date_start = d.strftime('%Y-%m-%d 00:00:00')
@@ -312,8 +319,54 @@ def insert_clientanalysis(conn, report_id, client_name, report_data):
         cur.execute(sql)
     except psycopg2.ProgrammingError as e:
         raise BaseException(e.message)
+    cur.close()
+
+# Insert the analysis rows of the run, ( client_name, report_id, report_data )
+# as from aggregate_single_pass(), in one short transaction
+def store_analysis(analysis):
+    conn = dbanalysis_connect()
+    for name, report_id, report_data in analysis:
+        if name is None:
+            insert_geoanalysis(conn, report_id, report_data)
+        else:
+            insert_clientanalysis(conn, report_id, name, report_data)
     conn.commit()
-    cur.close()              
+    conn.close()
+
+# Geographic and client analysis with aggregator.py loaded in this process
+# and one query for all reports, instead of an aggregator.py run per report.
+# Returns ( client_name, report_id, report_data ) for each report with rows,
+# client_name is None for the geographic one.
+def aggregate_single_pass(clients, date_range):
+    aggr = imp.load_source('aggregator', config['aggregator-script'])
+    aggr.default_config()
+    if aggr.read_config(config['aggregator-config']) is False:
+        raise BaseException('Unable to read aggregator configuration file: {0}'\
+                            .format(config['aggregator-config']))
+    aggr.config['date-range-use'] = 'yes'
+    aggr.config['date-range-start'] = date_range[0]
+    aggr.config['date-range-end'] = date_range[1]
+    aggr.check_boundary()
+    aggr.set_grid()
+    aggr.check_date()
+
+    conn = aggr.dbgps_connect()
+    geo, per_client = aggr.aggregate_clients(conn, clients)
+    conn.close()
+
+    reports = []
+    if geo[0] > 0:
+        reports.append(( None, clients, geo[1] ))
+    for c in clients:
+        if c in per_client:
+            reports.append(( c, [ c ], per_client[c][1] ))
+    ret = []
+    for name, report_clients, res in reports:
+        report_id = 0
+        if aggr.config['record-report'] == 'yes':
+            report_id = aggr.record_report(res, report_clients)
+        ret.append(( name, report_id, report_totals([ n[2:7] for n in res ]) ))
+    return ret
 
 
 #
@@ -360,6 +413,9 @@ except BaseException as e:
 # Date range
 date_range = get_daterange()
 
+# Analysis rows of the run, stored together at the end
+analysis = []
+
 # Geographic analysis
 if rewrite_aggrconfig(clients, date_range) is False:
     print 'Unable to write aggregator configuration file'
@@ -368,10 +424,31 @@ if rewrite_aggrconfig(clients, date_range) is False:
 report_date = date.today() - timedelta(days=int(config['previous-days']))
 print 'Report date is {0}'.format(report_date.strftime('%Y-%m-%d'))
 
+# All reports from one pass over the data
+if config['analysis-mode'] == 'single-pass':
+    print 'Running aggregator for geographic and client analysis in a single pass...'
+    try:
+        analysis = aggregate_single_pass(clients, date_range)
+        for name, report_id, report_data in analysis:
+            if name is None:
+                print 'Geographic analysis report ID {0}'.format(report_id)
+            else:
+                print 'Client analysis of {0} report ID {1}'.format(name, report_id)
+        store_analysis(analysis)
+    except BaseException as e:
+        print e
+        sys.exit(-1)
+    sys.exit(0)
+
 exit_status = 0
 pid = os.fork()
 if pid == 0: # Child
-    os.execv(config['aggregator-script'], ( config['aggregator-script'], aggrconfig_file ))
+    try:
+        os.execv(config['aggregator-script'], ( config['aggregator-script'], aggrconfig_file ))
+    except OSError as e:
+        sys.stderr.write('{0}\n'.format(e))
+    # Leave the parent's connections alone
+    os._exit(255)
 else:
     print 'Running aggregator for geographic analysis with PID {0}...\n'.format(pid)
     ret = os.waitpid(pid, 0)
@@ -392,14 +469,7 @@ if exit_status == 0:
     report_data = dbreport_getreport(conn, report_id)
     conn.close()
 
-    # Insert geographic analysis report
-    try:
-        conn = dbanalysis_connect()
-        insert_geoanalysis(conn, report_id, report_data)
-        conn.close()
-    except BaseException as e:
-        print e
-        sys.exit(-1)
+    analysis.append(( None, report_id, report_data ))
 
 
 # Client analysis
@@ -409,7 +479,11 @@ for c in clients:
         sys.exit(-1)
     pid = os.fork()
     if pid == 0: # Child
-        os.execv(config['aggregator-script'], ( config['aggregator-script'], aggrconfig_file ))
+        try:
+            os.execv(config['aggregator-script'], ( config['aggregator-script'], aggrconfig_file ))
+        except OSError as e:
+            sys.stderr.write('{0}\n'.format(e))
+        os._exit(255)
     else:
         print 'Running aggregator for client analysis with PID {0}...\n'.format(pid)
         ret = os.waitpid(pid, 0)
@@ -429,14 +503,13 @@ for c in clients:
                 print e
                 sys.exit(-1)
 
-            # Insert client analysis report
-            try:
-                conn = dbanalysis_connect()
-                insert_clientanalysis(conn, report_id, c, report_data)
-                conn.close()
-            except BaseException as e:
-                print e
-                sys.exit(-1)
+            analysis.append(( c, report_id, report_data ))
         print ''
 
+try:
+    store_analysis(analysis)
+except BaseException as e:
+    print e
+    sys.exit(-1)
+
 sys.exit(0)
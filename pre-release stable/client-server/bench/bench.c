@@ -0,0 +1,413 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+#include "utils.h"
+#include "crc16.h"
+#include "msg.h"
+#include "config.h"
+#include "database.h"
+#include "buffer.h"
+
+/*
+ * Microbenchmarks of the message hot paths. Every benchmark runs in
+ * batches calibrated to take about BENCH_TARGET ms, the fastest of
+ * BENCH_REPEAT batches is reported so one-off preemption does not show.
+ *
+ * Output is one row per benchmark, the columns keep their order and
+ * meaning between commits:
+ *   label,name,iterations,ns_per_op,cycles_per_op,allocs_per_op,bytes_per_op
+ * cycles_per_op is -1 where no cycle counter is available. Allocations
+ * are the malloc, calloc and realloc calls made by the repository code
+ * (they are wrapped at link time), libc internals are not seen.
+ */
+
+#define BENCH_TARGET 200        /* ms per batch */
+#define BENCH_REPEAT 5
+
+struct bench {
+	const char *name;
+	int (*setup)(void);     /* Returns 0 to skip the benchmark */
+	void (*run)(unsigned long n);
+};
+
+struct bench_result {
+	unsigned long iterations;
+	double ns;
+	double cycles;
+	double allocs;
+	double bytes;
+};
+
+/* Allocation counters, updated by the buffer thread too */
+static unsigned long long alloc_calls, alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, nmemb * size, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+static volatile int result;
+static struct tgr_msg tgr;
+static struct ack_msg ack;
+static struct ctl_msg ctl;
+static struct db_data dbdata;
+static char bufdir[] = "/tmp/gpsbenchXXXXXX";
+
+static int msg_setup(void)
+{
+	memset(&tgr, 0, sizeof(tgr));
+	tgr.tsp = time(NULL);
+	msgtgr_init(&tgr);
+	memset(&ack, 0, sizeof(ack));
+	snprintf(ack.name, sizeof(ack.name), "bench");
+	snprintf(ack.latitude, sizeof(ack.latitude), "%f", 40.637512);
+	snprintf(ack.longitude, sizeof(ack.longitude), "%f", -89.477031);
+	ack.tsp = time(NULL);
+	msgack_init(&ack);
+	memset(&ctl, 0, sizeof(ctl));
+	snprintf(ctl.name, sizeof(ctl.name), "bench");
+	ctl.ctl = CTL_CLIENT_ONLINE;
+	ctl.uport = ctl.mport = ctl.bport = 6000;
+	msgctl_init(&ctl);
+	return 1;
+}
+
+static void run_crc16_tgr(unsigned long n)
+{
+	while (n--)
+		result = crc16(0, (char*) &tgr + 4, sizeof(tgr) - 4);
+}
+
+static void run_crc16_ack(unsigned long n)
+{
+	while (n--)
+		result = crc16(0, (char*) &ack + 4, sizeof(ack) - 4);
+}
+
+static void run_msgtgr_init(unsigned long n)
+{
+	while (n--)
+		msgtgr_init(&tgr);
+}
+
+static void run_msgtgr_check(unsigned long n)
+{
+	while (n--)
+		result = msgtgr_check(&tgr);
+}
+
+static void run_msgack_init(unsigned long n)
+{
+	while (n--)
+		msgack_init(&ack);
+}
+
+static void run_msgack_check(unsigned long n)
+{
+	while (n--)
+		result = msgack_check(&ack);
+}
+
+/* Byte order helpers are timed as hton plus ntoh, the message is unchanged */
+static void run_msgtgr_order(unsigned long n)
+{
+	while (n--) {
+		msgtgr_hton(&tgr);
+		msgtgr_ntoh(&tgr);
+	}
+}
+
+static void run_msgack_order(unsigned long n)
+{
+	while (n--) {
+		msgack_hton(&ack);
+		msgack_ntoh(&ack);
+	}
+}
+
+static void run_msgctl_order(unsigned long n)
+{
+	while (n--) {
+		msgctl_hton(&ctl);
+		msgctl_ntoh(&ctl);
+	}
+}
+
+/* debug() with stderr on /dev/null, formatting and the write are measured */
+static void run_debug(unsigned long n)
+{
+	int fd, null;
+
+	fflush(stderr);
+	fd = dup(STDERR_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	dup2(null, STDERR_FILENO);
+	close(null);
+	while (n--)
+		debug(DEBUG_INFO, "recvd ACK msg client='%s' lat=%s lon=%s tsp=%u addr=%s fd=%i",
+		      ack.name, ack.latitude, ack.longitude, ack.tsp, "127.0.0.1", 5);
+	fflush(stderr);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+}
+
+/*
+ * buffer_insert() with the null sink behind it, the buffer thread uploads
+ * concurrently like in gpsclient. Records spill to the SQLite buffer when
+ * the ring runs over its threshold, that cost is part of the figure.
+ */
+static int buffer_setup(void)
+{
+	if (!mkdtemp(bufdir)) {
+		debug(DEBUG_ERROR, "mkdtemp: %s", strerror(errno));
+		return 0;
+	}
+	memset(&config, 0, sizeof(config));
+	snprintf(config.client_name, sizeof(config.client_name), "bench");
+	snprintf(config.db_tabledata, sizeof(config.db_tabledata), "gpsdata");
+	snprintf(config.sink_type, sizeof(config.sink_type), "null");
+	snprintf(config.buffer_backend, sizeof(config.buffer_backend), "sqlite");
+	snprintf(config.buffer_file, sizeof(config.buffer_file), "%s/buffer.db", bufdir);
+	config.buffer_interval = 10;
+	config.buffer_ring_size = 4096;
+	config.buffer_ring_threshold = 4096;
+	if (!buffer_init())
+		return 0;
+	/* Let the buffer thread connect to the sink */
+	msleep(100);
+
+	memset(&dbdata, 0, sizeof(dbdata));
+	snprintf(dbdata.client_name, sizeof(dbdata.client_name), "bench");
+	snprintf(dbdata.client_ip, sizeof(dbdata.client_ip), "0.0.0.0");
+	snprintf(dbdata.sender_ip, sizeof(dbdata.sender_ip), "127.0.0.1");
+	dbdata.gps_tsp = time(NULL);
+	dbdata.gps_lat = 40.637512;
+	dbdata.gps_lon = -89.477031;
+	dbdata.packet_type = CONFIG_UCAST;
+	return 1;
+}
+
+static void run_buffer_insert(unsigned long n)
+{
+	while (n--)
+		result = buffer_insert(&dbdata);
+}
+
+static void buffer_teardown(void)
+{
+	char path[300];
+
+	buffer_stop();
+	snprintf(path, sizeof(path), "%s/buffer.db", bufdir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/buffer.db.seq", bufdir);
+	unlink(path);
+	rmdir(bufdir);
+}
+
+static const struct bench benches[] = {
+	{ "crc16_tgr", msg_setup, run_crc16_tgr },
+	{ "crc16_ack", msg_setup, run_crc16_ack },
+	{ "msgtgr_init", msg_setup, run_msgtgr_init },
+	{ "msgtgr_check", msg_setup, run_msgtgr_check },
+	{ "msgack_init", msg_setup, run_msgack_init },
+	{ "msgack_check", msg_setup, run_msgack_check },
+	{ "msgtgr_hton_ntoh", msg_setup, run_msgtgr_order },
+	{ "msgack_hton_ntoh", msg_setup, run_msgack_order },
+	{ "msgctl_hton_ntoh", msg_setup, run_msgctl_order },
+	{ "debug", msg_setup, run_debug },
+	{ "buffer_insert", buffer_setup, run_buffer_insert },
+	{ NULL, NULL, NULL }
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long cycles(void)
+{
+#ifdef BENCH_HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* One batch of n iterations */
+static void batch(const struct bench *b,
+		  unsigned long n,
+		  struct bench_result *r)
+{
+	unsigned long long c0, c1, a0, b0;
+	double t0, t1;
+
+	a0 = __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED);
+	b0 = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+	t0 = now_ns();
+	c0 = cycles();
+	b->run(n);
+	c1 = cycles();
+	t1 = now_ns();
+	r->iterations = n;
+	r->ns = (t1 - t0) / n;
+#ifdef BENCH_HAVE_TSC
+	r->cycles = (double) (c1 - c0) / n;
+#else
+	r->cycles = -1;
+#endif
+	r->allocs = (double) (__atomic_load_n(&alloc_calls, __ATOMIC_RELAXED) - a0) / n;
+	r->bytes = (double) (__atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - b0) / n;
+}
+
+static void measure(const struct bench *b,
+		    double target,
+		    struct bench_result *best)
+{
+	struct bench_result r;
+	unsigned long n;
+	int i;
+
+	/* Grow the batch until it is long enough to scale from */
+	for (n = 1; ; n *= 2) {
+		batch(b, n, &r);
+		if (r.ns * n >= target * 1e6 / 10 || n >= 1UL << 40)
+			break;
+	}
+	n = target * 1e6 / (r.ns > 0 ? r.ns : 1);
+	if (n < 1)
+		n = 1;
+
+	for (i = 0; i < BENCH_REPEAT; i++) {
+		batch(b, n, &r);
+		if (!i || r.ns < best->ns)
+			*best = r;
+	}
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [options] [benchmark]...\n"
+		"  -f format   csv or json (csv)\n"
+		"  -l label    first column of every row, e.g. a commit id\n"
+		"  -t ms       time per batch (%i)\n"
+		"  -L          list benchmarks\n", progname, BENCH_TARGET);
+	exit(EXIT_FAILURE);
+}
+
+static int selected(const char *name,
+		    int argc,
+		    char **argv)
+{
+	int i;
+
+	if (optind == argc)
+		return 1;
+	for (i = optind; i < argc; i++)
+		if (!strcmp(argv[i], name))
+			return 1;
+	return 0;
+}
+
+int main(int argc,
+	 char **argv)
+{
+	const struct bench *b;
+	struct bench_result r;
+	const char *label = "";
+	double target = BENCH_TARGET;
+	int opt, json = 0, rows = 0, buffered = 0;
+	char *progname, *tmp;
+
+	progname = argv[0];
+	if ((tmp = strstr(argv[0], "/")))
+		progname = ++tmp;
+
+	while ((opt = getopt(argc, argv, "f:l:t:Lh")) != -1) {
+		switch (opt) {
+			case 'f':
+				if (!strcmp(optarg, "json"))
+					json = 1;
+				else if (strcmp(optarg, "csv"))
+					usage(progname);
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			case 't':
+				target = atof(optarg);
+				if (target <= 0)
+					usage(progname);
+				break;
+			case 'L':
+				for (b = benches; b->name; b++)
+					printf("%s\n", b->name);
+				exit(EXIT_SUCCESS);
+			default:
+				usage(progname);
+		}
+	}
+
+	if (json)
+		printf("{\"label\":\"%s\",\"benchmarks\":[\n", label);
+	else
+		printf("label,name,iterations,ns_per_op,cycles_per_op,allocs_per_op,bytes_per_op\n");
+	for (b = benches; b->name; b++) {
+		if (!selected(b->name, argc, argv))
+			continue;
+		if (!b->setup()) {
+			debug(DEBUG_WARNING, "%s: setup failed, skipped", b->name);
+			continue;
+		}
+		if (b->setup == buffer_setup)
+			buffered = 1;
+		measure(b, target, &r);
+		if (json)
+			printf("%s{\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.3f,"
+			       "\"cycles_per_op\":%.1f,\"allocs_per_op\":%.4f,\"bytes_per_op\":%.1f}",
+			       rows ? ",\n" : "", b->name, r.iterations, r.ns, r.cycles,
+			       r.allocs, r.bytes);
+		else
+			printf("%s,%s,%lu,%.3f,%.1f,%.4f,%.1f\n", label, b->name, r.iterations,
+			       r.ns, r.cycles, r.allocs, r.bytes);
+		fflush(stdout);
+		rows++;
+	}
+	if (json)
+		printf("\n]}\n");
+	if (buffered)
+		buffer_teardown();
+	exit(EXIT_SUCCESS);
+}
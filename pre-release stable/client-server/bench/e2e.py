@@ -0,0 +1,219 @@
+#!/usr/bin/env python
+"""
+End-to-end latency of the TGR -> ACK -> storage path on loopback.
+
+Starts gpsserver with trace-file enabled and the chosen sink, drives it
+with gpsswarm for a fixed time and breaks every trigger cycle into stages:
+
+  deliver   server sends TGR        -> client receives it
+  client    client receives TGR     -> client sends ACK
+  return    client sends ACK        -> server has read it
+  store     server has read ACK     -> storage commit
+  total     server sends TGR        -> storage commit
+
+Both processes stamp events with CLOCK_REALTIME. Events are matched per
+client: an ACK belongs to the latest TGR sent to that client before it,
+and a commit line covers the oldest ACKs not yet committed. A drop line
+does not tell which ACKs were discarded, so all ACKs pending at that point
+are left out. Cycles missing a stage (lost ACKs, dropped rows, shutdown)
+are counted but left out.
+
+Usage: e2e.py [options], see --help. Runs on Python 2.7 and 3.
+"""
+
+from __future__ import print_function
+
+import json
+import optparse
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+STAGES = ['deliver', 'client', 'return', 'store', 'total']
+
+# Keys written by the harness, the rest may come from --base-conf
+SERVER_KEYS = ['control-port', 'unicast-enable', 'broadcast-enable', 'multicast-enable',
+               'clientport-enable', 'packet-interval', 'prune-interval', 'sink-type',
+               'sink-path', 'trace-file', 'logfile-path', 'daemonize-enable']
+
+
+def parse_options():
+    here = os.path.dirname(os.path.abspath(__file__))
+    p = optparse.OptionParser()
+    p.add_option('--server', default=os.path.join(here, '..', 'gpsserver', 'gpsserver'),
+                 help='gpsserver binary')
+    p.add_option('--swarm', default=os.path.join(here, '..', 'gpsswarm', 'gpsswarm'),
+                 help='gpsswarm binary')
+    p.add_option('--base-conf', help='gpsserver.conf to take other keys from, e.g. db-*')
+    p.add_option('-n', '--clients', type='int', default=50)
+    p.add_option('-t', '--duration', type='float', default=20, help='seconds')
+    p.add_option('-I', '--interval', type='int', default=1000, help='packet-interval ms')
+    p.add_option('-s', '--sink', default='file', help='pgsql, sqlite, file or null')
+    p.add_option('-d', '--delay', default='0', help='ACK delay of the clients, ms[:ms]')
+    p.add_option('-c', '--ctl-port', type='int', default=15500)
+    p.add_option('-b', '--base-port', type='int', default=21000)
+    p.add_option('-w', '--workdir', help='keep traces and logs here')
+    p.add_option('-j', '--json', action='store_true', help='print results as JSON')
+    opts, args = p.parse_args()
+    if args:
+        p.error('unexpected arguments')
+    return opts
+
+
+def write_config(opts, path, workdir):
+    lines = ['db-table gpsdata']
+    if opts.base_conf:
+        for line in open(opts.base_conf):
+            key = line.split(None, 1)[0] if line.strip() else ''
+            if key and not key.startswith('#') and key not in SERVER_KEYS:
+                lines.append(line.rstrip('\n'))
+    lines += ['control-port %i' % opts.ctl_port,
+              'unicast-enable yes',
+              'broadcast-enable no',
+              'multicast-enable no',
+              'clientport-enable yes',
+              'packet-interval %i' % opts.interval,
+              'prune-interval %i' % max(3 * opts.interval, 5000),
+              'sink-type %s' % opts.sink,
+              'sink-path %s' % os.path.join(workdir, 'sink'),
+              'trace-file %s' % os.path.join(workdir, 'server.trace'),
+              'logfile-path %s' % os.path.join(workdir, 'server.log'),
+              'daemonize-enable no']
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+def run(opts, workdir):
+    conf = os.path.join(workdir, 'gpsserver.conf')
+    write_config(opts, conf, workdir)
+    with open(os.path.join(workdir, 'server.log'), 'w') as log:
+        server = subprocess.Popen([opts.server, conf], stdout=log, stderr=log)
+    try:
+        time.sleep(0.5)
+        if server.poll() is not None:
+            sys.exit('gpsserver exited, see %s' % os.path.join(workdir, 'server.log'))
+        with open(os.path.join(workdir, 'swarm.log'), 'w') as log:
+            ret = subprocess.call([opts.swarm, '-c', str(opts.ctl_port),
+                                   '-n', str(opts.clients), '-b', str(opts.base_port),
+                                   '-I', str(opts.interval), '-d', opts.delay,
+                                   '-t', str(opts.duration), '-i', str(opts.duration),
+                                   '-T', os.path.join(workdir, 'swarm.trace')],
+                                  stdout=log, stderr=log)
+        if ret != 0:
+            sys.exit('gpsswarm failed, see %s' % os.path.join(workdir, 'swarm.log'))
+        # Server flushes its trace once per select round
+        time.sleep(1.5)
+    finally:
+        if server.poll() is None:
+            server.send_signal(signal.SIGTERM)
+            server.wait()
+
+
+def read_trace(path):
+    for line in open(path):
+        parts = line.split()
+        if len(parts) == 3:
+            yield int(parts[0]), parts[1], parts[2]
+
+
+def analyze(workdir):
+    events = {}          # client -> [(ns, event, record)]
+    pending = []         # ACKs read by the server and not committed yet
+    skip = 0             # Of the ACKs still to commit, left out at a drop
+
+    for ns, event, name in read_trace(os.path.join(workdir, 'server.trace')):
+        if event == 'drop':
+            skip += len(pending) - int(name)
+            pending = []
+            continue
+        if event == 'commit':
+            n = int(name)
+            k = min(skip, n)
+            skip -= k
+            for rec in pending[:n - k]:
+                rec['commit'] = ns
+            pending = pending[n - k:]
+            continue
+        rec = {}
+        if event == 'ack_recv':
+            pending.append(rec)
+        events.setdefault(name, []).append((ns, event, rec))
+    for ns, event, name in read_trace(os.path.join(workdir, 'swarm.trace')):
+        events.setdefault(name, []).append((ns, event, None))
+
+    samples = dict((s, []) for s in STAGES)
+    cycles = incomplete = 0
+    for name, evs in events.items():
+        evs.sort(key=lambda e: e[0])
+        cycle = None
+        for ns, event, rec in evs:
+            if event == 'tgr_send':
+                if cycle is not None:
+                    incomplete += 1
+                cycle = {'tgr_send': ns}
+                cycles += 1
+            elif cycle is None or event in cycle:
+                continue
+            elif event == 'ack_recv':
+                cycle[event] = ns
+                if 'commit' in rec and len(cycle) == 4:
+                    c = cycle
+                    samples['deliver'].append(c['tgr_recv'] - c['tgr_send'])
+                    samples['client'].append(c['ack_send'] - c['tgr_recv'])
+                    samples['return'].append(c['ack_recv'] - c['ack_send'])
+                    samples['store'].append(rec['commit'] - c['ack_recv'])
+                    samples['total'].append(rec['commit'] - c['tgr_send'])
+                else:
+                    incomplete += 1
+                cycle = None
+            else:
+                cycle[event] = ns
+        if cycle is not None:
+            incomplete += 1
+    return samples, cycles, incomplete
+
+
+def percentile(v, p):
+    return v[int(p * (len(v) - 1) + 0.5)] / 1e6 if v else float('nan')
+
+
+def report(opts, samples, cycles, incomplete):
+    result = {'clients': opts.clients, 'duration': opts.duration,
+              'interval': opts.interval, 'sink': opts.sink,
+              'cycles': cycles, 'incomplete': incomplete, 'stages': {}}
+    for s in STAGES:
+        v = sorted(samples[s])
+        result['stages'][s] = dict(n=len(v), p50=percentile(v, 0.5), p90=percentile(v, 0.9),
+                                   p99=percentile(v, 0.99), max=percentile(v, 1.0))
+    if opts.json:
+        print(json.dumps(result, sort_keys=True))
+        return
+    print('clients=%i duration=%gs interval=%ims sink=%s cycles=%i incomplete=%i' %
+          (opts.clients, opts.duration, opts.interval, opts.sink, cycles, incomplete))
+    print('%-8s %8s %10s %10s %10s %10s' % ('stage ms', 'n', 'p50', 'p90', 'p99', 'max'))
+    for s in STAGES:
+        r = result['stages'][s]
+        print('%-8s %8i %10.3f %10.3f %10.3f %10.3f' %
+              (s, r['n'], r['p50'], r['p90'], r['p99'], r['max']))
+
+
+def main():
+    opts = parse_options()
+    workdir = opts.workdir or tempfile.mkdtemp(prefix='gpse2e')
+    if not os.path.isdir(workdir):
+        os.makedirs(workdir)
+    try:
+        run(opts, workdir)
+        samples, cycles, incomplete = analyze(workdir)
+        report(opts, samples, cycles, incomplete)
+    finally:
+        if not opts.workdir:
+            shutil.rmtree(workdir, True)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,3 +1,5 @@
+-- Schema v1, see database_v2.sql for new deployments and gpsdata_migrate.py
+-- for converting an existing table.
 CREATE TABLE gpsdata (
 	uid SERIAL PRIMARY KEY,    -- unique id
 	client_name VARCHAR(100),  -- client name
@@ -6,9 +8,15 @@ CREATE TABLE gpsdata (
 	client_timestamp INTEGER,  -- gps timestamp
 	client_lat VARCHAR(16),    -- gps latitude
 	client_long VARCHAR(16),   -- gps longitude
-	event_type CHAR            -- type of packet
+	event_type CHAR,           -- type of packet
+	client_seq BIGINT          -- client sequence number, NULL for server events
 );
 
+-- Uploads from gpsclient are retried with ON CONFLICT DO NOTHING against
+-- this key. On existing databases run:
+--   ALTER TABLE gpsdata ADD COLUMN client_seq BIGINT;
+CREATE UNIQUE INDEX gpsdata_client_seq ON gpsdata(client_name, client_seq);
+
 CREATE TABLE gpsclientcfg (
 	client_name VARCHAR(16),      -- client name
 	unicast_port INTEGER,         -- unicast port
@@ -0,0 +1,129 @@
+-- Schema v2 with gpsdata range partitioned on client_timestamp, one
+-- partition per day or per week. Queries with a client_timestamp range
+-- only scan the partitions it covers, and old data is removed by
+-- detaching or dropping whole partitions.
+--
+-- Partitions are created ahead of time by gpsdata_create_partitions(),
+-- run it daily, e.g. from cron with gpsdata_partitions.py. Rows outside
+-- all partitions go to gpsdata_default and are moved to their partition
+-- when it is created. Stick to one unit, day and week ranges overlap.
+--
+-- Unique keys of a partitioned table must contain the partition key, so
+-- client_timestamp is part of the primary key and of the client_seq key.
+-- Retried uploads resend the same timestamp, ON CONFLICT DO NOTHING still
+-- catches them. Requires PostgreSQL 11 or later.
+--
+-- To convert an existing table, create the table, its indexes and default
+-- partition below as gpsdata_v2 (the functions take the table name), add
+-- the past partitions with
+--   SELECT gpsdata_create_partitions(p_table => 'gpsdata_v2', p_from => '<oldest row>');
+-- and run gpsdata_migrate.py --swap.
+CREATE TABLE gpsdata (
+	uid SERIAL,                     -- unique id
+	client_name VARCHAR(100),       -- client name
+	client_ip INET,                 -- client ip address
+	sender_ip INET,                 -- sender ip address
+	client_timestamp INTEGER,       -- gps timestamp
+	client_lat DOUBLE PRECISION,    -- gps latitude, packet interval for EVENT_ONLINE
+	client_long DOUBLE PRECISION,   -- gps longitude
+	event_type SMALLINT,            -- type of packet
+	client_seq BIGINT,              -- client sequence number, NULL for server events
+	PRIMARY KEY(uid, client_timestamp)
+) PARTITION BY RANGE (client_timestamp);
+
+CREATE UNIQUE INDEX gpsdata_client_seq ON gpsdata(client_name, client_seq, client_timestamp);
+-- Per client tracks, aggregator.py and analyzer.py
+CREATE INDEX gpsdata_client_tsp ON gpsdata(client_name, client_timestamp);
+-- Rows arrive in time order, a BRIN index is a few pages per partition
+CREATE INDEX gpsdata_tsp ON gpsdata USING brin(client_timestamp);
+
+CREATE TABLE gpsdata_default PARTITION OF gpsdata DEFAULT;
+
+-- Create the partitions from p_from up to now() + p_ahead, p_unit is 'day'
+-- or 'week' (UTC). Returns the number of partitions created.
+CREATE OR REPLACE FUNCTION gpsdata_create_partitions(p_ahead INTERVAL DEFAULT '7 days',
+						     p_unit TEXT DEFAULT 'day',
+						     p_table TEXT DEFAULT 'gpsdata',
+						     p_from TIMESTAMPTZ DEFAULT now())
+RETURNS INTEGER AS $$
+DECLARE
+	step INTERVAL;
+	t TIMESTAMP;
+	lo BIGINT;
+	hi BIGINT;
+	part TEXT;
+	created INTEGER := 0;
+BEGIN
+	IF p_unit NOT IN ('day', 'week') THEN
+		RAISE EXCEPTION 'unit must be day or week, not %', p_unit;
+	END IF;
+	step := ('1 ' || p_unit)::INTERVAL;
+	t := date_trunc(p_unit, p_from AT TIME ZONE 'UTC');
+	WHILE t < (now() + p_ahead) AT TIME ZONE 'UTC' LOOP
+		lo := extract(epoch FROM t);
+		hi := extract(epoch FROM t + step);
+		part := format('%s_p%s', p_table, to_char(t, 'YYYYMMDD'));
+		IF to_regclass(part) IS NULL THEN
+			EXECUTE format('CREATE TABLE %I (LIKE %I INCLUDING DEFAULTS)', part, p_table);
+			-- Attaching fails while the default partition holds rows of the range
+			IF to_regclass(p_table || '_default') IS NOT NULL THEN
+				EXECUTE format('WITH moved AS (DELETE FROM %I WHERE client_timestamp >= %s '
+					       'AND client_timestamp < %s RETURNING *) '
+					       'INSERT INTO %I SELECT * FROM moved',
+					       p_table || '_default', lo, hi, part);
+			END IF;
+			EXECUTE format('ALTER TABLE %I ATTACH PARTITION %I FOR VALUES FROM (%s) TO (%s)',
+				       p_table, part, lo, hi);
+			created := created + 1;
+		END IF;
+		t := t + step;
+	END LOOP;
+	RETURN created;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Detach the partitions that end before now() - p_keep and drop them
+-- unless p_drop is false, detached tables can then be archived. Returns
+-- the number of partitions removed.
+CREATE OR REPLACE FUNCTION gpsdata_drop_partitions(p_keep INTERVAL,
+						   p_drop BOOLEAN DEFAULT true,
+						   p_table TEXT DEFAULT 'gpsdata')
+RETURNS INTEGER AS $$
+DECLARE
+	r RECORD;
+	cutoff BIGINT := extract(epoch FROM now() - p_keep);
+	removed INTEGER := 0;
+BEGIN
+	FOR r IN
+		SELECT c.relname,
+		       substring(pg_get_expr(c.relpartbound, c.oid) FROM 'TO \((-?[0-9]+)\)')::BIGINT AS hi
+		FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid
+		WHERE i.inhparent = p_table::regclass
+	LOOP
+		-- The default partition has no bound
+		CONTINUE WHEN r.hi IS NULL OR r.hi > cutoff;
+		EXECUTE format('ALTER TABLE %I DETACH PARTITION %I', p_table, r.relname);
+		IF p_drop THEN
+			EXECUTE format('DROP TABLE %I', r.relname);
+		END IF;
+		removed := removed + 1;
+	END LOOP;
+	RETURN removed;
+END;
+$$ LANGUAGE plpgsql;
+
+SELECT gpsdata_create_partitions();
+
+CREATE TABLE gpsclientcfg (
+	client_name VARCHAR(16),      -- client name
+	unicast_port INTEGER,         -- unicast port
+	multicast_port INTEGER,       -- multicast port
+	multicast_group VARCHAR(15),  -- multicast group
+	broadcast_port INTEGER,       -- broadcast port
+	packet_validation CHAR,       -- packet validation
+	location_writeival INTEGER,   -- location write interval
+	server_host VARCHAR(255),     -- server host
+	server_ctlport INTEGER,       -- server control port
+	server_retryival INTEGER,     -- server retry interval
+	PRIMARY KEY(client_name)
+);
@@ -0,0 +1,36 @@
+-- Schema v2: typed columns and indexes for the aggregator's range scans.
+-- Existing v1 tables are converted online with gpsdata_migrate.py.
+-- gpsdata_rollup.py keeps the hourly rollup of aggregation-engine rollup.
+CREATE TABLE gpsdata (
+	uid SERIAL PRIMARY KEY,         -- unique id
+	client_name VARCHAR(100),       -- client name
+	client_ip INET,                 -- client ip address
+	sender_ip INET,                 -- sender ip address
+	client_timestamp INTEGER,       -- gps timestamp
+	client_lat DOUBLE PRECISION,    -- gps latitude, packet interval for EVENT_ONLINE
+	client_long DOUBLE PRECISION,   -- gps longitude
+	event_type SMALLINT,            -- type of packet
+	client_seq BIGINT               -- client sequence number, NULL for server events
+);
+
+-- Uploads from gpsclient are retried with ON CONFLICT DO NOTHING against
+-- this key.
+CREATE UNIQUE INDEX gpsdata_client_seq ON gpsdata(client_name, client_seq);
+-- Per client tracks, aggregator.py and analyzer.py
+CREATE INDEX gpsdata_client_tsp ON gpsdata(client_name, client_timestamp);
+-- Time range over all clients
+CREATE INDEX gpsdata_tsp ON gpsdata(client_timestamp);
+
+CREATE TABLE gpsclientcfg (
+	client_name VARCHAR(16),      -- client name
+	unicast_port INTEGER,         -- unicast port
+	multicast_port INTEGER,       -- multicast port
+	multicast_group VARCHAR(15),  -- multicast group
+	broadcast_port INTEGER,       -- broadcast port
+	packet_validation CHAR,       -- packet validation
+	location_writeival INTEGER,   -- location write interval
+	server_host VARCHAR(255),     -- server host
+	server_ctlport INTEGER,       -- server control port
+	server_retryival INTEGER,     -- server retry interval
+	PRIMARY KEY(client_name)
+);
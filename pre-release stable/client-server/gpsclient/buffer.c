@@ -1,6 +1,9 @@
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,20 +12,75 @@
 #include "config.h"
 #include "database.h"
 #include "utils.h"
+#include "buffer.h"
+#include "ring.h"
+#include "seglog.h"
 
 static sqlite3 *bufdb;
+static struct ring bufring;
+static unsigned long long seq_next;
+static unsigned long long seq_limit;
+static int seqfd = -1;
+static pthread_mutex_t seqmutex = PTHREAD_MUTEX_INITIALIZER;
+static int uplink = 0;
+static int spilled = 1;  /* Buffer file may hold records from a previous run */
 static int bufrun = 0;
 static pthread_t bufthread;
 static pthread_mutex_t bufmutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t condmutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t bufcond = PTHREAD_COND_INITIALIZER;
+static int cfgfd = -1;   /* Signaled when a requested config read is done */
+static int cfgreq = 0;
+static int cfgret;       /* db_getcfg() result and config, under bufmutex */
+static struct db_config cfgnew;
 
-static int buffer_delete(unsigned uid)
+static int bufdb_open(void)
+{
+	int ret;
+	const char *cmd;
+
+	ret = sqlite3_open(config.buffer_file, &bufdb);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not open buffer file: %s", sqlite3_errmsg(bufdb));
+		sqlite3_close(bufdb);
+		return 0;
+	}
+
+	ret = sqlite3_exec(bufdb, "PRAGMA synchronous = 1", NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not set buffer option: %s", sqlite3_errmsg(bufdb));
+		sqlite3_close(bufdb);
+		return 0;
+	}
+
+	/* Create buffer table */
+	cmd = "CREATE TABLE IF NOT EXISTS buffer("
+	      "uid INTEGER PRIMARY KEY,"
+	      "client_name TEXT,"
+	      "client_ip TEXT,"
+              "sender_ip TEXT,"
+              "gps_tsp REAL,"
+	      "gps_lat REAL,"
+	      "gps_lon REAL,"
+	      "packet_type INTEGER,"
+	      "seq INTEGER)";
+	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not create table: %s", sqlite3_errmsg(bufdb));
+		return 0;
+	}
+	/* Buffer files created before sequence numbers lack the column */
+	sqlite3_exec(bufdb, "ALTER TABLE buffer ADD COLUMN seq INTEGER", NULL, NULL, NULL);
+	return 1;
+}
+
+static int bufdb_delete(unsigned first,
+			unsigned last)
 {
 	char *cmd;
 	int ret;
 
-	cmd = sqlite3_mprintf("DELETE FROM buffer WHERE uid=%u", uid);
+	cmd = sqlite3_mprintf("DELETE FROM buffer WHERE uid>=%u AND uid<=%u", first, last);
 	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
 	sqlite3_free(cmd);
 
@@ -34,76 +92,421 @@ static int buffer_delete(unsigned uid)
 	return 1;
 }
 
-static void buffer_process(dbctx_t *dbctx)
+static int bufdb_store(const struct db_data *db)
+{
+	char *cmd;
+	int ret;
+
+	cmd = sqlite3_mprintf("INSERT INTO buffer VALUES(NULL,'%q','%q','%q',%f,%f,%f,%i,%llu)",
+			      db->client_name, db->client_ip, db->sender_ip,
+			      db->gps_tsp, db->gps_lat, db->gps_lon, db->packet_type, db->seq);
+	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
+	sqlite3_free(cmd);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not insert buffer: %s", sqlite3_errmsg(bufdb));
+		return 0;
+	}
+	return 1;
+}
+
+/* Upload buffered rows in batches, oldest first */
+static int bufdb_process(dbctx_t *dbctx)
 {
+	static struct db_data batch[BUFFER_BATCH];
 	int ret, row, col;
 	int i, j;
-	unsigned uid;
+	unsigned first, last;
 	char **table;
-	struct db_data dbdata;
+	char *cmd;
 
-	ret = sqlite3_get_table(bufdb, "SELECT * FROM buffer", &table, &row, &col, NULL);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_WARNING, "could not get table: %s", sqlite3_errmsg(bufdb));
-		return;
-	}
+	do {
+		cmd = sqlite3_mprintf("SELECT uid,client_name,client_ip,sender_ip,gps_tsp,gps_lat,"
+				      "gps_lon,packet_type,seq FROM buffer ORDER BY uid LIMIT %i",
+				      BUFFER_BATCH);
+		ret = sqlite3_get_table(bufdb, cmd, &table, &row, &col, NULL);
+		sqlite3_free(cmd);
+		if (ret != SQLITE_OK) {
+			debug(DEBUG_WARNING, "could not get table: %s", sqlite3_errmsg(bufdb));
+			return 1;
+		}
+		if (row == 0) {
+			sqlite3_free_table(table);
+			break;
+		}
 
-	for (i = 0, j = col; i < row; i++, j += col) {
-		uid = atoi(table[j]);
-		snprintf(dbdata.client_name, sizeof(dbdata.client_name), "%s", table[j + 1]);
-		snprintf(dbdata.client_ip, sizeof(dbdata.client_ip), "%s", table[j + 2]);
-		snprintf(dbdata.sender_ip, sizeof(dbdata.sender_ip), "%s", table[j + 3]);
-		dbdata.gps_tsp = atof(table[j + 4]);
-		dbdata.gps_lat = atof(table[j + 5]);
-		dbdata.gps_lon = atof(table[j + 6]);
-		dbdata.packet_type = atoi(table[j + 7]);
+		first = atoi(table[col]);
+		last = atoi(table[row * col]);
+		for (i = 0, j = col; i < row; i++, j += col) {
+			snprintf(batch[i].client_name, sizeof(batch[i].client_name), "%s", table[j + 1]);
+			snprintf(batch[i].client_ip, sizeof(batch[i].client_ip), "%s", table[j + 2]);
+			snprintf(batch[i].sender_ip, sizeof(batch[i].sender_ip), "%s", table[j + 3]);
+			batch[i].gps_tsp = atof(table[j + 4]);
+			batch[i].gps_lat = atof(table[j + 5]);
+			batch[i].gps_lon = atof(table[j + 6]);
+			batch[i].packet_type = atoi(table[j + 7]);
+			batch[i].seq = table[j + 8] ? strtoull(table[j + 8], NULL, 10) : 0;
+		}
+		sqlite3_free_table(table);
 
-		ret = db_insert(dbctx, &dbdata);
+		ret = db_insert(dbctx, batch, row);
 		if (!ret)
-			break;
-		ret = buffer_delete(uid);
+			return 0;
+		/* Rows left behind are resent and skipped by their sequence number */
+		ret = bufdb_delete(first, last);
 		if (!ret)
 			break;
-	}
+	} while (row == BUFFER_BATCH);
+	return 1;
+}
+
+static int bufdb_count(void)
+{
+	int ret, row, col, count;
+	char **table;
 
+	ret = sqlite3_get_table(bufdb, "SELECT COUNT(*) FROM buffer", &table, &row, &col, NULL);
+	if (ret != SQLITE_OK) {
+		debug(DEBUG_WARNING, "could not count buffer: %s", sqlite3_errmsg(bufdb));
+		return 0;
+	}
+	count = row > 0 ? atoi(table[1]) : 0;
 	sqlite3_free_table(table);
+	return count;
+}
+
+static int bufdb_thin(unsigned step)
+{
+	char *cmd;
+	int ret;
+
+	/* Keep the first location of each step second bucket */
+	cmd = sqlite3_mprintf("DELETE FROM buffer WHERE packet_type=%i AND uid NOT IN "
+			      "(SELECT MIN(uid) FROM buffer WHERE packet_type=%i "
+			      "GROUP BY CAST(gps_tsp / %u AS INTEGER))",
+			      CONFIG_MANUAL, CONFIG_MANUAL, step);
+	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
+	sqlite3_free(cmd);
+	if (ret != SQLITE_OK)
+		debug(DEBUG_ERROR, "could not thin buffer: %s", sqlite3_errmsg(bufdb));
+	return bufdb_count();
+}
+
+/* On-disk store for records that could not be uploaded from the ring */
+struct buffer_backend {
+	const char *name;
+	int (*open)(void);
+	int (*store)(const struct db_data *db);
+	int (*process)(dbctx_t *dbctx);
+	int (*count)(void);
+	int (*thin)(unsigned step);
+};
+
+static const struct buffer_backend backends[] = {
+	{ "sqlite", bufdb_open, bufdb_store, bufdb_process, bufdb_count, bufdb_thin },
+	{ "segment", seglog_open, seglog_append, seglog_process, seglog_count, seglog_thin },
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+static const struct buffer_backend *backend;
+
+static int buffer_spill(const struct db_data *db)
+{
+	int ret;
+
+	ret = backend->store(db);
+	__atomic_store_n(&spilled, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/* Move everything left in the ring to the buffer file */
+static void buffer_spill_ring(void)
+{
+	struct db_data dbdata;
+	int n = 0;
+
+	while (ring_pop(&bufring, &dbdata)) {
+		buffer_spill(&dbdata);
+		n++;
+	}
+	if (n)
+		debug(DEBUG_INFO, "spilled %i record(s) to buffer file", n);
+}
+
+/* Upload records queued in the ring, returns 0 when database is failing */
+static int buffer_drain(dbctx_t *dbctx)
+{
+	static struct db_data batch[BUFFER_BATCH];
+	int i, n;
+
+	do {
+		for (n = 0; n < BUFFER_BATCH; n++)
+			if (!ring_pop(&bufring, &batch[n]))
+				break;
+		if (n && !db_insert(dbctx, batch, n)) {
+			for (i = 0; i < n; i++)
+				buffer_spill(&batch[i]);
+			buffer_spill_ring();
+			return 0;
+		}
+	} while (n == BUFFER_BATCH);
+	return 1;
+}
+
+/*
+ * Keep the buffer file under buffer-max-records. Trigger events are never
+ * dropped, location fixes are decimated to the first one of every step
+ * seconds, and as the step doubles each pass keeps a subset of what the
+ * previous one kept. The step reached is kept while the buffer stays over
+ * the limit, so each interval runs one pass at that step unless it has to
+ * double further.
+ */
+static void buffer_trim(void)
+{
+	static unsigned step = 2;
+	static int full;
+	int count;
+
+	if (config.buffer_max_records <= 0)
+		return;
+	count = backend->count();
+	if (count <= config.buffer_max_records) {
+		if (full)
+			debug(DEBUG_INFO, "buffer is under limit again records=%i", count);
+		full = 0;
+		step = 2;
+		return;
+	}
+	if (!full)
+		debug(DEBUG_WARNING, "buffer is full records=%i max=%i, keeping one location per %us",
+		      count, config.buffer_max_records, step);
+	for (;;) {
+		count = backend->thin(step);
+		if (count <= config.buffer_max_records || step >= BUFFER_THIN_MAXSTEP)
+			break;
+		step <<= 1;
+		debug(DEBUG_INFO, "buffer is full records=%i, keeping one location per %us",
+		      count, step);
+	}
+	if (count > config.buffer_max_records && full < 2) {
+		debug(DEBUG_WARNING, "buffer is still over limit records=%i, keeping trigger events",
+		      count);
+		full = 2;
+	} else if (!full)
+		full = 1;
+}
+
+static void buffer_uplink(int up)
+{
+	if (__atomic_exchange_n(&uplink, up, __ATOMIC_RELAXED) != up)
+		debug(up ? DEBUG_INFO : DEBUG_WARNING, "database uplink is %s, %s",
+		      up ? "up" : "down", up ? "uploading from ring" : "spilling to buffer file");
+}
+
+static void buffer_deadline(struct timespec *ts,
+			    const struct timespec *now,
+			    long ms)
+{
+	ts->tv_sec = now->tv_sec + ms / 1000;
+	ts->tv_nsec = now->tv_nsec + ms % 1000 * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Drop a failed connection and schedule the next attempt */
+static void buffer_disconnect(dbctx_t **ctx,
+			      long *backoff,
+			      struct timespec *retry,
+			      unsigned *seed)
+{
+	struct timespec now;
+	long delay;
+
+	if (*ctx) {
+		db_close(*ctx);
+		*ctx = NULL;
+	}
+	buffer_uplink(0);
+
+	/* Exponential backoff, randomized over its upper half */
+	*backoff = *backoff ? *backoff * 2 : BUFFER_RETRY_MIN;
+	if (*backoff > BUFFER_RETRY_MAX)
+		*backoff = BUFFER_RETRY_MAX;
+	delay = *backoff / 2 + rand_r(seed) % (*backoff / 2 + 1);
+	clock_gettime(CLOCK_REALTIME, &now);
+	buffer_deadline(retry, &now, delay);
+	debug(DEBUG_INFO, "reconnecting to database in %lims", delay);
+}
+
+/* Read configuration for the main loop, db_getcfg() may block for seconds */
+static void buffer_fetchcfg(void)
+{
+	struct db_config cfg;
+	uint64_t one = 1;
+	int ret;
+
+	ret = db_getcfg(&cfg);
+	pthread_mutex_lock(&bufmutex);
+	cfgret = ret;
+	if (ret > 0)
+		memcpy(&cfgnew, &cfg, sizeof(cfgnew));
+	pthread_mutex_unlock(&bufmutex);
+	if (write(cfgfd, &one, sizeof(one)) != sizeof(one))
+		debug(DEBUG_WARNING, "eventfd: %s", strerror(errno));
 }
 
+/*
+ * Records are uploaded from the ring as soon as they are queued while the
+ * database is reachable. The buffer file is only drained once per
+ * buffer_interval and only when something was spilled to it, it holds what
+ * was written while the uplink was down or the ring was over its threshold.
+ * The connection is kept open and checked when idle; when it fails the
+ * reconnection is delayed by a jittered exponential backoff. Configuration
+ * reads requested with buffer_reqcfg() are served here too.
+ */
 static void *buffer_routine(void *data)
 {
-	dbctx_t *ctx;
-	struct timespec ts;
+	dbctx_t *ctx = NULL;
+	struct timespec ts, next, retry, *wake;
+	unsigned seed;
+	long backoff = 0;
 	int run = bufrun;
+	int used, pending;
 
 	debug(DEBUG_INFO, "buffer is started");
+	clock_gettime(CLOCK_REALTIME, &ts);
+	seed = ts.tv_nsec ^ getpid();
+	next = retry = ts;
+	used = 0;
 	while (run) {
-		ctx = db_connect();
-		if (ctx) {
-			buffer_process(ctx);
-			db_close(ctx);
-		}
+		if (__atomic_exchange_n(&cfgreq, 0, __ATOMIC_RELAXED))
+			buffer_fetchcfg();
+
 		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += config.buffer_interval;
+		if (!ctx && tsdiff(&retry, &ts) >= 0) {
+			ctx = db_connect();
+			if (ctx) {
+				backoff = 0;
+				buffer_uplink(1);
+			} else
+				buffer_disconnect(&ctx, &backoff, &retry, &seed);
+		}
+
+		if (tsdiff(&next, &ts) >= 0) {
+			pending = __atomic_exchange_n(&spilled, 0, __ATOMIC_RELAXED);
+			if (pending)
+				buffer_trim();
+			if (ctx && pending) {
+				if (!backend->process(ctx)) {
+					__atomic_store_n(&spilled, 1, __ATOMIC_RELAXED);
+					buffer_disconnect(&ctx, &backoff, &retry, &seed);
+				}
+				used = 1;
+			} else if (pending)
+				__atomic_store_n(&spilled, 1, __ATOMIC_RELAXED);
+
+			/* Health check a connection left idle for a whole interval */
+			if (ctx && !used && !db_ping(ctx)) {
+				debug(DEBUG_WARNING, "database connection was lost");
+				buffer_disconnect(&ctx, &backoff, &retry, &seed);
+			}
+			used = 0;
+			buffer_deadline(&next, &ts, config.buffer_interval * 1000L);
+		}
+
+		if (ctx) {
+			if (ring_count(&bufring))
+				used = 1;
+			if (!buffer_drain(ctx))
+				buffer_disconnect(&ctx, &backoff, &retry, &seed);
+		} else
+			buffer_spill_ring();
+
+		wake = (!ctx && tsdiff(&retry, &next) > 0) ? &retry : &next;
 		pthread_mutex_lock(&condmutex);
-		pthread_cond_timedwait(&bufcond, &condmutex, &ts);
+		if (ring_count(&bufring) == 0 && bufrun &&
+		    !__atomic_load_n(&cfgreq, __ATOMIC_RELAXED))
+			pthread_cond_timedwait(&bufcond, &condmutex, wake);
 		pthread_mutex_unlock(&condmutex);
 
 		pthread_mutex_lock(&bufmutex);
 		run = bufrun;
 		pthread_mutex_unlock(&bufmutex);
-		if (!run) {
-			ctx = db_connect();
-			if (ctx) {
-				buffer_process(ctx);
-				db_close(ctx);
-			}
-			break;
-		}
 	}
+
+	/* Flush what is left before exiting */
+	buffer_uplink(0);
+	if (!ctx)
+		ctx = db_connect();
+	if (ctx) {
+		if (backend->process(ctx))
+			buffer_drain(ctx);
+		db_close(ctx);
+	}
+	buffer_spill_ring();
 	debug(DEBUG_INFO, "buffer is stopped");
 	return NULL;
 }
 
+/* Persist the end of the reserved sequence block */
+static int buffer_saveseq(unsigned long long limit)
+{
+	char str[32];
+	int len;
+
+	len = snprintf(str, sizeof(str), "%llu\n", limit);
+	if (pwrite(seqfd, str, len, 0) != len || fdatasync(seqfd) == -1) {
+		debug(DEBUG_ERROR, "could not save sequence number: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sequence numbers never go backwards, they resume from the last reserved
+ * block or from the wall clock in milliseconds, whichever is higher, so
+ * losing the sequence file does not make new records collide with old ones.
+ */
+static int buffer_initseq(void)
+{
+	char path[300];
+	char str[32];
+	unsigned long long tsp;
+	int len;
+
+	snprintf(path, sizeof(path), "%s.seq", config.buffer_file);
+	seqfd = open(path, O_RDWR | O_CREAT, 0644);
+	if (seqfd == -1) {
+		debug(DEBUG_ERROR, "could not open sequence file %s: %s", path, strerror(errno));
+		return 0;
+	}
+	len = pread(seqfd, str, sizeof(str) - 1, 0);
+	str[len > 0 ? len : 0] = 0;
+	seq_next = strtoull(str, NULL, 10);
+	tsp = (unsigned long long) time(NULL) * 1000;
+	if (tsp > seq_next)
+		seq_next = tsp;
+	seq_limit = seq_next;
+	debug(DEBUG_INFO, "buffer sequence starts at %llu", seq_next);
+	return 1;
+}
+
+static unsigned long long buffer_nextseq(void)
+{
+	unsigned long long seq;
+
+	seq = __atomic_fetch_add(&seq_next, 1, __ATOMIC_SEQ_CST);
+	if (seq >= __atomic_load_n(&seq_limit, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&seqmutex);
+		while (seq >= seq_limit) {
+			buffer_saveseq(seq_limit + BUFFER_SEQ_BLOCK);
+			__atomic_store_n(&seq_limit, seq_limit + BUFFER_SEQ_BLOCK, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&seqmutex);
+	}
+	return seq;
+}
+
 static int buffer_start(void)
 {
 	int ret;
@@ -122,35 +525,33 @@ static int buffer_start(void)
 int buffer_init(void)
 {
 	int ret;
-	const char *cmd;
 
-	ret = sqlite3_open(config.buffer_file, &bufdb);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not open buffer file: %s", sqlite3_errmsg(bufdb));
-		sqlite3_close(bufdb);
+	ret = ring_init(&bufring, config.buffer_ring_size, sizeof(struct db_data));
+	if (!ret) {
+		debug(DEBUG_ERROR, "could not allocate buffer ring");
 		return 0;
 	}
+	debug(DEBUG_INFO, "buffer ring size=%u threshold=%i", bufring.size,
+	      config.buffer_ring_threshold);
 
-	ret = sqlite3_exec(bufdb, "PRAGMA synchronous = 1", NULL, NULL, NULL);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not set buffer option: %s", sqlite3_errmsg(bufdb));
-		sqlite3_close(bufdb);
+	ret = buffer_initseq();
+	if (!ret)
+		return 0;
+
+	for (backend = backends; backend->name; backend++)
+		if (!strcmp(backend->name, config.buffer_backend))
+			break;
+	if (!backend->name) {
+		debug(DEBUG_ERROR, "unknown buffer backend '%s'", config.buffer_backend);
 		return 0;
 	}
+	ret = backend->open();
+	if (!ret)
+		return 0;
 
-	/* Create buffer table */
-	cmd = "CREATE TABLE IF NOT EXISTS buffer("
-	      "uid INTEGER PRIMARY KEY,"
-	      "client_name TEXT,"
-	      "client_ip TEXT,"
-              "sender_ip TEXT,"
-              "gps_tsp REAL,"
-	      "gps_lat REAL,"
-	      "gps_lon REAL,"
-	      "packet_type INTEGER)";
-	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not create table: %s", sqlite3_errmsg(bufdb));
+	cfgfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cfgfd == -1) {
+		debug(DEBUG_ERROR, "eventfd: %s", strerror(errno));
 		return 0;
 	}
 
@@ -159,23 +560,58 @@ int buffer_init(void)
 	return ret;
 }
 
+/*
+ * Queue record for upload, it goes to the buffer file instead when the
+ * database is unreachable or the ring is over its threshold
+ */
 int buffer_insert(const struct db_data *db)
 {
-	char *cmd;
-	int ret;
+	struct db_data rec;
 
-	cmd = sqlite3_mprintf("INSERT INTO buffer VALUES(NULL,'%q','%q','%q',%f,%f,%f,%i)",
-			      db->client_name, db->client_ip, db->sender_ip,
-			      db->gps_tsp, db->gps_lat, db->gps_lon, db->packet_type);
-	ret = sqlite3_exec(bufdb, cmd, NULL, NULL, NULL);
-	sqlite3_free(cmd);
-	if (ret != SQLITE_OK) {
-		debug(DEBUG_ERROR, "could not insert buffer: %s", sqlite3_errmsg(bufdb));
-		return 0;
-	}
+	memcpy(&rec, db, sizeof(rec));
+	rec.seq = buffer_nextseq();
+	if (!__atomic_load_n(&uplink, __ATOMIC_RELAXED) ||
+	    ring_count(&bufring) >= config.buffer_ring_threshold ||
+	    !ring_push(&bufring, &rec))
+		return buffer_spill(&rec);
+
+	pthread_mutex_lock(&condmutex);
+	pthread_cond_signal(&bufcond);
+	pthread_mutex_unlock(&condmutex);
 	return 1;
 }
 
+/* Ask the buffer thread to read configuration, see buffer_cfgfd() */
+void buffer_reqcfg(void)
+{
+	__atomic_store_n(&cfgreq, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&condmutex);
+	pthread_cond_signal(&bufcond);
+	pthread_mutex_unlock(&condmutex);
+}
+
+/* Becomes readable when a requested configuration read is done */
+int buffer_cfgfd(void)
+{
+	return cfgfd;
+}
+
+/* Result of the finished read as returned by db_getcfg(), cfg set when 1 */
+int buffer_readcfg(struct db_config *cfg)
+{
+	uint64_t n;
+	int ret;
+
+	if (read(cfgfd, &n, sizeof(n)) != sizeof(n))
+		return -1;
+	pthread_mutex_lock(&bufmutex);
+	ret = cfgret;
+	if (ret > 0)
+		memcpy(cfg, &cfgnew, sizeof(*cfg));
+	pthread_mutex_unlock(&bufmutex);
+	return ret;
+}
+
 void buffer_stop(void)
 {
 	pthread_mutex_lock(&bufmutex);
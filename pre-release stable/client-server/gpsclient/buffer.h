@@ -3,8 +3,24 @@
 
 #include "database.h"
 
+/* Coarsest location decimation applied to a full buffer, in seconds */
+#define BUFFER_THIN_MAXSTEP 4096
+
+/* Records uploaded per INSERT statement */
+#define BUFFER_BATCH 256
+
+/* Database reconnection backoff bounds, in miliseconds */
+#define BUFFER_RETRY_MIN 1000
+#define BUFFER_RETRY_MAX 300000
+
+/* Sequence numbers reserved on disk at a time */
+#define BUFFER_SEQ_BLOCK 4096
+
 int buffer_init(void);
 int buffer_insert(const struct db_data *db);
-int buffer_stop(void);
+void buffer_reqcfg(void);
+int buffer_cfgfd(void);
+int buffer_readcfg(struct db_config *cfg);
+void buffer_stop(void);
 
 #endif /* _BUFFER_H_ */
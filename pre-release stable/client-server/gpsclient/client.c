@@ -1,12 +1,18 @@
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <gps.h>
 #include <math.h>
 #include <string.h>
@@ -15,45 +21,136 @@
 #include "utils.h"
 #include "msg.h"
 #include "buffer.h"
+#include "fixring.h"
+#include "sampler.h"
+#include "ring.h"
 #include "config.h"
 
+/* Miliseconds the OFFLINE CTL msg may take at exit */
+#define CTL_EXIT_TIMEOUT 3000
+
 static struct db_config dbcfg;
 static struct gps_data_t gpsd;
 static struct in_addr server_addr;
-static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
-static int ucast_sock;
-static int mcast_sock;
-static int bcast_sock;
-
-static int read_gpsd(struct gps_fix_t *fix)
+static int ucast_sock = -1;
+static int mcast_sock = -1;
+static int bcast_sock = -1;
+static int epfd;
+static int tgr_epfd;    /* Trigger sockets, epfd unless ACK thread is used */
+static int loc_timer;   /* Location sampling deadlines, CLOCK_REALTIME */
+static int reg_timer;   /* TGR timeout or registration retry */
+static int sig_fd;
+static int ctl_sock = -1;   /* CTL connection in progress */
+static int ctl_status;
+static int cfg_pending;     /* Config read requested from buffer thread */
+static struct timespec last_cfg;
+static long long loc_start;       /* First deadline, ns since epoch */
+static long long loc_ival;        /* Sampling period in ns */
+static unsigned long long loc_n;  /* Deadlines elapsed since loc_start */
+static unsigned long long loc_missed;
+static pthread_mutex_t sockmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* TGR msg handled on the ACK path, logged and buffered later */
+struct tgr_event {
+	int type;               /* CONFIG_UCAST, CONFIG_MCAST or CONFIG_BCAST */
+	int sock;
+	struct sockaddr_in saddr;
+	struct gps_fix_t fix;
+};
+
+static struct ring tgr_queue;
+static pthread_t tgr_thread;
+static pthread_mutex_t tgr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tgr_cond = PTHREAD_COND_INITIALIZER;
+static int tgr_stop;
+static pthread_t ack_thread;
+static int ack_efd = -1;  /* Wakes the ACK thread to stop */
+
+/* Position at local time ts, or the latest fix when interpolation is off */
+static int read_gpsd(const struct timespec *ts,
+		     struct gps_fix_t *fix)
 {
-	int latlon_set;
-
-	pthread_rwlock_rdlock(&rwlock);
-	latlon_set = gpsd.set & LATLON_SET;
-	memcpy(fix, &gpsd.fix, sizeof(struct gps_fix_t));
-	pthread_rwlock_unlock(&rwlock);
-	return (latlon_set && fix->mode > MODE_NO_FIX);
+	if (!config.fix_interpolation)
+		return fixring_latest(fix);
+	return fixring_at(ts, fix);
 }
 
-static void *gpsd_routine(void *data)
+/* Consume everything gpsd has sent, libgps may hold more than one report */
+static void handle_gpsd(void)
 {
+	static timestamp_t last;
+	struct timespec ts;
 	int ret;
 
-	while (1) {
-		ret = gps_waiting(&gpsd, 1000);
-		if (ret) {
-			pthread_rwlock_wrlock(&rwlock);
-			ret = gps_read(&gpsd);
-			pthread_rwlock_unlock(&rwlock);
-			if (ret == -1) {
-				debug(DEBUG_ERROR, "unable to read gpsd: %s",
-				      gps_errstr(errno));
-				exit(1);
-			}
+	do {
+		ret = gps_read(&gpsd);
+		if (ret == -1) {
+			debug(DEBUG_ERROR, "unable to read gpsd: %s", gps_errstr(errno));
+			exit(1);
 		}
+		/* Publish every new valid fix */
+		if (!(gpsd.set & LATLON_SET) || gpsd.fix.mode <= MODE_NO_FIX ||
+		    isnan(gpsd.fix.time) || isnan(gpsd.fix.latitude) ||
+		    isnan(gpsd.fix.longitude) || gpsd.fix.time == last)
+			continue;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		fixring_publish(&gpsd.fix, &ts);
+		last = gpsd.fix.time;
+	} while (gps_waiting(&gpsd, 0));
+}
+
+static void epoll_add(int efd,
+		      int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		debug(DEBUG_ERROR, "epoll_ctl: %s", strerror(errno));
+		exit(1);
 	}
-	return NULL;
+}
+
+static int timer_new(int clockid)
+{
+	int fd;
+
+	fd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		debug(DEBUG_ERROR, "timerfd_create: %s", strerror(errno));
+		exit(1);
+	}
+	epoll_add(epfd, fd);
+	return fd;
+}
+
+/* Arm timer to expire in ms miliseconds, then every ms when periodic */
+static void timer_arm(int fd,
+		      long ms,
+		      int periodic)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = ms % 1000 * 1000000;
+	if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+		its.it_value.tv_nsec = 1;
+	if (periodic)
+		its.it_interval = its.it_value;
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* Returns number of expirations since last read */
+static uint64_t timer_read(int fd)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return 0;
+	return n;
 }
 
 static void set_sockaddr(struct sockaddr_in *saddr,
@@ -86,7 +183,7 @@ static int create_socket(int type,
 	struct in_addr iaddr;
 	struct ip_mreq mreq;
 
-	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sock == -1)
 		return sock;
 
@@ -95,6 +192,11 @@ static int create_socket(int type,
 	if (ret == -1)
 		return ret;
 
+	/* Kernel receive timestamps, used to locate the client at trigger time */
+	ret = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(int));
+	if (ret == -1)
+		return ret;
+
 	/* Specify multicast group */
 	if (type == CONFIG_MCAST) {
 		ret = inet_pton(AF_INET, dbcfg.mcast_group, &iaddr);
@@ -129,14 +231,19 @@ static int prepare_sockets(void)
 	bcast_sock = create_socket(CONFIG_BCAST, config.client_addr, dbcfg.bcast_port);
 	if (bcast_sock == -1)
 		return 0;
+	epoll_add(tgr_epfd, ucast_sock);
+	epoll_add(tgr_epfd, mcast_sock);
+	epoll_add(tgr_epfd, bcast_sock);
 	return 1;
 }
 
+/* Closing the sockets also removes them from epoll */
 static void close_sockets(void)
 {
 	close(ucast_sock);
 	close(mcast_sock);
 	close(bcast_sock);
+	ucast_sock = mcast_sock = bcast_sock = -1;
 }
 
 static void fill_db_data(const struct in_addr *addr,
@@ -169,31 +276,66 @@ static void fill_db_data(const struct in_addr *addr,
 	db->packet_type = type;
 }
 
+static const char *tgr_typestr(int type)
+{
+	if (type == CONFIG_UCAST)
+		return "ucast";
+	else if (type == CONFIG_MCAST)
+		return "mcast";
+	return "bcast";
+}
+
+/*
+ * Receive and validate a TGR msg and locate ourself at its arrival time.
+ * Returns the trigger type, 0 when msg was invalid or there is no fix and
+ * -1 on socket error.
+ */
 static int recv_msg(int sock,
 		    struct sockaddr_in *saddr,
 		    struct gps_fix_t *fix)
 {
-	struct db_data dbdata;
 	struct tgr_msg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+	char cbuf[CMSG_SPACE(sizeof(struct timespec))];
 	int ret, type;
-	unsigned socklen;
-	char ipstr[INET_ADDRSTRLEN];
-	const char *str;
 
 	if (sock == ucast_sock)
-		str = "ucast";
+		type = CONFIG_UCAST;
 	else if (sock == mcast_sock)
-		str = "mcast";
+		type = CONFIG_MCAST;
 	else
-		str = "bcast";
-
-	socklen = sizeof(struct sockaddr_in);
-	ret = recvfrom(sock, &msg, sizeof(struct tgr_msg),
-		       0, (struct sockaddr*) saddr, &socklen);
+		type = CONFIG_BCAST;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(struct tgr_msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = saddr;
+	mh.msg_namelen = sizeof(struct sockaddr_in);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	ret = recvmsg(sock, &mh, 0);
 	if (ret == -1) {
-		debug(DEBUG_WARNING, "recvfrom: %s", strerror(errno));
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		debug(DEBUG_WARNING, "recvmsg: %s", strerror(errno));
 		return -1;
-	} else if (ret != sizeof(msg)) {
+	}
+
+	/* Arrival time, taken now when kernel did not stamp the datagram */
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			break;
+	if (cmsg)
+		memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+	else
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+	if (ret != sizeof(msg)) {
 		debug(DEBUG_WARNING, "invalid TGR msg length");
 		return 0;
 	}
@@ -203,197 +345,342 @@ static int recv_msg(int sock,
 		ret = msgtgr_check(&msg);
 		if (ret != 0) {
 			debug(DEBUG_WARNING, "invalid TGR msg type=%s hdr=%.4x crc=%.4x",
-			      str, msg.hdr, msg.crc);
+			      tgr_typestr(type), msg.hdr, msg.crc);
 			return 0;
 		}
 	}
 
-	inet_ntop(AF_INET, &saddr->sin_addr, ipstr, sizeof(ipstr));
-	debug(DEBUG_INFO, "recvd TGR msg type=%s addr=%s fd=%i", str, ipstr, sock);
-
-	ret = read_gpsd(fix);
-	if (ret) {
-		debug(DEBUG_INFO, "type=%s addr=%s tsp=%li lat=%f lon=%f", 
-		      str, ipstr, (long) fix->time, fix->latitude, fix->longitude);
-		if (isnan(fix->time) || isnan(fix->latitude) || isnan(fix->longitude)) {
-			debug(DEBUG_WARNING, "invalid gps value (NAN)");
-			return 0;
-		}
-		if (sock == ucast_sock)
-			type = CONFIG_UCAST;
-		else if (sock == mcast_sock)
-			type = CONFIG_MCAST;
-		else
-			type = CONFIG_BCAST;
-		fill_db_data(&saddr->sin_addr, fix, &dbdata, type);
-		buffer_insert(&dbdata);
-	} else {
-		debug(DEBUG_WARNING, "no data from gpsd type=%s addr=%s", str, ipstr);
+	ret = read_gpsd(&ts, fix);
+	if (!ret) {
+		debug(DEBUG_WARNING, "no data from gpsd type=%s", tgr_typestr(type));
 		return 0;
 	}
-	return 1;
+	if (isnan(fix->time) || isnan(fix->latitude) || isnan(fix->longitude)) {
+		debug(DEBUG_WARNING, "invalid gps value (NAN)");
+		return 0;
+	}
+	return type;
 }
 
-static void *location_write(void *data)
+/* Log and buffer a TGR msg which was already answered */
+static void tgr_record(const struct tgr_event *ev)
 {
-	int ret;
-	struct gps_fix_t fix;
-	struct db_data db;
+	struct db_data dbdata;
+	char ipstr[INET_ADDRSTRLEN];
+	const char *str;
 
-	for (;;) {
-		ret = read_gpsd(&fix);
-		if (ret) {
-			fill_db_data(NULL, &fix, &db, CONFIG_MANUAL);
-			buffer_insert(&db);
-			debug(DEBUG_INFO, "location write tsp=%li lat=%f lon=%f", 
-			      (long) fix.time, fix.latitude, fix.longitude);
+	str = tgr_typestr(ev->type);
+	inet_ntop(AF_INET, &ev->saddr.sin_addr, ipstr, sizeof(ipstr));
+	debug(DEBUG_INFO, "recvd TGR msg type=%s addr=%s fd=%i", str, ipstr, ev->sock);
+	debug(DEBUG_INFO, "type=%s addr=%s tsp=%li lat=%f lon=%f", 
+	      str, ipstr, (long) ev->fix.time, ev->fix.latitude, ev->fix.longitude);
+	if (ev->type == CONFIG_UCAST)
+		debug(DEBUG_INFO, "sent ACK msg lat=%f lon=%f tsp=%li",
+		      ev->fix.latitude, ev->fix.longitude, (long) ev->fix.time);
+	fill_db_data(&ev->saddr.sin_addr, &ev->fix, &dbdata, ev->type);
+	buffer_insert(&dbdata);
+}
+
+static void *tgr_routine(void *arg)
+{
+	struct tgr_event ev;
+
+	while (1) {
+		pthread_mutex_lock(&tgr_mutex);
+		while (!ring_pop(&tgr_queue, &ev)) {
+			if (tgr_stop) {
+				pthread_mutex_unlock(&tgr_mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&tgr_cond, &tgr_mutex);
 		}
-		msleep(dbcfg.location_writeival);
+		pthread_mutex_unlock(&tgr_mutex);
+		tgr_record(&ev);
 	}
 	return NULL;
 }
 
-static int send_ctlmsg(int status)
+/* Hand event to the worker, recorded in place when the queue is full */
+static void tgr_defer(const struct tgr_event *ev)
 {
-	int sock, ret;
-	size_t sent;
-	struct sockaddr_in saddr;
-	struct ctl_msg ctl;
+	if (!ring_push(&tgr_queue, ev)) {
+		tgr_record(ev);
+		return;
+	}
+	pthread_mutex_lock(&tgr_mutex);
+	pthread_cond_signal(&tgr_cond);
+	pthread_mutex_unlock(&tgr_mutex);
+}
 
-	sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-		debug(DEBUG_INFO, "socket: %s", strerror(errno));
-		exit(1);
+/*
+ * Location sampling runs on a grid of absolute deadlines loc_start + n *
+ * loc_ival, so processing time never shifts later samples. Every sample
+ * is taken at its deadline rather than at wakeup time. With location-align
+ * the grid starts on a whole second of the (GPS disciplined) system clock.
+ */
+static void location_schedule(void)
+{
+	struct itimerspec its;
+	struct timespec now;
+	long long t, first;
+
+	loc_ival = (long long) dbcfg.location_writeival * 1000000;
+	if (loc_ival <= 0)
+		loc_ival = 1000000000;
+	clock_gettime(CLOCK_REALTIME, &now);
+	t = (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+	if (config.location_align) {
+		first = (long long) now.tv_sec * 1000000000;
+		first += (t - first + loc_ival) / loc_ival * loc_ival;
+	} else
+		first = t + loc_ival;
+	loc_start = first;
+	loc_n = 0;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = first / 1000000000;
+	its.it_value.tv_nsec = first % 1000000000;
+	its.it_interval.tv_sec = loc_ival / 1000000000;
+	its.it_interval.tv_nsec = loc_ival % 1000000000;
+	timerfd_settime(loc_timer, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+	debug(DEBUG_INFO, "location sampling every %lli.%.3llis from %lli.%.3lli",
+	      loc_ival / 1000000000, loc_ival / 1000000 % 1000,
+	      first / 1000000000, first / 1000000 % 1000);
+}
+
+static void location_write(void)
+{
+	int ret, i;
+	struct gps_fix_t fix, out[2];
+	struct db_data db;
+	struct timespec ts;
+	unsigned long long n;
+	long long t;
+
+	ret = read(loc_timer, &n, sizeof(n));
+	if (ret == -1 && errno == ECANCELED) {
+		/* System clock was stepped, rebuild the grid */
+		debug(DEBUG_WARNING, "system clock changed, rescheduling location sampling");
+		location_schedule();
+		return;
+	}
+	if (ret != sizeof(n) || !n)
+		return;
+	loc_n += n;
+	if (n > 1) {
+		loc_missed += n - 1;
+		debug(DEBUG_WARNING, "missed %llu location deadlines, %llu total",
+		      n - 1, loc_missed);
 	}
 
-	memset(&saddr, 0, sizeof(saddr));
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons(dbcfg.server_ctlport);
-	saddr.sin_addr = server_addr;
+	t = loc_start + (long long) (loc_n - 1) * loc_ival;
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	ret = read_gpsd(&ts, &fix);
+	if (!ret)
+		return;
+	ret = sampler_feed(&fix, out);
+	for (i = 0; i < ret; i++) {
+		fill_db_data(NULL, &out[i], &db, CONFIG_MANUAL);
+		buffer_insert(&db);
+		debug(DEBUG_INFO, "location write tsp=%.3f lat=%f lon=%f", 
+		      out[i].time, out[i].latitude, out[i].longitude);
+	}
+}
 
-	ret = connect(sock, (struct sockaddr*) &saddr, sizeof(saddr));
-	if (ret == -1) {
-		debug(DEBUG_ERROR, "connect: %s", strerror(errno));
-		close(sock);
-		return -1;
+/* Send the pending CTL msg once its connection is up */
+static void ctl_finish(void)
+{
+	struct ctl_msg ctl;
+	socklen_t len;
+	int err = 0;
+
+	if (ctl_sock == -1)
+		return;
+	len = sizeof(err);
+	if (getsockopt(ctl_sock, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+		debug(DEBUG_ERROR, "connect: %s", strerror(err ? err : errno));
+		goto out;
 	}
 
 	/* Initialize CTL msg to send */
 	memcpy(ctl.name, dbcfg.name, sizeof(ctl.name));
-	ctl.ctl = status;
+	ctl.ctl = ctl_status;
 	ctl.uport = dbcfg.ucast_port;
 	ctl.mport = dbcfg.mcast_port;
 	ctl.bport = dbcfg.bcast_port;
 	msgctl_init(&ctl);
 	msgctl_hton(&ctl);
 
-	sent = 0;
-	while (sent < sizeof(ctl)) {
-		ret = send(sock, (char*) &ctl + sent, sizeof(ctl) - sent, 0);
-		if (ret == -1) {
-			debug(DEBUG_WARNING, "send: %s", strerror(errno));
-			close(sock);
-			return -1;
-		}
-		sent += ret;
+	/* A fresh connection takes the whole msg or fails */
+	if (send(ctl_sock, &ctl, sizeof(ctl), 0) != sizeof(ctl)) {
+		debug(DEBUG_WARNING, "send: %s", strerror(errno));
+		goto out;
 	}
-	debug(DEBUG_INFO, "sent CTL msg fd=%i status=%s", sock,
-	      status == CTL_CLIENT_ONLINE ? "CLIENT_ONLINE" : "CLIENT_OFFLINE");
-	return 1;
+	debug(DEBUG_INFO, "sent CTL msg fd=%i status=%s", ctl_sock,
+	      ctl_status == CTL_CLIENT_ONLINE ? "CLIENT_ONLINE" : "CLIENT_OFFLINE");
+
+out:
+	/* Closing the socket also removes it from epoll */
+	close(ctl_sock);
+	ctl_sock = -1;
 }
 
-static int read_sockets(void)
+/*
+ * Start sending a CTL msg. The connect does not block, the msg is sent by
+ * ctl_finish() once epoll reports the socket writable. An attempt still in
+ * progress is given up.
+ */
+static int send_ctlmsg(int status)
 {
-	int ret, maxfd;
-	fd_set rset;
-	struct timeval tv;
-	struct ack_msg ack;
 	struct sockaddr_in saddr;
-	struct gps_fix_t gfix;
-	struct timespec ts1, ts2;
+	struct epoll_event ev;
+
+	if (ctl_sock != -1) {
+		debug(DEBUG_WARNING, "CTL connection timed out");
+		close(ctl_sock);
+	}
+	ctl_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ctl_sock == -1) {
+		debug(DEBUG_INFO, "socket: %s", strerror(errno));
+		exit(1);
+	}
+	ctl_status = status;
 
-	maxfd = ucast_sock;
-	if (mcast_sock > maxfd)
-		maxfd = mcast_sock;
-	if (bcast_sock > maxfd)
-		maxfd = bcast_sock;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(dbcfg.server_ctlport);
+	saddr.sin_addr = server_addr;
 
-	/* Initialize last received TGR time */
-	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	if (connect(ctl_sock, (struct sockaddr*) &saddr, sizeof(saddr)) == 0) {
+		ctl_finish();
+		return 1;
+	}
+	if (errno != EINPROGRESS) {
+		debug(DEBUG_ERROR, "connect: %s", strerror(errno));
+		goto fail;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.fd = ctl_sock;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctl_sock, &ev) == -1) {
+		debug(DEBUG_ERROR, "epoll_ctl: %s", strerror(errno));
+		goto fail;
+	}
+	return 1;
 
-	while (1) {
-		FD_ZERO(&rset);
-		FD_SET(ucast_sock, &rset);
-		FD_SET(mcast_sock, &rset);
-		FD_SET(bcast_sock, &rset);
-		tv = (struct timeval) { .tv_sec = 1, .tv_usec = 0 };
+fail:
+	close(ctl_sock);
+	ctl_sock = -1;
+	return -1;
+}
 
-		ret = select(maxfd + 1, &rset, NULL, NULL, &tv);
+/*
+ * Read one TGR msg from a trigger socket. Unicast ones are answered with
+ * ACK right away, everything else is left to the TGR worker.
+ */
+static void handle_tgr(int sock)
+{
+	int ret;
+	struct ack_msg ack;
+	struct tgr_event ev;
+
+	ret = recv_msg(sock, &ev.saddr, &ev.fix);
+	if (ret == -1)
+		exit(1);
+	if (ret == 0)
+		return;
+	ev.type = ret;
+	ev.sock = sock;
+
+	if (ev.type == CONFIG_UCAST) {
+		/* Reply with ACK msg */
+		memcpy(ack.name, dbcfg.name, sizeof(ack.name));
+		sprintf(ack.latitude, "%f", ev.fix.latitude);
+		sprintf(ack.longitude, "%f", ev.fix.longitude);
+		ack.tsp = ev.fix.time;
+		msgack_init(&ack);
+		msgack_hton(&ack);
+
+		ret = sendto(ucast_sock, &ack, sizeof(ack), 
+			     0, (struct sockaddr*) &ev.saddr, sizeof(ev.saddr));
 		if (ret == -1) {
-			debug(DEBUG_ERROR, "select: %s", strerror(errno));
-			return -1;
-		} else if (ret == 0) { /* select was timeout */
-			clock_gettime(CLOCK_MONOTONIC, &ts2);
-			ret = tsdiff(&ts1, &ts2);
-			if (ret >= dbcfg.server_retryival) {
-				debug(DEBUG_INFO, "TGR msg recv was timeout");
-				return 0;
-			}
-			continue;
+			debug(DEBUG_WARNING, "sendto: %s", strerror(errno));
+			exit(1);
 		}
+		/* Restart TGR timeout */
+		timer_arm(reg_timer, dbcfg.server_retryival, 0);
+	}
+	tgr_defer(&ev);
+}
 
-		/* Unicast */
-		if (FD_ISSET(ucast_sock, &rset)) {
-			ret = recv_msg(ucast_sock, &saddr, &gfix);
-			if (ret == -1)
-				return -1;
-			if (ret) {
-				/* Update last TGR recvd time */
-				clock_gettime(CLOCK_MONOTONIC, &ts1);
-				/* Reply with ACK msg */
-				memcpy(ack.name, dbcfg.name, sizeof(ack.name));
-				sprintf(ack.latitude, "%f", gfix.latitude);
-				sprintf(ack.longitude, "%f", gfix.longitude);
-				ack.tsp = gfix.time;
-				msgack_init(&ack);
-				msgack_hton(&ack);
-
-				ret = sendto(ucast_sock, &ack, sizeof(ack), 
-					     0, (struct sockaddr*) &saddr, sizeof(saddr));
-				if (ret == -1) {
-					debug(DEBUG_WARNING, "sendto: %s", strerror(errno));
-					return -1;
-				}
-				debug(DEBUG_INFO, "sent ACK msg lat=%f lon=%f tsp=%li",
-				      gfix.latitude, gfix.longitude, (long) gfix.time);
-			}
-		}
-		/* Multicast */
-		if (FD_ISSET(mcast_sock, &rset)) {
-			ret = recv_msg(mcast_sock, &saddr, &gfix);
-			if (ret == -1)
-				return -1;
+/* Serves trigger sockets when ack-thread-priority is set */
+static void *ack_routine(void *arg)
+{
+	struct epoll_event events[4];
+	int i, n, fd;
+
+	while (1) {
+		n = epoll_wait(tgr_epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			debug(DEBUG_ERROR, "epoll_wait: %s", strerror(errno));
+			exit(1);
 		}
-		/* Broadcast */
-		if (FD_ISSET(bcast_sock, &rset)) {
-			ret = recv_msg(bcast_sock, &saddr, &gfix);
-			if (ret == -1)
-				return -1;
+		pthread_mutex_lock(&sockmutex);
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == ack_efd) {
+				pthread_mutex_unlock(&sockmutex);
+				return NULL;
+			}
+			if (fd == ucast_sock || fd == mcast_sock || fd == bcast_sock)
+				handle_tgr(fd);
 		}
+		pthread_mutex_unlock(&sockmutex);
 	}
-	return 1;
+	return NULL;
 }
 
-/* Get configuration from database */
-int get_dbcfg(void)
+/* Start real-time ACK thread, returns 0 when it could not be created */
+static int ack_start(int prio)
 {
-	dbctx_t *dbctx;
+	pthread_attr_t attr;
+	struct sched_param sp;
 	int ret;
 
-	dbctx = db_connect();
-	if (!dbctx)
-		return -1;
-	ret = db_getcfg(dbctx, &dbcfg);
+	if (prio > sched_get_priority_max(SCHED_FIFO))
+		prio = sched_get_priority_max(SCHED_FIFO);
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = prio;
+	pthread_attr_setschedparam(&attr, &sp);
+	ack_efd = eventfd(0, EFD_CLOEXEC);
+	if (ack_efd == -1) {
+		debug(DEBUG_WARNING, "eventfd: %s", strerror(errno));
+		pthread_attr_destroy(&attr);
+		return 0;
+	}
+	epoll_add(tgr_epfd, ack_efd);
+	ret = pthread_create(&ack_thread, &attr, ack_routine, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		debug(DEBUG_WARNING, "unable to start ACK thread prio=%i: %s", prio, strerror(ret));
+		close(ack_efd);
+		ack_efd = -1;
+		return 0;
+	}
+	debug(DEBUG_INFO, "ACK thread started with SCHED_FIFO prio=%i", prio);
+	return 1;
+}
+
+/* Log the result of db_getcfg() */
+static int check_dbcfg(int ret,
+		       const struct db_config *cfg)
+{
 	if (ret == -1) {
 		debug(DEBUG_ERROR, "unable to read configuration from database");
 		return -1;
@@ -401,11 +688,16 @@ int get_dbcfg(void)
 		debug(DEBUG_ERROR, "client name '%s' was not found in database", config.client_name);
 		return 0;
 	}
-	db_close(dbctx);
-	db_debugcfg(&dbcfg);
+	db_debugcfg(cfg);
 	return 1;
 }
 
+/* Get configuration from database, or gpsclient.conf without PostgreSQL */
+int get_dbcfg(void)
+{
+	return check_dbcfg(db_getcfg(&dbcfg), &dbcfg);
+}
+
 int get_serveraddr(void)
 {
 	struct hostent *he;
@@ -422,28 +714,142 @@ int get_serveraddr(void)
 	return 1;
 }
 
-static void signal_handler(int signo)
+/*
+ * Apply configuration reread by the buffer thread, trigger sockets and
+ * location timer are only recreated when their settings were changed.
+ * Registration that waited for it goes on when it was read.
+ */
+static void reload_dbcfg(void)
 {
-	struct ack_msg;
+	struct db_config old, cfg;
+
+	cfg_pending = 0;
+	if (check_dbcfg(buffer_readcfg(&cfg), &cfg) <= 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &last_cfg);
+	memcpy(&old, &dbcfg, sizeof(old));
+	memcpy(&dbcfg, &cfg, sizeof(dbcfg));
+
+	if (old.ucast_port != dbcfg.ucast_port || old.mcast_port != dbcfg.mcast_port ||
+	    old.bcast_port != dbcfg.bcast_port || strcmp(old.mcast_group, dbcfg.mcast_group)) {
+		debug(DEBUG_INFO, "trigger ports were changed, recreating sockets");
+		pthread_mutex_lock(&sockmutex);
+		close_sockets();
+		if (!prepare_sockets()) {
+			debug(DEBUG_ERROR, "unable to create trigger sockets");
+			exit(1);
+		}
+		pthread_mutex_unlock(&sockmutex);
+	}
+	if (old.location_writeival != dbcfg.location_writeival)
+		location_schedule();
+	send_ctlmsg(CTL_CLIENT_ONLINE);
+}
 
-	if (signo == SIGTERM || signo == SIGINT) {
+/*
+ * Announce ourself to server. Configuration older than 5 seconds is reread
+ * first, off the main loop, and the CTL msg is sent once it arrives. Either
+ * way reg_timer then runs for server_retryival: it is restarted by every
+ * unicast TGR and leads to a new registration when it expires.
+ */
+static void do_register(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (tsdiff(&last_cfg, &ts) < 5000)
+		send_ctlmsg(CTL_CLIENT_ONLINE);
+	else if (!cfg_pending) {
+		debug(DEBUG_INFO, "attemping to reread config from database");
+		cfg_pending = 1;
+		buffer_reqcfg();
+	}
+	timer_arm(reg_timer, dbcfg.server_retryival, 0);
+}
+
+static void handle_signal(void)
+{
+	struct signalfd_siginfo si;
+
+	if (read(sig_fd, &si, sizeof(si)) != sizeof(si))
+		return;
+	if (si.ssi_signo == SIGTERM || si.ssi_signo == SIGINT) {
 		debug(DEBUG_INFO, "got TERM or INT signal, sending OFFLINE status");
-		send_ctlmsg(CTL_CLIENT_OFFLINE);
+		if (send_ctlmsg(CTL_CLIENT_OFFLINE) > 0 && ctl_sock != -1) {
+			struct pollfd pfd = { ctl_sock, POLLOUT, 0 };
+
+			if (poll(&pfd, 1, CTL_EXIT_TIMEOUT) == 1)
+				ctl_finish();
+			else
+				debug(DEBUG_WARNING, "CTL connection timed out");
+		}
+		/* ACK thread first, it queues TGR events until it returns */
+		if (ack_efd != -1) {
+			uint64_t one = 1;
+
+			if (write(ack_efd, &one, sizeof(one)) == sizeof(one))
+				pthread_join(ack_thread, NULL);
+		}
+		/* Then the worker, which drains tgr_queue before it returns */
+		pthread_mutex_lock(&tgr_mutex);
+		tgr_stop = 1;
+		pthread_cond_signal(&tgr_cond);
+		pthread_mutex_unlock(&tgr_mutex);
+		pthread_join(tgr_thread, NULL);
+		debug(DEBUG_INFO, "location deadlines=%llu missed=%llu", loc_n, loc_missed);
 		debug(DEBUG_INFO, "processing buffer records");
 		buffer_stop();
+		gps_close(&gpsd);
 		exit(0);
 	}
 }
 
+/*
+ * Sleep for ms before the main loop runs, gpsd is still read so fixes do
+ * not back up in the socket meanwhile
+ */
+static void startup_wait(long ms)
+{
+	struct epoll_event events[2];
+	struct signalfd_siginfo si;
+	struct timespec start, now;
+	long left;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = ms - tsdiff(&start, &now);
+		if (left <= 0)
+			break;
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), left);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			debug(DEBUG_ERROR, "epoll_wait: %s", strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == gpsd.gps_fd)
+				handle_gpsd();
+			else if (events[i].data.fd == sig_fd &&
+				 read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+				debug(DEBUG_INFO, "got TERM or INT signal before registration");
+				buffer_stop();
+				gps_close(&gpsd);
+				exit(0);
+			}
+		}
+	}
+}
+
 int main(int argc,
 	 char **argv)
 {
-	pthread_t gpsd_thread;
-	pthread_t writeloc_thread;
-	struct timespec ts1, ts2;
-	struct sigaction sa;
-	char gpsd_port[5];
-	int ret, nretry;
+	struct epoll_event events[8];
+	sigset_t mask;
+	char gpsd_port[6];
+	int ret, nretry, i, n, fd;
 	char *progname, *tmp;
 
 	progname = argv[0];
@@ -461,6 +867,17 @@ int main(int argc,
 		exit(EXIT_FAILURE);
 	}
 
+	/* Signals are delivered through signalfd, block them before any thread is created */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sig_fd == -1) {
+		debug(DEBUG_ERROR, "signalfd: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
 	/* Initialize GPSD connection */
 	sprintf(gpsd_port, "%i", config.gpsd_port);
 	ret = gps_open(config.gpsd_addr, gpsd_port, &gpsd);
@@ -477,13 +894,6 @@ int main(int argc,
 	}
 	debug(DEBUG_INFO, "gpsd streams enabled %s:%i", config.gpsd_addr, config.gpsd_port);
 
-	/* Start gpsd routine */
-	ret = pthread_create(&gpsd_thread, NULL, gpsd_routine, NULL);
-	if (ret) {
-		debug(DEBUG_ERROR, "unable to create gpsd routine\n");
-		exit(1);
-	}
-
 	/* Initialize buffer */
 	ret = buffer_init();
 	if (!ret) {
@@ -491,6 +901,16 @@ int main(int argc,
 		exit(EXIT_FAILURE);
 	}
 
+	/* Every event source of the client is served from one epoll loop */
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		debug(DEBUG_ERROR, "epoll_create1: %s", strerror(errno));
+		exit(1);
+	}
+	epoll_add(epfd, gpsd.gps_fd);
+	epoll_add(epfd, sig_fd);
+	epoll_add(epfd, buffer_cfgfd());
+
 	/* Get configuration from database */
 	nretry = 0;
 	while (1) {
@@ -498,7 +918,7 @@ int main(int argc,
 		debug(DEBUG_INFO, "reading config from database try=%i", nretry);
 		if (get_dbcfg() > 0 && get_serveraddr())
 			break;
-		msleep(30000);
+		startup_wait(30000);
 		if (nretry >= 5) {
 			debug(DEBUG_ERROR, "timeout reading config from database");
 			exit(1);
@@ -506,50 +926,76 @@ int main(int argc,
 	}
 
 	/* Set last time of config read */
-	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	clock_gettime(CLOCK_MONOTONIC, &last_cfg);
 
-	/* Start local location write routine */
-	ret = pthread_create(&writeloc_thread, NULL, location_write, NULL);
-	if (ret) {
-		debug(DEBUG_ERROR, "unable to create location write routine");
+	/* TGR msgs are logged and buffered off the ACK path */
+	if (!ring_init(&tgr_queue, 64, sizeof(struct tgr_event)) ||
+	    pthread_create(&tgr_thread, NULL, tgr_routine, NULL)) {
+		debug(DEBUG_ERROR, "unable to start TGR worker");
+		exit(1);
+	}
+
+	/* Unless trigger sockets are served by a real-time ACK thread */
+	tgr_epfd = epfd;
+	if (config.ack_thread_priority > 0) {
+		tgr_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (tgr_epfd == -1) {
+			debug(DEBUG_ERROR, "epoll_create1: %s", strerror(errno));
+			exit(1);
+		}
+	}
+	if (!prepare_sockets()) {
+		debug(DEBUG_ERROR, "unable to create trigger sockets");
 		exit(1);
 	}
+	loc_timer = timer_new(CLOCK_REALTIME);
+	reg_timer = timer_new(CLOCK_MONOTONIC);
+	if (tgr_epfd != epfd && !ack_start(config.ack_thread_priority)) {
+		/* Fall back to serve triggers from main loop */
+		close(tgr_epfd);
+		tgr_epfd = epfd;
+		epoll_add(epfd, ucast_sock);
+		epoll_add(epfd, mcast_sock);
+		epoll_add(epfd, bcast_sock);
+	}
+
+	/* Start local location write */
+	location_schedule();
 
-	/* Install signal handler */
-	sa.sa_handler = signal_handler;
-	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGINT, &sa, NULL);
+	/* Register to server */
+	do_register();
 
 	/* Main loop */
 	while (1) {
-		clock_gettime(CLOCK_MONOTONIC, &ts2);
-		if (tsdiff(&ts1, &ts2) >= 5000) {
-			debug(DEBUG_INFO, "attemping to reread config from database");
-			ret = get_dbcfg();
-			if (ret <= 0) {
-				msleep(dbcfg.server_retryival);
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n == -1) {
+			if (errno == EINTR)
 				continue;
-			}
-			ts1 = ts2;
+			debug(DEBUG_ERROR, "epoll_wait: %s", strerror(errno));
+			exit(1);
 		}
-		ret = send_ctlmsg(CTL_CLIENT_ONLINE);
-		if (ret <= 0) {
-			msleep(dbcfg.server_retryival);
-			continue;
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == gpsd.gps_fd)
+				handle_gpsd();
+			else if (fd == loc_timer)
+				location_write();
+			else if (fd == reg_timer) {
+				if (timer_read(reg_timer)) {
+					debug(DEBUG_INFO, "TGR msg recv was timeout");
+					do_register();
+				}
+			} else if (fd == sig_fd)
+				handle_signal();
+			else if (fd == ctl_sock)
+				ctl_finish();
+			else if (fd == buffer_cfgfd())
+				reload_dbcfg();
+			else if (fd == ucast_sock || fd == mcast_sock || fd == bcast_sock)
+				handle_tgr(fd);
 		}
-
-		if (prepare_sockets() == -1)
-			exit(1);
-
-		ret = read_sockets();
-		if (ret == -1)
-			exit(1);
-		close_sockets();
 	}
 
 	/* Not reached */
-	gps_close(&gpsd);
-	pthread_join(gpsd_thread, NULL);
-	pthread_join(writeloc_thread, NULL);
 	exit(0);
 }
@@ -20,6 +20,26 @@ static const char * const config_keys[] = {
 	"db-tabledata",
 	"buffer-file",
 	"buffer-interval",
+	"buffer-ring-size",
+	"buffer-ring-threshold",
+	"buffer-backend",
+	"buffer-max-records",
+	"fix-interpolation",
+	"ack-thread-priority",
+	"location-align",
+	"location-min-distance",
+	"location-min-heading",
+	"location-max-interval",
+	"sink-type",
+	"sink-path",
+	"unicast-port",
+	"multicast-port",
+	"broadcast-port",
+	"packet-validation",
+	"location-writeival",
+	"server-host",
+	"server-ctlport",
+	"server-retryival",
 	NULL
 };
 
@@ -43,8 +63,18 @@ static void config_debug(void)
 	debug(DEBUG_INFO, "db-addr=%s db-port=%i db-name=%s db-user=%s db-passwd=%s "
 	      "db-tablecfg=%s db-tabledata=%s", config.db_addr, config.db_port, config.db_name, 
 	      config.db_user, config.db_passwd, config.db_tablecfg, config.db_tabledata);
-	debug(DEBUG_INFO, "buffer-file=%s buffer-interval=%i", config.buffer_file,
-	      config.buffer_interval);
+	debug(DEBUG_INFO, "sink-type=%s sink-path=%s", config.sink_type, config.sink_path);
+	debug(DEBUG_INFO, "buffer-backend=%s buffer-file=%s buffer-interval=%i "
+	      "buffer-max-records=%i", config.buffer_backend, config.buffer_file,
+	      config.buffer_interval, config.buffer_max_records);
+	debug(DEBUG_INFO, "buffer-ring-size=%i buffer-ring-threshold=%i",
+	      config.buffer_ring_size, config.buffer_ring_threshold);
+	debug(DEBUG_INFO, "fix-interpolation=%s ack-thread-priority=%i location-align=%s",
+	      config.fix_interpolation ? "yes" : "no", config.ack_thread_priority,
+	      config.location_align ? "yes" : "no");
+	debug(DEBUG_INFO, "location-min-distance=%.1f location-min-heading=%.1f "
+	      "location-max-interval=%i", config.location_min_distance,
+	      config.location_min_heading, config.location_max_interval);
 }
 
 const char *config_get_value(char *line)
@@ -120,6 +150,68 @@ static void config_set_value(const char *value, int id)
 			if (config.buffer_interval <= 0)
 				config.buffer_interval = 10;
 			break;
+		case 14: /* buffer-ring-size */
+			config.buffer_ring_size = atoi(value);
+			if (config.buffer_ring_size <= 0)
+				config.buffer_ring_size = 256;
+			break;
+		case 15: /* buffer-ring-threshold */
+			config.buffer_ring_threshold = atoi(value);
+			break;
+		case 16: /* buffer-backend */
+			xstrncpy(config.buffer_backend, value, sizeof(config.buffer_backend));
+			break;
+		case 17: /* buffer-max-records */
+			config.buffer_max_records = atoi(value);
+			break;
+		case 18: /* fix-interpolation */
+			config.fix_interpolation = strcmp("yes", value) ? 0 : 1;
+			break;
+		case 19: /* ack-thread-priority */
+			config.ack_thread_priority = atoi(value);
+			break;
+		case 20: /* location-align */
+			config.location_align = strcmp("yes", value) ? 0 : 1;
+			break;
+		case 21: /* location-min-distance */
+			config.location_min_distance = atof(value);
+			break;
+		case 22: /* location-min-heading */
+			config.location_min_heading = atof(value);
+			break;
+		case 23: /* location-max-interval */
+			config.location_max_interval = atoi(value);
+			break;
+		case 24: /* sink-type */
+			xstrncpy(config.sink_type, value, sizeof(config.sink_type));
+			break;
+		case 25: /* sink-path */
+			xstrncpy(config.sink_path, value, sizeof(config.sink_path));
+			break;
+		case 26: /* unicast-port */
+			config.ucast_port = atoi(value);
+			break;
+		case 27: /* multicast-port */
+			config.mcast_port = atoi(value);
+			break;
+		case 28: /* broadcast-port */
+			config.bcast_port = atoi(value);
+			break;
+		case 29: /* packet-validation */
+			config.packet_validation = strcmp("yes", value) ? 0 : 1;
+			break;
+		case 30: /* location-writeival */
+			config.location_writeival = atoi(value);
+			break;
+		case 31: /* server-host */
+			xstrncpy(config.server_host, value, sizeof(config.server_host));
+			break;
+		case 32: /* server-ctlport */
+			config.server_ctlport = atoi(value);
+			break;
+		case 33: /* server-retryival */
+			config.server_retryival = atoi(value);
+			break;
 	}
 }
 
@@ -144,8 +236,32 @@ static void config_default(void)
         sprintf(config.db_tabledata, "%s", "dbtabledata");
 
 	/* Buffer */
+	sprintf(config.buffer_backend, "%s", "sqlite");
 	sprintf(config.buffer_file, "%s", "/tmp/gpsclient.db");
 	config.buffer_interval = 10;
+	config.buffer_max_records = 86400;
+	config.buffer_ring_size = 256;
+	config.buffer_ring_threshold = 192;
+
+	/* GPS fixes */
+	config.fix_interpolation = 1;
+	config.ack_thread_priority = 0;
+	config.location_align = 0;
+	config.location_min_distance = 0;
+	config.location_min_heading = 0;
+	config.location_max_interval = 0;
+
+	/* Storage, the settings below replace gpsclientcfg unless it is pgsql */
+	sprintf(config.sink_type, "%s", "pgsql");
+	sprintf(config.sink_path, "%s", "/tmp/gpsclient.sink");
+	config.ucast_port = 6000;
+	config.mcast_port = 6001;
+	config.bcast_port = 6002;
+	config.packet_validation = 1;
+	config.location_writeival = 1000;
+	sprintf(config.server_host, "%s", "127.0.0.1");
+	config.server_ctlport = 5000;
+	config.server_retryival = 10000;
 }
 
 int config_read(const char *file)
@@ -173,6 +289,9 @@ int config_read(const char *file)
 			}
 	}
 	fclose(fp);
+	if (config.buffer_ring_threshold <= 0 ||
+	    config.buffer_ring_threshold > config.buffer_ring_size)
+		config.buffer_ring_threshold = config.buffer_ring_size;
 	config_debug();
 	return 1;
 }
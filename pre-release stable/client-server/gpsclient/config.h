@@ -22,7 +22,28 @@ struct config {
 	char db_tablecfg[32];
 	char db_tabledata[32];
 	char buffer_file[256];
+	char buffer_backend[16];
 	int buffer_interval;
+	int buffer_ring_size;
+	int buffer_ring_threshold;
+	int buffer_max_records;
+	int fix_interpolation;
+	int ack_thread_priority;
+	int location_align;
+	double location_min_distance;
+	double location_min_heading;
+	int location_max_interval;
+	char sink_type[16];
+	char sink_path[256];
+	/* Client configuration when it is not read from gpsclientcfg */
+	unsigned short ucast_port;
+	unsigned short mcast_port;
+	unsigned short bcast_port;
+	int packet_validation;
+	int location_writeival;
+	char server_host[255];
+	unsigned short server_ctlport;
+	int server_retryival;
 };
 
 /* Globally accessed configuration */
@@ -6,82 +6,120 @@
 #include "database.h"
 #include "config.h"
 
-typedef PGconn dbctx_t;
+/*
+ * Uploads go through the sink selected by sink-type. The client
+ * configuration is read from gpsclientcfg when that is pgsql and taken
+ * from gpsclient.conf otherwise.
+ */
 
 dbctx_t *db_connect(void)
 {
-	dbctx_t *ctx;
-	char conn_str[256];
+	char target[512];
 
-	snprintf(conn_str, sizeof(conn_str),
-		 "host=%s port=%i dbname=%s user=%s password=%s connect_timeout=10",
-		 config.db_addr, config.db_port, config.db_name, config.db_user, 
-		 config.db_passwd);
-
-	ctx = PQconnectdb(conn_str);
-	if (PQstatus (ctx) != CONNECTION_OK) {
-		debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage (ctx));
-		PQfinish (ctx);
-		return NULL;
-	}
-	return ctx;
+	if (!strcmp(config.sink_type, "pgsql"))
+		snprintf(target, sizeof(target),
+			 "host=%s port=%i dbname=%s user=%s password=%s connect_timeout=10 "
+			 "keepalives=1 keepalives_idle=60",
+			 config.db_addr, config.db_port, config.db_name, config.db_user,
+			 config.db_passwd);
+	else
+		snprintf(target, sizeof(target), "%s", config.sink_path);
+	return sink_open(config.sink_type, target, config.db_tabledata);
 }
 
 void db_close(dbctx_t *ctx)
 {
-	PQfinish(ctx);
+	sink_close(ctx);
 }
 
+/* Check that a kept-open connection still works */
+int db_ping(dbctx_t *ctx)
+{
+	return sink_ping(ctx);
+}
+
+/*
+ * Store n records as one batch. Rows already stored under the same
+ * (client_name, client_seq) are skipped, so a batch can be resent safely
+ * when it is not known whether the previous attempt was committed.
+ */
 int db_insert(dbctx_t *ctx,
-	      const struct db_data *data)
+	      const struct db_data *data,
+	      int n)
 {
-	PGresult *result;
-	int ret;
-	char cmd[1024];
-	char gps_lat[16];
-	char gps_lon[16];
-
-	sprintf(gps_lat, "%f", data->gps_lat);
-	sprintf(gps_lon, "%f", data->gps_lon);
-	snprintf(cmd, sizeof(cmd),
-		 "insert into %s(client_name,client_ip,sender_ip,client_timestamp,client_lat,"
-		 "client_long,event_type) values('%s','%s','%s',%li,'%s','%s',%i)", 
-		 config.db_tabledata, data->client_name, data->client_ip, data->sender_ip,
-		 (long) data->gps_tsp, gps_lat, gps_lon, data->packet_type);
-	result = PQexec (ctx, cmd);
-	if (result == NULL) {
-		debug(DEBUG_ERROR, "%s", PQerrorMessage (ctx));
-		return 0;
-	}
-	if (PQresultStatus (result) == PGRES_COMMAND_OK)
-		ret = 1;
-	else {
-		debug(DEBUG_ERROR, "could not insert to db: %s", PQresultErrorMessage (result));
-		ret = 0;
+	struct sink_row row;
+	int i;
+
+	for (i = 0; i < n; i++, data++) {
+		memset(&row, 0, sizeof(row));
+		memcpy(row.client_name, data->client_name,
+		       strnlen(data->client_name, sizeof(row.client_name) - 1));
+		memcpy(row.client_ip, data->client_ip, sizeof(row.client_ip));
+		memcpy(row.sender_ip, data->sender_ip, sizeof(row.sender_ip));
+		row.tsp = (long) data->gps_tsp;
+		snprintf(row.lat, sizeof(row.lat), "%f", data->gps_lat);
+		snprintf(row.lon, sizeof(row.lon), "%f", data->gps_lon);
+		row.event = data->packet_type;
+		row.seq = data->seq;
+		if (!sink_append(ctx, &row, 1))
+			return 0;
 	}
-	PQclear (result);
-	return ret;
+	return sink_flush(ctx);
 }
 
-int db_getcfg(dbctx_t *ctx,
-	      struct db_config *cfg)
+static int db_localcfg(struct db_config *cfg)
 {
+	memset(cfg, 0, sizeof(*cfg));
+	snprintf(cfg->name, sizeof(cfg->name), "%s", config.client_name);
+	cfg->ucast_port = config.ucast_port;
+	cfg->mcast_port = config.mcast_port;
+	snprintf(cfg->mcast_group, sizeof(cfg->mcast_group), "%s", config.mcast_gaddr);
+	cfg->bcast_port = config.bcast_port;
+	cfg->packet_validation = config.packet_validation;
+	cfg->location_writeival = config.location_writeival;
+	snprintf(cfg->server_host, sizeof(cfg->server_host), "%s", config.server_host);
+	cfg->server_ctlport = config.server_ctlport;
+	cfg->server_retryival = config.server_retryival;
+	return 1;
+}
+
+int db_getcfg(struct db_config *cfg)
+{
+	PGconn *conn;
 	PGresult *result;
 	struct db_config tcfg;
+	char conn_str[256];
 	char cmd[128];
 	int row;
 
+	if (strcmp(config.sink_type, "pgsql"))
+		return db_localcfg(cfg);
+
+	snprintf(conn_str, sizeof(conn_str),
+		 "host=%s port=%i dbname=%s user=%s password=%s connect_timeout=10",
+		 config.db_addr, config.db_port, config.db_name, config.db_user,
+		 config.db_passwd);
+	conn = PQconnectdb(conn_str);
+	if (PQstatus(conn) != CONNECTION_OK) {
+		debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage(conn));
+		PQfinish(conn);
+		return -1;
+	}
+
 	snprintf(cmd, sizeof(cmd), "SELECT * FROM %s WHERE client_name='%s'",
 		 config.db_tablecfg, config.client_name);
-	result = PQexec(ctx, cmd);
+	result = PQexec(conn, cmd);
 	if (result == NULL || PQresultStatus (result) != PGRES_TUPLES_OK) {
-		debug(DEBUG_ERROR, "%s", PQerrorMessage(ctx));
+		debug(DEBUG_ERROR, "%s", PQerrorMessage(conn));
+		PQclear(result);
+		PQfinish(conn);
 		return -1;
 	}
 
 	row = PQntuples(result);
 	if (row <= 0) {
 		PQclear(result);
+		PQfinish(conn);
 		return 0;
 	}
 
@@ -98,6 +136,7 @@ int db_getcfg(dbctx_t *ctx,
 
 	memcpy(cfg, &tcfg, sizeof(tcfg));
 	PQclear(result);
+	PQfinish(conn);
 	return 1;
 }
 
@@ -1,10 +1,10 @@
 #ifndef _DATABASE_H_
 #define _DATABASE_H_
 
-#include <libpq-fe.h>
 #include <netinet/in.h>
+#include "sink.h"
 
-typedef PGconn dbctx_t;
+typedef struct sink dbctx_t;
 
 struct db_data {
 	char client_name[16];            /* client configured name */
@@ -14,6 +14,7 @@ struct db_data {
 	double gps_lat;                  /* gps latitude */
 	double gps_lon;                  /* gps longitude */
 	int packet_type;                 /* type of packet */
+	unsigned long long seq;          /* client sequence number, 0 if unset */
 };
 
 struct db_config {
@@ -33,11 +34,13 @@ dbctx_t *db_connect(void);
 
 void db_close(dbctx_t *ctx);
 
+int db_ping(dbctx_t *ctx);
+
 int db_insert(dbctx_t *ctx,
-              const struct db_data *data);
+              const struct db_data *data,
+              int n);
 
-int db_getcfg(dbctx_t *ctx,
-	      struct db_config *cfg);
+int db_getcfg(struct db_config *cfg);
 
 void db_debugcfg(const struct db_config *cfg);
 
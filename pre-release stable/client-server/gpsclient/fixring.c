@@ -0,0 +1,129 @@
+#include <string.h>
+#include <math.h>
+#include "fixring.h"
+
+/*
+ * A single writer (the gpsd reader) owns head. Before touching a slot it
+ * makes the slot sequence odd and makes it even again once the copy is
+ * done, readers retry whenever they saw an odd or changed sequence. Every
+ * fix is stored with the local arrival time of its report, so positions
+ * are interpolated on the same clock trigger timestamps are taken from.
+ */
+
+#define METERS_PER_DEGREE 111320.0
+
+struct fixslot {
+	unsigned seq;           /* Odd while slot is being written */
+	double rx;              /* Local receive time of the report */
+	struct gps_fix_t fix;
+};
+
+static struct fixslot slots[FIXRING_SIZE];
+static unsigned head;           /* Number of published fixes */
+
+static double ts2double(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+void fixring_publish(const struct gps_fix_t *fix, const struct timespec *rx)
+{
+	struct fixslot *slot;
+	unsigned seq;
+
+	slot = &slots[head & (FIXRING_SIZE - 1)];
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rx = ts2double(rx);
+	memcpy(&slot->fix, fix, sizeof(slot->fix));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy fix number pos, returns 0 when it was already overwritten */
+static int fixring_read(unsigned pos,
+			double *rx,
+			struct gps_fix_t *fix)
+{
+	struct fixslot *slot;
+	unsigned s1, s2;
+
+	slot = &slots[pos & (FIXRING_SIZE - 1)];
+	do {
+		s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		*rx = slot->rx;
+		memcpy(fix, &slot->fix, sizeof(*fix));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	} while ((s1 & 1) || s1 != s2);
+	return __atomic_load_n(&head, __ATOMIC_ACQUIRE) - pos <= FIXRING_SIZE;
+}
+
+/* Returns 1 and the most recent fix, 0 when no fix was published yet */
+int fixring_latest(struct gps_fix_t *fix)
+{
+	unsigned h;
+	double rx;
+
+	h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	if (!h)
+		return 0;
+	return fixring_read(h - 1, &rx, fix);
+}
+
+/*
+ * Dead reckoning from fix along its track. A stale fix or one without
+ * speed and track is left as it is, its time included, so it is not
+ * reported as a current position.
+ */
+static void fix_extrapolate(struct gps_fix_t *fix, double dt)
+{
+	double dist, rad;
+
+	if (isnan(fix->speed) || isnan(fix->track) || dt > FIXRING_MAXEXTRAP)
+		return;
+	fix->time += dt;
+	dist = fix->speed * dt;
+	rad = fix->track * M_PI / 180.0;
+	fix->latitude += dist * cos(rad) / METERS_PER_DEGREE;
+	fix->longitude += dist * sin(rad) /
+			  (METERS_PER_DEGREE * cos(fix->latitude * M_PI / 180.0));
+}
+
+/*
+ * Position at local time ts: interpolated between the two fixes received
+ * around ts or extrapolated from the newest one. Returns 0 when no fix is
+ * available.
+ */
+int fixring_at(const struct timespec *ts, struct gps_fix_t *fix)
+{
+	struct gps_fix_t prev;
+	double t, rx, prx, f;
+	unsigned h, pos;
+
+	h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	if (!h || !fixring_read(h - 1, &rx, fix))
+		return 0;
+	t = ts2double(ts);
+	if (t >= rx) {
+		fix_extrapolate(fix, t - rx);
+		return 1;
+	}
+
+	for (pos = h - 1; pos > 0 && h - pos < FIXRING_SIZE; pos--) {
+		if (!fixring_read(pos - 1, &prx, &prev))
+			break;
+		if (prx <= t) {
+			f = prx < rx ? (t - prx) / (rx - prx) : 0.0;
+			fix->latitude = prev.latitude + f * (fix->latitude - prev.latitude);
+			fix->longitude = prev.longitude + f * (fix->longitude - prev.longitude);
+			fix->time = prev.time + f * (fix->time - prev.time);
+			return 1;
+		}
+		memcpy(fix, &prev, sizeof(*fix));
+		rx = prx;
+	}
+	/* Older than history, oldest fix is the best we have */
+	return 1;
+}
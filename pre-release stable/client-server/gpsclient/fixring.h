@@ -0,0 +1,19 @@
+/*
+ * History of the last GPS fixes published through per-slot sequence
+ * locks, readers never block the gpsd reader
+ */
+
+#ifndef _FIXRING_H_
+#define _FIXRING_H_
+
+#include <time.h>
+#include <gps.h>
+
+#define FIXRING_SIZE      32   /* Power of two */
+#define FIXRING_MAXEXTRAP 2.0  /* Seconds a fix may be extrapolated */
+
+void fixring_publish(const struct gps_fix_t *fix, const struct timespec *rx);
+int fixring_latest(struct gps_fix_t *fix);
+int fixring_at(const struct timespec *ts, struct gps_fix_t *fix);
+
+#endif /* _FIXRING_H_ */
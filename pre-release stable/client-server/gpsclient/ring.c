@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+
+/*
+ * Every slot carries a sequence number telling whether it is free for the
+ * writer at position pos (seq == pos) or holds data for the reader at
+ * position pos (seq == pos + 1). Writers claim a position with a CAS on
+ * head, so no lock is ever taken on the insert path.
+ */
+
+int ring_init(struct ring *r, unsigned size, size_t elem)
+{
+	unsigned i, n;
+
+	n = 2;
+	while (n < size)
+		n <<= 1;
+
+	memset(r, 0, sizeof(*r));
+	r->seq = malloc(n * sizeof(unsigned));
+	r->data = malloc(n * elem);
+	if (!r->seq || !r->data) {
+		free(r->seq);
+		free(r->data);
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		r->seq[i] = i;
+	r->size = n;
+	r->mask = n - 1;
+	r->elem = elem;
+	return 1;
+}
+
+void ring_free(struct ring *r)
+{
+	free(r->seq);
+	free(r->data);
+	memset(r, 0, sizeof(*r));
+}
+
+/* Returns 1 when item was queued, 0 when ring is full */
+int ring_push(struct ring *r, const void *item)
+{
+	unsigned pos, seq;
+	int diff;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		seq = __atomic_load_n(&r->seq[pos & r->mask], __ATOMIC_ACQUIRE);
+		diff = (int) (seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	}
+	memcpy(r->data + (pos & r->mask) * r->elem, item, r->elem);
+	__atomic_store_n(&r->seq[pos & r->mask], pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Returns 1 when an item was dequeued, 0 when ring is empty */
+int ring_pop(struct ring *r, void *item)
+{
+	unsigned pos, seq;
+	int diff;
+
+	pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		seq = __atomic_load_n(&r->seq[pos & r->mask], __ATOMIC_ACQUIRE);
+		diff = (int) (seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+	memcpy(item, r->data + (pos & r->mask) * r->elem, r->elem);
+	__atomic_store_n(&r->seq[pos & r->mask], pos + r->size, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Approximate number of queued items */
+unsigned ring_count(struct ring *r)
+{
+	unsigned head, tail;
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	return head - tail;
+}
@@ -0,0 +1,27 @@
+/*
+ * Bounded lock-free ring of fixed-size elements, safe for multiple
+ * producers and a single consumer
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+
+struct ring {
+	unsigned size;          /* number of slots, power of two */
+	unsigned mask;          /* size - 1 */
+	size_t elem;            /* element size in bytes */
+	unsigned head;          /* next position to be written */
+	unsigned tail;          /* next position to be read */
+	unsigned *seq;          /* per slot sequence number */
+	char *data;             /* slot storage */
+};
+
+int ring_init(struct ring *r, unsigned size, size_t elem);
+void ring_free(struct ring *r);
+int ring_push(struct ring *r, const void *item);
+int ring_pop(struct ring *r, void *item);
+unsigned ring_count(struct ring *r);
+
+#endif /* _RING_H_ */
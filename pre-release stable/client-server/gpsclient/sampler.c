@@ -0,0 +1,92 @@
+#include <string.h>
+#include <math.h>
+#include "config.h"
+#include "sampler.h"
+
+/*
+ * Dead-band compression of location samples. A sample is stored when it
+ * is location-min-distance meters away from the last stored one, when the
+ * heading changed by location-min-heading degrees or when
+ * location-max-interval seconds passed. On a turn the sample preceding it
+ * is stored as well, so corners of the track are kept.
+ */
+
+#define METERS_PER_DEGREE 111320.0
+#define RAD(x) ((x) * M_PI / 180.0)
+
+static struct gps_fix_t last;   /* Last stored sample */
+static struct gps_fix_t prev;   /* Last sample seen */
+static int have_last, prev_stored;
+
+static double distance(const struct gps_fix_t *a, const struct gps_fix_t *b)
+{
+	double dy, dx;
+
+	dy = (b->latitude - a->latitude) * METERS_PER_DEGREE;
+	dx = (b->longitude - a->longitude) * METERS_PER_DEGREE *
+	     cos(RAD((a->latitude + b->latitude) / 2));
+	return sqrt(dx * dx + dy * dy);
+}
+
+/* Heading at b in degrees, NAN when it can not be told */
+static double heading(const struct gps_fix_t *a, const struct gps_fix_t *b)
+{
+	double dy, dx, h;
+
+	if (!isnan(b->track) && !isnan(b->speed) && b->speed >= SAMPLER_MINSPEED)
+		return b->track;
+	dy = (b->latitude - a->latitude) * METERS_PER_DEGREE;
+	dx = (b->longitude - a->longitude) * METERS_PER_DEGREE * cos(RAD(a->latitude));
+	if (sqrt(dx * dx + dy * dy) < 1.0)
+		return NAN;
+	h = atan2(dx, dy) * 180.0 / M_PI;
+	return h < 0 ? h + 360.0 : h;
+}
+
+static double heading_diff(double a, double b)
+{
+	double d;
+
+	d = fabs(a - b);
+	return d > 180.0 ? 360.0 - d : d;
+}
+
+/* Returns number of samples to store in out, at most two */
+int sampler_feed(const struct gps_fix_t *fix, struct gps_fix_t *out)
+{
+	double hlast, hcur;
+	int n = 0, turn = 0;
+
+	if (config.location_min_distance <= 0 && config.location_min_heading <= 0 &&
+	    config.location_max_interval <= 0) {
+		memcpy(out, fix, sizeof(*out));
+		return 1;
+	}
+
+	if (have_last) {
+		if (config.location_min_heading > 0) {
+			hlast = heading(&last, &prev);
+			hcur = heading(&prev, fix);
+			turn = !isnan(hlast) && !isnan(hcur) &&
+			       heading_diff(hlast, hcur) >= config.location_min_heading;
+		}
+		if (!turn &&
+		    (config.location_min_distance <= 0 ||
+		     distance(&last, fix) < config.location_min_distance) &&
+		    (config.location_max_interval <= 0 ||
+		     fix->time - last.time < config.location_max_interval)) {
+			memcpy(&prev, fix, sizeof(prev));
+			prev_stored = 0;
+			return 0;
+		}
+		/* Keep the corner the client turned at */
+		if (turn && !prev_stored)
+			memcpy(&out[n++], &prev, sizeof(*out));
+	}
+
+	memcpy(&out[n++], fix, sizeof(*out));
+	memcpy(&last, fix, sizeof(last));
+	memcpy(&prev, fix, sizeof(prev));
+	have_last = prev_stored = 1;
+	return n;
+}
@@ -0,0 +1,15 @@
+/*
+ * Motion-adaptive location sampling, a fix is only stored once the client
+ * moved, turned or stayed silent for long enough
+ */
+
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include <gps.h>
+
+#define SAMPLER_MINSPEED 0.5   /* m/s below which gpsd track is noise */
+
+int sampler_feed(const struct gps_fix_t *fix, struct gps_fix_t *out);
+
+#endif /* _SAMPLER_H_ */
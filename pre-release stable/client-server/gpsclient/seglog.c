@@ -0,0 +1,353 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "database.h"
+#include "crc16.h"
+#include "utils.h"
+#include "buffer.h"
+#include "seglog.h"
+
+/*
+ * Records are appended to <buffer-file>.NNNNNNNN segment files, each one
+ * holding SEGLOG_RECORDS slots. The uploader reads them back in order and
+ * keeps its position in <buffer-file>.cursor, a segment is unlinked once
+ * every record in it has been inserted to database.
+ */
+
+#define SEGLOG_SIZE       (SEGLOG_RECORDS * sizeof(struct seglog_rec))
+
+struct seglog_cursor {
+	unsigned short magic;   /* SEGLOG_MAGIC */
+	unsigned short crc;     /* CRC16 of seg and off */
+	unsigned int seg;       /* Segment being read */
+	unsigned int off;       /* Next record to read in segment */
+};
+
+static pthread_mutex_t segmutex = PTHREAD_MUTEX_INITIALIZER;
+static struct seglog_rec *wmap;  /* Segment being written */
+static unsigned wseg, woff;
+static struct seglog_rec *rmap;  /* Segment being read */
+static unsigned rseg, roff;
+static unsigned saved_seg, saved_off;
+static int nrecs;                /* Records not uploaded yet */
+static int curfd = -1;
+
+static void seglog_path(char *path, size_t len, unsigned seg)
+{
+	snprintf(path, len, "%s.%.8u", config.buffer_file, seg);
+}
+
+static int seglog_exists(unsigned seg)
+{
+	char path[300];
+
+	seglog_path(path, sizeof(path), seg);
+	return access(path, F_OK) == 0;
+}
+
+static struct seglog_rec *seglog_map(unsigned seg)
+{
+	char path[300];
+	struct stat st;
+	void *p;
+	int fd;
+
+	seglog_path(path, sizeof(path), seg);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		debug(DEBUG_ERROR, "could not open segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	/* New or short segments are extended with zeroes, i.e. empty slots */
+	if (fstat(fd, &st) == -1 ||
+	    (st.st_size != SEGLOG_SIZE && ftruncate(fd, SEGLOG_SIZE) == -1)) {
+		debug(DEBUG_ERROR, "could not size segment %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, SEGLOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		debug(DEBUG_ERROR, "could not map segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	return p;
+}
+
+static int seglog_valid(const struct seglog_rec *rec)
+{
+	return rec->magic == SEGLOG_MAGIC &&
+	       rec->crc == crc16(0, (char*) &rec->data, sizeof(rec->data));
+}
+
+/* Number of valid records in a sealed segment */
+static int seglog_count_segment(unsigned seg)
+{
+	struct seglog_rec *map;
+	int i, n = 0;
+
+	map = seglog_map(seg);
+	if (!map)
+		return 0;
+	for (i = 0; i < SEGLOG_RECORDS && map[i].magic; i++)
+		n += seglog_valid(&map[i]);
+	munmap(map, SEGLOG_SIZE);
+	return n;
+}
+
+/* Persist read position, sync to disk when a segment was released */
+static void seglog_save(int sync)
+{
+	struct seglog_cursor cur;
+
+	if (rseg == saved_seg && roff == saved_off)
+		return;
+	memset(&cur, 0, sizeof(cur));
+	cur.magic = SEGLOG_MAGIC;
+	cur.seg = rseg;
+	cur.off = roff;
+	cur.crc = crc16(0, (char*) &cur.seg, sizeof(cur) - 4);
+	if (pwrite(curfd, &cur, sizeof(cur), 0) != sizeof(cur)) {
+		debug(DEBUG_ERROR, "could not write segment cursor: %s", strerror(errno));
+		return;
+	}
+	if (sync)
+		fdatasync(curfd);
+	saved_seg = rseg;
+	saved_off = roff;
+}
+
+int seglog_open(void)
+{
+	char path[300];
+	struct seglog_cursor cur;
+	unsigned seg, i;
+
+	snprintf(path, sizeof(path), "%s.cursor", config.buffer_file);
+	curfd = open(path, O_RDWR | O_CREAT, 0644);
+	if (curfd == -1) {
+		debug(DEBUG_ERROR, "could not open segment cursor %s: %s", path, strerror(errno));
+		return 0;
+	}
+	if (pread(curfd, &cur, sizeof(cur), 0) == sizeof(cur) && cur.magic == SEGLOG_MAGIC &&
+	    cur.crc == crc16(0, (char*) &cur.seg, sizeof(cur) - 4)) {
+		rseg = cur.seg;
+		roff = cur.off < SEGLOG_RECORDS ? cur.off : SEGLOG_RECORDS;
+	} else
+		rseg = roff = 0;
+
+	/* Segment may have been released before the cursor was saved */
+	while (!seglog_exists(rseg) && seglog_exists(rseg + 1)) {
+		rseg++;
+		roff = 0;
+	}
+	saved_seg = rseg;
+	saved_off = roff;
+
+	/* Writer continues after the last complete record of the last segment */
+	wseg = rseg;
+	while (seglog_exists(wseg + 1))
+		wseg++;
+	rmap = seglog_map(rseg);
+	wmap = seglog_map(wseg);
+	if (!rmap || !wmap)
+		return 0;
+	/* A torn write may leave invalid slots before later complete records,
+	 * appending after the last valid one keeps those records */
+	for (woff = SEGLOG_RECORDS; woff > 0; woff--)
+		if (seglog_valid(&wmap[woff - 1]))
+			break;
+	if (wseg == rseg && roff > woff)
+		roff = woff;
+
+	nrecs = 0;
+	for (i = wseg == rseg ? roff : 0; i < woff; i++)
+		nrecs += seglog_valid(&wmap[i]);
+	if (wseg != rseg) {
+		for (i = roff; i < SEGLOG_RECORDS && rmap[i].magic; i++)
+			nrecs += seglog_valid(&rmap[i]);
+		for (seg = rseg + 1; seg < wseg; seg++)
+			nrecs += seglog_count_segment(seg);
+	}
+
+	debug(DEBUG_INFO, "segment log read=%u:%u write=%u:%u records=%i",
+	      rseg, roff, wseg, woff, nrecs);
+	return 1;
+}
+
+int seglog_append(const struct db_data *db)
+{
+	struct seglog_rec *rec, *map;
+
+	pthread_mutex_lock(&segmutex);
+	if (woff == SEGLOG_RECORDS) {
+		map = seglog_map(wseg + 1);
+		if (!map) {
+			pthread_mutex_unlock(&segmutex);
+			return 0;
+		}
+		msync(wmap, SEGLOG_SIZE, MS_ASYNC);
+		munmap(wmap, SEGLOG_SIZE);
+		wmap = map;
+		wseg++;
+		woff = 0;
+	}
+	rec = &wmap[woff];
+	memcpy(&rec->data, db, sizeof(rec->data));
+	rec->crc = crc16(0, (char*) &rec->data, sizeof(rec->data));
+	rec->magic = SEGLOG_MAGIC;
+	woff++;
+	nrecs++;
+	pthread_mutex_unlock(&segmutex);
+	return 1;
+}
+
+/* Upload segment records, returns 0 when database is failing */
+int seglog_process(dbctx_t *dbctx)
+{
+	static struct db_data batch[BUFFER_BATCH];
+	char path[300];
+	unsigned end, i;
+	int last, n, ret = 1;
+
+	for (;;) {
+		if (!rmap && !(rmap = seglog_map(rseg)))
+			break;
+
+		pthread_mutex_lock(&segmutex);
+		last = (rseg == wseg);
+		end = last ? woff : SEGLOG_RECORDS;
+		pthread_mutex_unlock(&segmutex);
+
+		while (roff < end) {
+			/* Collect a batch, sealed segments may end early once thinned */
+			for (i = roff, n = 0; i < end && n < BUFFER_BATCH; i++) {
+				if (!last && rmap[i].magic == 0) {
+					i = end;
+					break;
+				}
+				if (seglog_valid(&rmap[i]))
+					memcpy(&batch[n++], &rmap[i].data, sizeof(batch[0]));
+				else
+					debug(DEBUG_WARNING, "skipping corrupted record %u:%u", rseg, i);
+			}
+			if (n && !db_insert(dbctx, batch, n)) {
+				ret = 0;
+				break;
+			}
+			pthread_mutex_lock(&segmutex);
+			nrecs -= n;
+			pthread_mutex_unlock(&segmutex);
+			roff = i;
+			seglog_save(0);
+		}
+		if (!ret || last)
+			break;
+
+		/* Every record was acknowledged, release the segment */
+		munmap(rmap, SEGLOG_SIZE);
+		rmap = NULL;
+		seglog_path(path, sizeof(path), rseg);
+		unlink(path);
+		rseg++;
+		roff = 0;
+		seglog_save(1);
+	}
+	seglog_save(0);
+	return ret;
+}
+
+int seglog_count(void)
+{
+	int n;
+
+	pthread_mutex_lock(&segmutex);
+	n = nrecs;
+	pthread_mutex_unlock(&segmutex);
+	return n;
+}
+
+/*
+ * Keep only the first location record of every step seconds in a sealed
+ * segment. Kept records are packed to the front and the segment is
+ * replaced through a rename, the unused tail is left as a hole.
+ */
+static int seglog_thin_segment(unsigned seg, unsigned step)
+{
+	char path[300], tmp[310];
+	struct seglog_rec *map, *buf;
+	long long bucket, last = -1;
+	int i, n, fd, removed;
+
+	map = seglog_map(seg);
+	if (!map)
+		return 0;
+	buf = malloc(SEGLOG_SIZE);
+	if (!buf) {
+		munmap(map, SEGLOG_SIZE);
+		return 0;
+	}
+	for (i = n = removed = 0; i < SEGLOG_RECORDS && map[i].magic; i++) {
+		if (!seglog_valid(&map[i]))
+			continue;
+		if (map[i].data.packet_type == CONFIG_MANUAL) {
+			bucket = (long long) (map[i].data.gps_tsp / step);
+			if (bucket == last) {
+				removed++;
+				continue;
+			}
+			last = bucket;
+		}
+		buf[n++] = map[i];
+	}
+	munmap(map, SEGLOG_SIZE);
+	if (!removed) {
+		free(buf);
+		return 0;
+	}
+
+	seglog_path(path, sizeof(path), seg);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 ||
+	    write(fd, buf, n * sizeof(*buf)) != n * sizeof(*buf) ||
+	    ftruncate(fd, SEGLOG_SIZE) == -1 ||
+	    fdatasync(fd) == -1 ||
+	    rename(tmp, path) == -1) {
+		debug(DEBUG_ERROR, "could not thin segment %s: %s", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		unlink(tmp);
+		free(buf);
+		return 0;
+	}
+	close(fd);
+	free(buf);
+	return removed;
+}
+
+/* Thin every sealed segment not being read, returns remaining records */
+int seglog_thin(unsigned step)
+{
+	unsigned seg, sealed;
+	int removed = 0;
+
+	pthread_mutex_lock(&segmutex);
+	sealed = wseg;
+	pthread_mutex_unlock(&segmutex);
+
+	for (seg = rseg + 1; seg < sealed; seg++)
+		removed += seglog_thin_segment(seg, step);
+
+	pthread_mutex_lock(&segmutex);
+	nrecs -= removed;
+	pthread_mutex_unlock(&segmutex);
+	return seglog_count();
+}
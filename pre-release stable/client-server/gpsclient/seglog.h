@@ -0,0 +1,27 @@
+/*
+ * Append-only log of fixed-size mmap'd segment files, used as an
+ * alternative to the SQLite buffer file
+ */
+
+#ifndef _SEGLOG_H_
+#define _SEGLOG_H_
+
+#include "database.h"
+
+#define SEGLOG_MAGIC    0x5347
+#define SEGLOG_RECORDS  1024
+
+struct seglog_rec {
+	unsigned short magic;   /* SEGLOG_MAGIC once record is complete */
+	unsigned short crc;     /* CRC16 of data */
+	unsigned int pad;       /* Unused */
+	struct db_data data;    /* Buffered record */
+};
+
+int seglog_open(void);
+int seglog_append(const struct db_data *db);
+int seglog_process(dbctx_t *dbctx);
+int seglog_count(void);
+int seglog_thin(unsigned step);
+
+#endif /* _SEGLOG_H_ */
@@ -0,0 +1,213 @@
+#!/usr/bin/env python
+"""
+Online conversion of a v1 gpsdata table to the typed schema v2.
+
+Rows are copied in uid ranges into a new table, one transaction per batch,
+so the servers and clients keep writing to the old table meanwhile. The
+copy resumes from the highest uid already in the new table when it is run
+again. Each pass copies up to a watermark uid read under a short EXCLUSIVE
+lock, so writers still holding a lower uid have committed by then. A lock
+request that waits longer than --lock-timeout, e.g. behind an nmeaimport
+COPY, gives up and is tried again, the writers would queue behind it. Values
+v2 cannot hold (empty or malformed coordinates and addresses) are stored
+as NULL. The v2 table is created unless it exists, so it can be set up
+beforehand, e.g. partitioned with database_partitioned.sql.
+
+With --swap the last rows are copied under an EXCLUSIVE lock, which blocks
+writers but not readers, and the tables are renamed so that the v2 table
+takes the old name. The v1 table is kept as <table>_v1. gpsdata is append
+only, rows updated in the old table after they were copied are not seen.
+
+Usage: gpsdata_migrate.py [options] <connection-string>, see --help.
+"""
+
+from __future__ import print_function
+
+import optparse
+import sys
+import time
+import psycopg2
+from psycopg2 import errorcodes
+
+# Anything else is written as NULL
+NUMBER_RE = r'^\s*[-+]?([0-9]+\.?[0-9]*|\.[0-9]+)([eE][-+]?[0-9]+)?\s*$'
+OCTET_RE = r'(25[0-5]|2[0-4][0-9]|1[0-9][0-9]|[1-9]?[0-9])'
+INET_RE = r'^' + OCTET_RE + r'(\.' + OCTET_RE + r'){3}$'
+
+CREATE_SQL = '''
+CREATE TABLE IF NOT EXISTS {0} (
+    uid SERIAL PRIMARY KEY,
+    client_name VARCHAR(100),
+    client_ip INET,
+    sender_ip INET,
+    client_timestamp INTEGER,
+    client_lat DOUBLE PRECISION,
+    client_long DOUBLE PRECISION,
+    event_type SMALLINT,
+    client_seq BIGINT
+);
+CREATE UNIQUE INDEX IF NOT EXISTS {0}_client_seq ON {0}(client_name, client_seq);
+CREATE INDEX IF NOT EXISTS {0}_client_tsp ON {0}(client_name, client_timestamp);
+CREATE INDEX IF NOT EXISTS {0}_tsp ON {0}(client_timestamp);
+'''
+
+COPY_SQL = '''
+INSERT INTO {1} (uid, client_name, client_ip, sender_ip, client_timestamp,
+                 client_lat, client_long, event_type, client_seq)
+SELECT uid, client_name,
+       CASE WHEN client_ip ~ %(inet)s THEN client_ip::inet END,
+       CASE WHEN sender_ip ~ %(inet)s THEN sender_ip::inet END,
+       client_timestamp,
+       CASE WHEN client_lat ~ %(number)s THEN client_lat::double precision END,
+       CASE WHEN client_long ~ %(number)s THEN client_long::double precision END,
+       CASE WHEN event_type ~ '^[0-9]$' THEN event_type::smallint END,
+       client_seq
+FROM {0} WHERE uid > %(lo)s AND uid <= %(hi)s
+ON CONFLICT DO NOTHING
+'''
+
+
+def parse_options():
+    p = optparse.OptionParser(usage='%prog [options] <connection-string>')
+    p.add_option('-s', '--source', default='gpsdata', help='v1 table (gpsdata)')
+    p.add_option('-t', '--target', help='v2 table (<source>_v2)')
+    p.add_option('-b', '--batch', type='int', default=20000, help='rows per transaction')
+    p.add_option('-p', '--pause', type='int', default=0, help='ms to sleep between batches')
+    p.add_option('-l', '--lock-timeout', type='int', default=1000,
+                 help='ms to wait for the table lock before trying again later (1000)')
+    p.add_option('--swap', action='store_true',
+                 help='finish under lock and rename the v2 table to <source>')
+    opts, args = p.parse_args()
+    if len(args) != 1:
+        p.error('connection string expected')
+    if opts.batch <= 0:
+        p.error('batch must be positive')
+    if opts.lock_timeout <= 0:
+        p.error('lock timeout must be positive')
+    if not opts.target:
+        opts.target = opts.source + '_v2'
+    return opts, args[0]
+
+
+def max_uid(cur, table):
+    cur.execute('SELECT COALESCE(MAX(uid), 0) FROM {0}'.format(table))
+    return cur.fetchone()[0]
+
+
+# EXCLUSIVE lock on the source, False when a long writer holds the table.
+# Writers queue behind a waiting lock request, so it gives up early.
+def lock_source(conn, cur, opts):
+    try:
+        cur.execute('SET LOCAL lock_timeout = {0}'.format(opts.lock_timeout))
+        cur.execute('LOCK TABLE {0} IN EXCLUSIVE MODE'.format(opts.source))
+    except psycopg2.OperationalError as e:
+        if e.pgcode != errorcodes.LOCK_NOT_AVAILABLE:
+            raise
+        conn.rollback()
+        print('{0} is busy, trying again'.format(opts.source))
+        sys.stdout.flush()
+        time.sleep(1)
+        return False
+    return True
+
+
+# Highest uid of the source with every lower uid committed
+def watermark(conn, opts):
+    cur = conn.cursor()
+    while not lock_source(conn, cur, opts):
+        pass
+    hi = max_uid(cur, opts.source)
+    conn.commit()
+    cur.close()
+    return hi
+
+
+def copy_range(cur, opts, lo, hi):
+    cur.execute(COPY_SQL.format(opts.source, opts.target),
+                {'inet': INET_RE, 'number': NUMBER_RE, 'lo': lo, 'hi': hi})
+    return cur.rowcount
+
+
+# Copy everything committed up to now, one transaction per batch
+def copy_batches(conn, opts):
+    cur = conn.cursor()
+    last = max_uid(cur, opts.target)
+    total = 0
+    while True:
+        hi = watermark(conn, opts)
+        if last >= hi:
+            break
+        while last < hi:
+            n = copy_range(cur, opts, last, min(last + opts.batch, hi))
+            conn.commit()
+            last = min(last + opts.batch, hi)
+            total += n
+            print('uid {0}/{1}, {2} row(s) copied'.format(last, hi, total))
+            sys.stdout.flush()
+            if opts.pause:
+                time.sleep(opts.pause / 1000.0)
+    cur.close()
+    return last
+
+
+# Rename the table, its partitions, the indexes of both and the uid sequence
+# from one prefix to another
+def rename(cur, old, new):
+    cur.execute("SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+                "WHERE i.inhparent = %s::regclass", (old, ))
+    parts = [r[0] for r in cur.fetchall()]
+    cur.execute("SELECT indexname FROM pg_indexes WHERE tablename = ANY(%s)", ([old] + parts, ))
+    indexes = [r[0] for r in cur.fetchall()]
+    cur.execute("SELECT pg_get_serial_sequence(%s, 'uid')", (old, ))
+    seq = cur.fetchone()[0]
+    cur.execute('ALTER TABLE {0} RENAME TO {1}'.format(old, new))
+    for idx in indexes:
+        if idx.startswith(old + '_'):
+            cur.execute('ALTER INDEX {0} RENAME TO {1}'.format(idx, new + idx[len(old):]))
+    for part in parts:
+        if part.startswith(old + '_'):
+            cur.execute('ALTER TABLE {0} RENAME TO {1}'.format(part, new + part[len(old):]))
+    if seq:
+        name = seq.split('.')[-1]
+        if name.startswith(old + '_'):
+            cur.execute('ALTER SEQUENCE {0} RENAME TO {1}'.format(seq, new + name[len(old):]))
+
+
+def swap(conn, opts, last):
+    cur = conn.cursor()
+    while not lock_source(conn, cur, opts):
+        last = copy_batches(conn, opts)
+    # Rows up to the last watermark are copied, the rest committed before the lock
+    n = copy_range(cur, opts, last, max_uid(cur, opts.source))
+    print('{0} row(s) copied under lock'.format(n))
+    rename(cur, opts.source, opts.source + '_v1')
+    rename(cur, opts.target, opts.source)
+    cur.execute("SELECT setval(pg_get_serial_sequence(%s, 'uid'), "
+                "(SELECT COALESCE(MAX(uid), 0) + 1 FROM {0}), false)".format(opts.source),
+                (opts.source, ))
+    conn.commit()
+    cur.close()
+    print('{0} is now v2, old data kept in {0}_v1'.format(opts.source))
+
+
+def main():
+    opts, connstr = parse_options()
+    try:
+        conn = psycopg2.connect(connstr)
+        cur = conn.cursor()
+        cur.execute('SELECT to_regclass(%s)', (opts.target, ))
+        if cur.fetchone()[0] is None:
+            cur.execute(CREATE_SQL.format(opts.target))
+        conn.commit()
+        cur.close()
+        last = copy_batches(conn, opts)
+        if opts.swap:
+            swap(conn, opts, last)
+        conn.close()
+    except psycopg2.Error as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
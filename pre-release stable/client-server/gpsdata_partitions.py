@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+"""
+Partition maintenance for the gpsdata table of database_partitioned.sql.
+
+Creates the partitions for the coming days and, with --keep, detaches and
+drops the partitions older than that. Meant to run daily from cron:
+
+  15 0 * * * gpsdata_partitions.py -k 90 'host=localhost dbname=test user=postgres'
+
+Usage: gpsdata_partitions.py [options] <connection-string>, see --help.
+"""
+
+from __future__ import print_function
+
+import optparse
+import sys
+import psycopg2
+
+
+def parse_options():
+    p = optparse.OptionParser(usage='%prog [options] <connection-string>')
+    p.add_option('-t', '--table', default='gpsdata', help='partitioned table (gpsdata)')
+    p.add_option('-a', '--ahead', type='int', default=7, help='days to create ahead (7)')
+    p.add_option('-u', '--unit', default='day', help='partition range, day or week (day)')
+    p.add_option('-k', '--keep', type='int', default=0,
+                 help='days of data to keep, older partitions are removed (0, keep all)')
+    p.add_option('--detach', action='store_true',
+                 help='only detach old partitions, e.g. to archive them')
+    opts, args = p.parse_args()
+    if len(args) != 1:
+        p.error('connection string expected')
+    if opts.unit not in ('day', 'week'):
+        p.error('unit must be day or week')
+    return opts, args[0]
+
+
+def main():
+    opts, connstr = parse_options()
+    try:
+        conn = psycopg2.connect(connstr)
+        cur = conn.cursor()
+        cur.execute('SELECT gpsdata_create_partitions(%s::interval, %s, %s)',
+                    ('{0} days'.format(opts.ahead), opts.unit, opts.table))
+        print('{0} partition(s) created'.format(cur.fetchone()[0]))
+        if opts.keep > 0:
+            cur.execute('SELECT gpsdata_drop_partitions(%s::interval, %s, %s)',
+                        ('{0} days'.format(opts.keep), not opts.detach, opts.table))
+            print('{0} partition(s) {1}'.format(cur.fetchone()[0],
+                                                'detached' if opts.detach else 'dropped'))
+        conn.commit()
+        conn.close()
+    except psycopg2.Error as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
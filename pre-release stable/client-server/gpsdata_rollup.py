@@ -0,0 +1,178 @@
+#!/usr/bin/env python
+"""
+Hourly rollup of the gpsdata location events for aggregation-engine rollup
+of aggregator.py.
+
+The rollup table holds one row per hour, client, base grid cell and event
+type with the number of events. Base cells are grid boxes of --base meters
+laid out from --origin the way aggregator.py lays out its grid from
+corner1, so a report with the same corner1 and a grid-size that is a
+multiple of --base sums whole base cells. Only EVENT_LOCAL to EVENT_ACK
+rows with coordinates are counted, and schema v2 (database_v2.sql) is
+expected.
+
+Each run adds the rows that arrived since the last one, up to a watermark
+uid kept with the grid in <rollup>_state. The watermark is read under a
+short EXCLUSIVE lock, so writers still holding a lower uid have committed
+by then. When the lock is not granted within --lock-timeout, e.g. behind an
+nmeaimport COPY, the run ends and the next one catches up, the writers would
+queue behind the waiting request. The first run creates both tables and
+needs --origin, corner1 of aggregator.conf, e.g. every few minutes from cron:
+
+  */5 * * * * gpsdata_rollup.py -o 40.627813,-89.476823 'host=localhost dbname=test user=postgres'
+
+Usage: gpsdata_rollup.py [options] <connection-string>, see --help.
+"""
+
+from __future__ import print_function
+
+import math
+import optparse
+import sys
+import psycopg2
+from psycopg2 import errorcodes
+
+LAT_PER_METER = 0.00001  # As aggregator.py
+
+CREATE_SQL = '''
+CREATE TABLE IF NOT EXISTS {0} (
+    hour INTEGER,
+    client_name VARCHAR(100),
+    cell_lat INTEGER,
+    cell_long INTEGER,
+    event_type SMALLINT,
+    events INTEGER,
+    PRIMARY KEY(hour, client_name, cell_lat, cell_long, event_type)
+);
+CREATE TABLE IF NOT EXISTS {0}_state (
+    last_uid BIGINT,
+    base_grid INTEGER,
+    origin_lat DOUBLE PRECISION,
+    origin_long DOUBLE PRECISION
+)
+'''
+
+# Coordinates have 6 decimals and often lie on a grid line, the division may
+# put them a rounding error short of it. They belong to the cell starting at
+# the line, as in get_boxcorner() of aggregator.py.
+ROLLUP_SQL = '''
+INSERT INTO {1} (hour, client_name, cell_lat, cell_long, event_type, events)
+SELECT client_timestamp - client_timestamp % 3600,
+       client_name,
+       CAST(floor((client_lat - %(lat)s) / %(lat_step)s + 1e-6) AS INTEGER),
+       CAST(floor((%(long)s - client_long) / %(long_step)s + 1e-6) AS INTEGER),
+       event_type, COUNT(*)
+FROM {0} WHERE uid > %(lo)s AND uid <= %(hi)s AND event_type IN (0,1,2,3,4)
+AND client_lat IS NOT NULL AND client_long IS NOT NULL
+GROUP BY 1, 2, 3, 4, 5
+ON CONFLICT (hour, client_name, cell_lat, cell_long, event_type)
+DO UPDATE SET events = {1}.events + EXCLUDED.events
+'''
+
+
+def parse_options():
+    p = optparse.OptionParser(usage='%prog [options] <connection-string>')
+    p.add_option('-s', '--source', default='gpsdata', help='GPS data table (gpsdata)')
+    p.add_option('-r', '--rollup', default='gpsrollup', help='rollup table (gpsrollup)')
+    p.add_option('-g', '--base', type='int', default=10,
+                 help='base grid size in meters, first run only (10)')
+    p.add_option('-o', '--origin', help='grid origin lat,long, first run only')
+    p.add_option('-b', '--batch', type='int', default=100000, help='rows per transaction')
+    p.add_option('-l', '--lock-timeout', type='int', default=1000,
+                 help='ms to wait for the watermark lock (1000)')
+    opts, args = p.parse_args()
+    if len(args) != 1:
+        p.error('connection string expected')
+    if opts.base <= 0 or opts.batch <= 0 or opts.lock_timeout <= 0:
+        p.error('base, batch and lock timeout must be positive')
+    if opts.origin:
+        try:
+            opts.origin = [float(v) for v in opts.origin.split(',')]
+        except ValueError:
+            opts.origin = []
+        if len(opts.origin) != 2:
+            p.error('origin must be lat,long')
+    return opts, args[0]
+
+
+# Create the tables unless they exist, returns base_grid, origin_lat, origin_long
+def setup(conn, opts):
+    cur = conn.cursor()
+    cur.execute(CREATE_SQL.format(opts.rollup))
+    cur.execute('SELECT base_grid, origin_lat, origin_long FROM {0}_state'.format(opts.rollup))
+    row = cur.fetchone()
+    if row is None:
+        if not opts.origin:
+            raise ValueError('{0} is new, --origin is required'.format(opts.rollup))
+        row = (opts.base, opts.origin[0], opts.origin[1])
+        cur.execute('INSERT INTO {0}_state VALUES (0, %s, %s, %s)'.format(opts.rollup), row)
+    conn.commit()
+    cur.close()
+    return row
+
+
+# None when a long writer holds the source
+def watermark(conn, opts):
+    cur = conn.cursor()
+    try:
+        cur.execute('SET LOCAL lock_timeout = {0}'.format(opts.lock_timeout))
+        cur.execute('LOCK TABLE {0} IN EXCLUSIVE MODE'.format(opts.source))
+    except psycopg2.OperationalError as e:
+        if e.pgcode != errorcodes.LOCK_NOT_AVAILABLE:
+            raise
+        conn.rollback()
+        cur.close()
+        return None
+    cur.execute('SELECT COALESCE(MAX(uid), 0) FROM {0}'.format(opts.source))
+    hi = cur.fetchone()[0]
+    conn.commit()
+    cur.close()
+    return hi
+
+
+# Roll up the rows after the stored watermark up to hi, one transaction per batch
+def rollup(conn, opts, grid, hi):
+    base, lat, lon = grid
+    params = {'lat': lat, 'long': lon, 'lat_step': base * LAT_PER_METER,
+              'long_step': base / (111111 * math.cos(math.radians(lat)))}
+    cur = conn.cursor()
+    total = 0
+    while True:
+        # Row lock keeps concurrent runs from counting a batch twice
+        cur.execute('SELECT last_uid FROM {0}_state FOR UPDATE'.format(opts.rollup))
+        lo = cur.fetchone()[0]
+        if lo >= hi:
+            conn.commit()
+            break
+        params['lo'] = lo
+        params['hi'] = min(lo + opts.batch, hi)
+        cur.execute(ROLLUP_SQL.format(opts.source, opts.rollup), params)
+        cur.execute('UPDATE {0}_state SET last_uid = %s'.format(opts.rollup), (params['hi'], ))
+        conn.commit()
+        total += params['hi'] - lo
+        print('uid {0}/{1}'.format(params['hi'], hi))
+        sys.stdout.flush()
+    cur.close()
+    return total
+
+
+def main():
+    opts, connstr = parse_options()
+    try:
+        conn = psycopg2.connect(connstr)
+        grid = setup(conn, opts)
+        hi = watermark(conn, opts)
+        if hi is None:
+            print('{0} is busy, left for the next run'.format(opts.source))
+            conn.close()
+            return
+        n = rollup(conn, opts, grid, hi)
+        print('{0} uid(s) rolled up, base grid {1}m from {2},{3}'.format(n, *grid))
+        conn.close()
+    except (psycopg2.Error, ValueError) as e:
+        print(e, file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "nmea.h"
+
+/*
+ * Stand-in for gpsd replaying a recorded track. It speaks enough of the
+ * gpsd JSON protocol for gps_open()/gps_stream()/gps_read(): VERSION on
+ * connect, DEVICES and WATCH as reply to ?WATCH and one TPV report per
+ * recorded fix. Tracks are NMEA logs (RMC and GGA sentences) or gpsdata
+ * CSV exports as found in the aggregator samples.
+ */
+
+#define REPLAY_MAXCLIENTS 32
+#define REPLAY_DEVICE     "/dev/gpsreplay"
+
+struct client {
+	int fd;
+	int watch;
+	size_t len;
+	char buf[512];
+};
+
+static struct nmea_fix *fixes;
+static size_t nfixes, maxfixes;
+static struct client clients[REPLAY_MAXCLIENTS];
+static int watching;            /* Set once a client enabled watch */
+
+/* Options */
+static const char *opt_addr = "127.0.0.1";
+static int opt_port = 2947;
+static double opt_speed = 1.0;
+static double opt_maxgap;
+static int opt_loop;
+static int opt_keeptime;
+static const char *opt_client;
+
+static struct nmea_fix *fix_new(void)
+{
+	struct nmea_fix *f;
+
+	if (nfixes == maxfixes) {
+		maxfixes = maxfixes ? maxfixes * 2 : 1024;
+		fixes = realloc(fixes, maxfixes * sizeof(*fixes));
+		if (!fixes) {
+			debug(DEBUG_ERROR, "out of memory");
+			exit(1);
+		}
+	}
+	f = &fixes[nfixes++];
+	f->lat = f->lon = f->alt = f->speed = f->track = NAN;
+	f->mode = NMEA_MODE_NOFIX;
+	return f;
+}
+
+/* Split line at commas in place, returns number of fields */
+static int split(char *line, char **field, int max)
+{
+	int n = 0;
+
+	field[n++] = line;
+	for (; *line && n < max; line++)
+		if (*line == ',') {
+			*line = '\0';
+			field[n++] = line + 1;
+		}
+	return n;
+}
+
+static int load_nmea(FILE *fp)
+{
+	struct nmea_state ns;
+	struct nmea_sentence snt;
+	struct nmea_fix *f;
+	const char *pos, *end;
+	char *buf;
+	long size;
+	int ret;
+
+	/* Tracks are small enough to be parsed in one piece */
+	if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1) {
+		debug(DEBUG_ERROR, "track must be a regular file");
+		return 0;
+	}
+	rewind(fp);
+	buf = malloc(size + 1);
+	if (!buf || fread(buf, 1, size, fp) != size) {
+		debug(DEBUG_ERROR, "unable to read track");
+		free(buf);
+		return 0;
+	}
+	buf[size] = '\n';
+	end = buf + size + 1;
+
+	/* GGA may come before the first RMC carrying the date */
+	nmea_init(&ns);
+	pos = buf;
+	while ((ret = nmea_next(&pos, end, &snt)) != 0)
+		if (ret == 1 && nmea_is(&snt, "RMC") && !isnan(nmea_date(&snt, 9))) {
+			ns.date = nmea_date(&snt, 9);
+			break;
+		}
+	if (isnan(ns.date)) {
+		debug(DEBUG_ERROR, "no dated RMC sentence found");
+		free(buf);
+		return 0;
+	}
+
+	pos = buf;
+	f = fix_new();
+	while ((ret = nmea_next(&pos, end, &snt)) != 0) {
+		if (ret == -1) {
+			debug(DEBUG_WARNING, "skipping invalid line at offset %li",
+			      (long) (pos - buf));
+			continue;
+		}
+		if (nmea_feed(&ns, &snt, f))
+			f = fix_new();
+	}
+	if (!nmea_flush(&ns, f))
+		nfixes--;
+	free(buf);
+	return 1;
+}
+
+/* Course from a to b in degrees */
+static double bearing(const struct nmea_fix *a, const struct nmea_fix *b)
+{
+	double dy, dx, h;
+
+	dy = b->lat - a->lat;
+	dx = (b->lon - a->lon) * cos(a->lat * M_PI / 180);
+	h = atan2(dx, dy) * 180 / M_PI;
+	return h < 0 ? h + 360 : h;
+}
+
+static int load_csv(FILE *fp)
+{
+	char line[512];
+	char *fld[16];
+	struct nmea_fix *f, *prev;
+	double dt, dy, dx;
+	int n;
+
+	/* uid,client_name,client_ip,sender_ip,client_timestamp,client_lat,client_long,event_type */
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		n = split(line, fld, 16);
+		if (n < 8 || !strcmp(fld[0], "uid"))
+			continue;
+		if (opt_client && strcmp(fld[1], opt_client))
+			continue;
+		if (!*fld[4] || !*fld[5] || !*fld[6] ||
+		    fabs(atof(fld[5])) > 90 || fabs(atof(fld[6])) > 180)
+			continue;
+		/* Several rows of one second collapse to the last one */
+		if (nfixes && fixes[nfixes - 1].time == atof(fld[4]))
+			f = &fixes[nfixes - 1];
+		else if (nfixes && fixes[nfixes - 1].time > atof(fld[4]))
+			continue;
+		else
+			f = fix_new();
+		f->time = atof(fld[4]);
+		f->lat = atof(fld[5]);
+		f->lon = atof(fld[6]);
+		f->mode = 2;
+	}
+
+	/* CSV carries positions only, derive speed and track */
+	for (n = 1; n < nfixes; n++) {
+		prev = &fixes[n - 1];
+		f = &fixes[n];
+		dt = f->time - prev->time;
+		if (dt <= 0 || dt > 60)
+			continue;
+		dy = (f->lat - prev->lat) * 111320;
+		dx = (f->lon - prev->lon) * 111320 * cos(prev->lat * M_PI / 180);
+		f->speed = sqrt(dx * dx + dy * dy) / dt;
+		if (f->speed > 0)
+			f->track = bearing(prev, f);
+	}
+	return 1;
+}
+
+static int load_track(const char *file)
+{
+	FILE *fp;
+	int c, ret;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		debug(DEBUG_ERROR, "%s: %s", file, strerror(errno));
+		return 0;
+	}
+	/* NMEA logs may start with vendor sentences, but always with '$' */
+	c = fgetc(fp);
+	ungetc(c, fp);
+	ret = (c == '$') ? load_nmea(fp) : load_csv(fp);
+	fclose(fp);
+	if (ret && !nfixes) {
+		debug(DEBUG_ERROR, "%s: no fixes found", file);
+		ret = 0;
+	}
+	if (ret)
+		debug(DEBUG_INFO, "loaded %lu fixes from %s, %.0f seconds of track",
+		      (unsigned long) nfixes, file, fixes[nfixes - 1].time - fixes[0].time);
+	return ret;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void client_close(struct client *c)
+{
+	debug(DEBUG_INFO, "client fd=%i disconnected", c->fd);
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* Whole reports only, clients too slow to take one are dropped */
+static void client_send(struct client *c, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	ret = send(c->fd, buf, len, MSG_NOSIGNAL);
+	if (ret != (ssize_t) len) {
+		if (ret == -1)
+			debug(DEBUG_WARNING, "send fd=%i: %s", c->fd, strerror(errno));
+		else
+			debug(DEBUG_WARNING, "client fd=%i not keeping up", c->fd);
+		client_close(c);
+	}
+}
+
+static void send_version(struct client *c)
+{
+	const char *msg = "{\"class\":\"VERSION\",\"release\":\"3.11\",\"rev\":\"gpsreplay\","
+			  "\"proto_major\":3,\"proto_minor\":11}\r\n";
+
+	client_send(c, msg, strlen(msg));
+}
+
+static void send_devices(struct client *c)
+{
+	char buf[512];
+
+	snprintf(buf, sizeof(buf), "{\"class\":\"DEVICES\",\"devices\":[{\"class\":\"DEVICE\","
+		 "\"path\":\"%s\",\"driver\":\"NMEA0183\",\"activated\":\"1970-01-01T00:00:00.000Z\","
+		 "\"flags\":1,\"native\":0,\"bps\":4800,\"parity\":\"N\",\"stopbits\":1,"
+		 "\"cycle\":%.2f}]}\r\n", REPLAY_DEVICE, 1.0 / opt_speed);
+	client_send(c, buf, strlen(buf));
+}
+
+static void send_watch(struct client *c)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "{\"class\":\"WATCH\",\"enable\":%s,\"json\":%s,"
+		 "\"nmea\":false,\"raw\":0,\"scaled\":false,\"timing\":false,"
+		 "\"split24\":false,\"pps\":false}\r\n",
+		 c->watch ? "true" : "false", c->watch ? "true" : "false");
+	client_send(c, buf, strlen(buf));
+}
+
+/* Handle ?VERSION; ?DEVICES; ?WATCH={...}; commands */
+static void client_command(struct client *c, char *cmd)
+{
+	if (!strncmp(cmd, "?WATCH", 6)) {
+		c->watch = !strstr(cmd, "\"enable\":false");
+		watching |= c->watch;
+		if (c->watch)
+			send_devices(c);
+		if (c->fd != -1)
+			send_watch(c);
+	} else if (!strncmp(cmd, "?VERSION", 8))
+		send_version(c);
+	else if (!strncmp(cmd, "?DEVICES", 8))
+		send_devices(c);
+	else if (!strncmp(cmd, "?POLL", 5) || !strncmp(cmd, "?DEVICE", 7))
+		; /* Next TPV answers it well enough */
+	else if (*cmd)
+		debug(DEBUG_WARNING, "unsupported command fd=%i: %s", c->fd, cmd);
+}
+
+static void client_read(struct client *c)
+{
+	char *p, *end;
+	ssize_t ret;
+
+	ret = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1, 0);
+	if (ret <= 0) {
+		client_close(c);
+		return;
+	}
+	c->len += ret;
+	c->buf[c->len] = '\0';
+
+	/* Commands end with ';', newline is optional */
+	p = c->buf;
+	while ((end = strchr(p, ';'))) {
+		*end = '\0';
+		p += strspn(p, " \r\n");
+		client_command(c, p);
+		if (c->fd == -1)
+			return;
+		p = end + 1;
+	}
+	c->len = strlen(p);
+	memmove(c->buf, p, c->len);
+	if (c->len == sizeof(c->buf) - 1) {
+		debug(DEBUG_WARNING, "command too long fd=%i", c->fd);
+		client_close(c);
+	}
+}
+
+static void client_accept(int lsock)
+{
+	int fd, i, val;
+
+	fd = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1) {
+		debug(DEBUG_WARNING, "accept: %s", strerror(errno));
+		return;
+	}
+	for (i = 0; i < REPLAY_MAXCLIENTS; i++)
+		if (clients[i].fd == -1)
+			break;
+	if (i == REPLAY_MAXCLIENTS) {
+		debug(DEBUG_WARNING, "too many clients");
+		close(fd);
+		return;
+	}
+	val = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	clients[i].fd = fd;
+	clients[i].watch = 0;
+	clients[i].len = 0;
+	debug(DEBUG_INFO, "client fd=%i connected", fd);
+	send_version(&clients[i]);
+}
+
+/* ISO 8601 time as gpsd reports it */
+static void iso8601(double t, char *buf, size_t len)
+{
+	struct tm tm;
+	time_t sec;
+	int ms;
+
+	sec = (time_t) floor(t);
+	ms = (int) floor((t - sec) * 1000 + 0.5);
+	if (ms == 1000) {
+		sec++;
+		ms = 0;
+	}
+	gmtime_r(&sec, &tm);
+	snprintf(buf, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900,
+		 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ms);
+}
+
+static void send_tpv(const struct nmea_fix *f, double t)
+{
+	char buf[512], tbuf[32];
+	int len, i;
+
+	iso8601(t, tbuf, sizeof(tbuf));
+	len = snprintf(buf, sizeof(buf), "{\"class\":\"TPV\",\"device\":\"%s\",\"mode\":%d,"
+		       "\"time\":\"%s\",\"ept\":0.005", REPLAY_DEVICE, f->mode, tbuf);
+	if (f->mode >= 2 && !isnan(f->lat) && !isnan(f->lon))
+		len += snprintf(buf + len, sizeof(buf) - len, ",\"lat\":%.9f,\"lon\":%.9f",
+				f->lat, f->lon);
+	if (f->mode >= 3 && !isnan(f->alt))
+		len += snprintf(buf + len, sizeof(buf) - len, ",\"alt\":%.3f", f->alt);
+	if (!isnan(f->track))
+		len += snprintf(buf + len, sizeof(buf) - len, ",\"track\":%.4f", f->track);
+	if (!isnan(f->speed))
+		len += snprintf(buf + len, sizeof(buf) - len, ",\"speed\":%.3f", f->speed);
+	len += snprintf(buf + len, sizeof(buf) - len, "}\r\n");
+
+	for (i = 0; i < REPLAY_MAXCLIENTS; i++)
+		if (clients[i].fd != -1 && clients[i].watch)
+			client_send(&clients[i], buf, len);
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_in saddr;
+	int sock, val;
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		debug(DEBUG_ERROR, "socket: %s", strerror(errno));
+		return -1;
+	}
+	val = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(opt_port);
+	if (inet_pton(AF_INET, opt_addr, &saddr.sin_addr) <= 0) {
+		debug(DEBUG_ERROR, "invalid address %s", opt_addr);
+		close(sock);
+		return -1;
+	}
+	if (bind(sock, (struct sockaddr*) &saddr, sizeof(saddr)) == -1 ||
+	    listen(sock, 8) == -1) {
+		debug(DEBUG_ERROR, "%s:%i: %s", opt_addr, opt_port, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [options] <nmea-log|gpsdata-csv>\n"
+		"  -a addr     listen address (127.0.0.1)\n"
+		"  -p port     listen port (2947)\n"
+		"  -s speed    replay speed multiplier (1.0)\n"
+		"  -g seconds  shorten gaps in the track to at most this long\n"
+		"  -c name     replay only rows of this client_name (CSV)\n"
+		"  -k          keep recorded timestamps instead of starting now\n"
+		"  -l          loop the track forever\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc,
+	 char **argv)
+{
+	struct pollfd pfd[REPLAY_MAXCLIENTS + 1];
+	int lsock, opt, i, j, n, timeout;
+	size_t cur;
+	double start, offset, trel, tnext, t, gap;
+	char *progname, *tmp;
+
+	progname = argv[0];
+	if ((tmp = strstr(argv[0], "/")))
+		progname = ++tmp;
+
+	while ((opt = getopt(argc, argv, "a:p:s:g:c:klh")) != -1) {
+		switch (opt) {
+			case 'a':
+				opt_addr = optarg;
+				break;
+			case 'p':
+				opt_port = atoi(optarg);
+				break;
+			case 's':
+				opt_speed = atof(optarg);
+				if (opt_speed <= 0)
+					usage(progname);
+				break;
+			case 'g':
+				opt_maxgap = atof(optarg);
+				break;
+			case 'c':
+				opt_client = optarg;
+				break;
+			case 'k':
+				opt_keeptime = 1;
+				break;
+			case 'l':
+				opt_loop = 1;
+				break;
+			default:
+				usage(progname);
+		}
+	}
+	if (optind != argc - 1)
+		usage(progname);
+
+	if (!load_track(argv[optind]))
+		exit(EXIT_FAILURE);
+	lsock = listen_socket();
+	if (lsock == -1)
+		exit(EXIT_FAILURE);
+	for (i = 0; i < REPLAY_MAXCLIENTS; i++)
+		clients[i].fd = -1;
+	debug(DEBUG_INFO, "replaying at %.2fx on %s:%i", opt_speed, opt_addr, opt_port);
+
+	/*
+	 * Replay starts with the first watching client. trel is track time
+	 * elapsed since the first fix with gaps shortened, fix cur is due at
+	 * start + trel / speed. Reported time is the recorded one, or wall
+	 * clock at replay start plus trel.
+	 */
+	cur = 0;
+	trel = 0;
+	start = offset = 0;
+	while (1) {
+		if (watching && !start) {
+			start = now();
+			offset = time(NULL) - fixes[0].time;
+		}
+		tnext = start + trel / opt_speed;
+		t = now();
+		if (start && t >= tnext) {
+			send_tpv(&fixes[cur], opt_keeptime ? fixes[cur].time :
+				 fixes[cur].time + offset);
+			if (++cur == nfixes) {
+				if (!opt_loop) {
+					debug(DEBUG_INFO, "end of track");
+					break;
+				}
+				/* Next lap continues one second after the last fix */
+				cur = 0;
+				trel += 1;
+				offset += fixes[nfixes - 1].time - fixes[0].time + 1;
+				continue;
+			}
+			gap = fixes[cur].time - fixes[cur - 1].time;
+			if (opt_maxgap > 0 && gap > opt_maxgap) {
+				offset -= gap - opt_maxgap;
+				gap = opt_maxgap;
+			}
+			trel += gap;
+			continue;
+		}
+		timeout = start ? (int) ceil((tnext - t) * 1000) : -1;
+
+		pfd[0].fd = lsock;
+		pfd[0].events = POLLIN;
+		for (i = 0, n = 1; i < REPLAY_MAXCLIENTS; i++)
+			if (clients[i].fd != -1) {
+				pfd[n].fd = clients[i].fd;
+				pfd[n++].events = POLLIN;
+			}
+		if (poll(pfd, n, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			debug(DEBUG_ERROR, "poll: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (pfd[0].revents & POLLIN)
+			client_accept(lsock);
+		for (i = 1; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			for (j = 0; j < REPLAY_MAXCLIENTS; j++)
+				if (clients[j].fd == pfd[i].fd) {
+					client_read(&clients[j]);
+					break;
+				}
+		}
+	}
+
+	for (i = 0; i < REPLAY_MAXCLIENTS; i++)
+		if (clients[i].fd != -1)
+			close(clients[i].fd);
+	close(lsock);
+	free(fixes);
+	exit(EXIT_SUCCESS);
+}
@@ -25,6 +25,9 @@ static const char * const config_keys[] = {
 	"logfile-path",
 	"pidfile-path",
 	"daemonize-enable",
+	"sink-type",
+	"sink-path",
+	"trace-file",
 	NULL
 };
 
@@ -54,6 +57,8 @@ void config_debug(void)
 	debug(DEBUG_INFO, "db-host=%s db-port=%i db-name=%s db-user=%s db-passwd=%s db-table=%s",
 	      config.db_host, config.db_port, config.db_name, 
 	      config.db_user, config.db_passwd, config.db_table);
+	debug(DEBUG_INFO, "sink-type=%s sink-path=%s", config.sink_type, config.sink_path);
+	debug(DEBUG_INFO, "trace-file=%s", *config.trace_file ? config.trace_file : "none");
 	debug(DEBUG_INFO, "logfile-path=%s", config.logfile_path);
 	debug(DEBUG_INFO, "pidfile-path=%s", config.pidfile_path);
 	debug(DEBUG_INFO, "daemonize-enable=%s", config.daemonize_enable ? "yes" : "no");
@@ -145,6 +150,15 @@ static void config_set_value(const char *value, int id)
 		case 18: /* daemonize-enable */
 			config.daemonize_enable = strcmp("yes", value) ? 0 : 1;
 			break;
+		case 19: /* sink-type */
+			xstrncpy(config.sink_type, value, sizeof(config.sink_type));
+			break;
+		case 20: /* sink-path */
+			xstrncpy(config.sink_path, value, sizeof(config.sink_path));
+			break;
+		case 21: /* trace-file */
+			xstrncpy(config.trace_file, value, sizeof(config.trace_file));
+			break;
 	}
 }
 
@@ -169,6 +183,9 @@ static void config_default(void)
         sprintf(config.db_user, "%s", "db-user");
         sprintf(config.db_passwd, "%s", "db-passwd");
 	sprintf(config.db_table, "%s", "db-table");
+	sprintf(config.sink_type, "%s", "pgsql");
+	sprintf(config.sink_path, "%s", "/tmp/gpsserver.sink");
+	config.trace_file[0] = 0;
 
 	/* Misc */
 	sprintf(config.logfile_path, "%s", "/tmp/gpsserver.log");
@@ -25,6 +25,9 @@ struct config {
 	char db_user[16];
 	char db_passwd[16];
 	char db_table[32];
+	char sink_type[16];
+	char sink_path[128];
+	char trace_file[128];
 	char logfile_path[128];
 	char pidfile_path[128];
 	int daemonize_enable;
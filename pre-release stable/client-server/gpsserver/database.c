@@ -1,34 +1,44 @@
-#include <libpq-fe.h>
+#include <string.h>
+#include <time.h>
 #include <stdio.h>
 #include "utils.h"
 #include "database.h"
 #include "config.h"
 #include "msg.h"
 
-typedef PGconn dbctx_t;
+/*
+ * Events are appended to the sink as they happen and written out by
+ * db_flush(), which the server calls once per loop round.
+ */
 
 dbctx_t *db_connect(void)
 {
-	dbctx_t *ctx;
-	char conn_str[256];
+	char target[256];
 
-	snprintf(conn_str, sizeof(conn_str),
-		 "host=%s port=%i dbname=%s user=%s password=%s connect_timeout=10",
-		 config.db_host, config.db_port, config.db_name, config.db_user, 
-		 config.db_passwd);
-
-	ctx = PQconnectdb(conn_str);
-	if (PQstatus(ctx) != CONNECTION_OK) {
-		debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage(ctx));
-		PQfinish (ctx);
-		return NULL;
-	}
-	return ctx;
+	if (!strcmp(config.sink_type, "pgsql"))
+		snprintf(target, sizeof(target),
+			 "host=%s port=%i dbname=%s user=%s password=%s connect_timeout=10",
+			 config.db_host, config.db_port, config.db_name, config.db_user,
+			 config.db_passwd);
+	else
+		snprintf(target, sizeof(target), "%s", config.sink_path);
+	return sink_open(config.sink_type, target, config.db_table);
 }
 
 void db_close(dbctx_t *ctx)
 {
-	PQfinish(ctx);
+	sink_flush(ctx);
+	sink_close(ctx);
+}
+
+int db_flush(dbctx_t *ctx)
+{
+	return sink_flush(ctx);
+}
+
+unsigned long db_dropped(dbctx_t *ctx)
+{
+	return sink_dropped(ctx);
 }
 
 int db_insertctl(dbctx_t *ctx,
@@ -36,34 +46,17 @@ int db_insertctl(dbctx_t *ctx,
 		 const char *addr,
 		 int event)
 {
-	PGresult *result;
-	int ret;
-	long int tsp;
-	char cmd[1024];
-	char ival[8];
+	struct sink_row row;
 
+	memset(&row, 0, sizeof(row));
+	memcpy(row.client_name, name, strnlen(name, sizeof(row.client_name) - 1));
+	snprintf(row.client_ip, sizeof(row.client_ip), "%s", addr);
+	row.tsp = time(NULL);
 	/* Write config.packet_interval to client_lat when event = EVENT_ONLINE */
 	if (event == 7)
-		snprintf(ival, sizeof(ival), "%i", config.packet_interval);
-	tsp = time(NULL);
-	snprintf(cmd, sizeof(cmd),
-		 "INSERT INTO %s(client_name,client_ip,client_timestamp,client_lat,event_type) "
-		 "VALUES('%s','%s',%li,'%s',%i)", config.db_table, name, addr, tsp,
-		 event == 7 ? ival : "", event);
-
-	result = PQexec(ctx, cmd);
-	if (result == NULL) {
-		debug(DEBUG_ERROR, "%s", PQerrorMessage (ctx));
-		return 0;
-	}
-	if (PQresultStatus(result) == PGRES_COMMAND_OK)
-		ret = 1;
-	else {
-		debug(DEBUG_ERROR, "%s", PQresultErrorMessage (result));
-		ret = 0;
-	}
-	PQclear(result);
-	return ret;
+		snprintf(row.lat, sizeof(row.lat), "%i", config.packet_interval);
+	row.event = event;
+	return sink_append(ctx, &row, 1);
 }
 
 int db_insertack(dbctx_t *ctx,
@@ -71,27 +64,14 @@ int db_insertack(dbctx_t *ctx,
 		 const char *addr,
 		 int event)
 {
-	PGresult *result;
-	int ret;
-	char cmd[1024];
-
-	snprintf(cmd, sizeof(cmd),
-		 "INSERT INTO %s(client_name,client_ip,client_timestamp,client_lat,"
-		 "client_long,event_type) VALUES('%s','%s',%u,'%s','%s',%i)",
-		 config.db_table, ack->name, addr, ack->tsp, ack->latitude,
-		 ack->longitude, event);
+	struct sink_row row;
 
-	result = PQexec(ctx, cmd);
-	if (result == NULL) {
-		debug(DEBUG_ERROR, "%s", PQerrorMessage (ctx));
-		return 0;
-	}
-	if (PQresultStatus(result) == PGRES_COMMAND_OK)
-		ret = 1;
-	else {
-		debug(DEBUG_ERROR, "%s", PQresultErrorMessage (result));
-		ret = 0;
-	}
-	PQclear(result);
-	return ret;
+	memset(&row, 0, sizeof(row));
+	memcpy(row.client_name, ack->name, strnlen(ack->name, sizeof(row.client_name) - 1));
+	snprintf(row.client_ip, sizeof(row.client_ip), "%s", addr);
+	row.tsp = ack->tsp;
+	memcpy(row.lat, ack->latitude, strnlen(ack->latitude, sizeof(row.lat) - 1));
+	memcpy(row.lon, ack->longitude, strnlen(ack->longitude, sizeof(row.lon) - 1));
+	row.event = event;
+	return sink_append(ctx, &row, 1);
 }
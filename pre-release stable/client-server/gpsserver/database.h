@@ -1,15 +1,19 @@
 #ifndef _DATABASE_H_
 #define _DATABASE_H_
 
-#include <libpq-fe.h>
+#include "sink.h"
 #include "msg.h"
 
-typedef PGconn dbctx_t;
+typedef struct sink dbctx_t;
 
 dbctx_t *db_connect(void);
 
 void db_close(dbctx_t *ctx);
 
+int db_flush(dbctx_t *ctx);
+
+unsigned long db_dropped(dbctx_t *ctx);
+
 int db_insertctl(dbctx_t *ctx,
 		 const char *name,
 		 const char *addr, 
@@ -35,6 +35,29 @@ struct client_state {
 static struct client_state *cstate[FD_SETSIZE];
 static dbctx_t *dbctx;
 static int sock_ctl;
+static FILE *trace;
+static int trace_acks;      /* ACKs read and not committed or dropped yet */
+static int trace_lost;      /* Of those, refused by the sink */
+static unsigned long trace_dropped; /* db_dropped() after the last round */
+
+/*
+ * Trace line "<CLOCK_REALTIME ns> <event> <client>", written only when
+ * trace-file is set. A round ends with a drop line carrying the number of
+ * ACKs the sink discarded, if any, then a commit line carrying the number
+ * of ACKs it stored. ACKs the sink keeps after a failed flush are counted
+ * in the commit line of the round that stores them.
+ */
+static void trace_event(const char *event,
+			const char *name)
+{
+	struct timespec ts;
+
+	if (!trace)
+		return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(trace, "%lld %s %.16s\n", (long long) ts.tv_sec * 1000000000 + ts.tv_nsec,
+		event, name);
+}
 
 static void cstate_new(int sock)
 {
@@ -240,8 +263,11 @@ static int read_ackmsg(int sock)
 	cs->ack.name[ret - 1] = 0;
 	/* Save the last ack time */
 	clock_gettime(CLOCK_MONOTONIC, &cs->last_ack);
+	trace_event("ack_recv", cs->ack.name);
 	/* Write event to database */
-	db_insertack(dbctx, &cs->ack, ip, EVENT_ACK);
+	trace_acks++;
+	if (!db_insertack(dbctx, &cs->ack, ip, EVENT_ACK))
+		trace_lost++;
 	debug(DEBUG_INFO, "recvd ACK msg client='%s' lat=%s lon=%s tsp=%u addr=%s fd=%i", 
 	      cs->ack.name, cs->ack.latitude, cs->ack.longitude, cs->ack.tsp, ip, sock);
 	return 1;
@@ -272,6 +298,7 @@ static int send_packets(int sock,
 			debug(DEBUG_WARNING, "sendto: %s", strerror(errno));
 			return 0;
 		}
+		trace_event("tgr_send", cs->ctl.name);
 		inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
 		debug(DEBUG_INFO, "sent TGR msg type=ucast client='%s' addr=%s fd=%i",
 		      cs->ctl.name, ip, sock);
@@ -406,6 +433,8 @@ static void accept_client(void)
 	struct client_state *cs;
 	struct timeval tv;
 	struct timespec ts;
+	char count[24];
+	unsigned long dropped;
 
 	maxfd = sock_ctl;
 	FD_ZERO(&rset);
@@ -446,6 +475,26 @@ static void accept_client(void)
 			}
 		}
 	}
+	/* Events of this round go to storage together */
+	ret = db_flush(dbctx);
+	dropped = trace_lost + db_dropped(dbctx) - trace_dropped;
+	trace_dropped = db_dropped(dbctx);
+	/* Dropped CTL events are counted too, ACKs can not be told apart */
+	if (dropped > trace_acks)
+		dropped = trace_acks;
+	if (dropped) {
+		snprintf(count, sizeof(count), "%lu", dropped);
+		trace_event("drop", count);
+		trace_acks -= dropped;
+	}
+	if (ret && trace_acks) {
+		snprintf(count, sizeof(count), "%i", trace_acks);
+		trace_event("commit", count);
+		trace_acks = 0;
+	}
+	trace_lost = 0;
+	if (trace)
+		fflush(trace);
 }
 
 int main(int argc,
@@ -490,11 +539,18 @@ int main(int argc,
 
 	config_debug();
 
-	/* Connect to database */
+	/* Open storage */
 	dbctx = db_connect();
 	if (!dbctx)
 		exit(1);
-	debug(DEBUG_INFO, "connected to database %s:%i", config.db_host, config.db_port);
+	debug(DEBUG_INFO, "opened %s sink", config.sink_type);
+	if (*config.trace_file) {
+		trace = fopen(config.trace_file, "w");
+		if (!trace) {
+			debug(DEBUG_ERROR, "%s: %s", config.trace_file, strerror(errno));
+			exit(1);
+		}
+	}
 
 	/* Setup control socket */
 	ret = setup_sockctl();
@@ -0,0 +1,731 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "msg.h"
+
+/*
+ * Simulates many gpsclients in one process to load gpsserver. Every
+ * virtual client registers with CTL_CLIENT_ONLINE from its own UDP port,
+ * validates the TGR msgs it gets there and answers them with ACK msgs
+ * carrying a synthetic track.
+ *
+ * Reported figures:
+ *  - TGR and ACK rates over all clients
+ *  - turnaround, TGR arrival to ACK sent in this process. It includes the
+ *    configured delay and shows when the swarm itself is saturated.
+ *  - lag, TGR inter-arrival time minus server packet-interval. The server
+ *    triggers a client once packet-interval has elapsed, any excess is
+ *    time its loop spent elsewhere, so lag growing with the client count
+ *    marks the server scaling ceiling.
+ *  - reregistrations, clients that got no TGR for -R ms, i.e. dropped
+ *    by the server after missing ACKs
+ */
+
+#define SWARM_TICK       100      /* ms between housekeeping rounds */
+#define SWARM_MAXSAMPLES 1000000
+#define SWARM_NAMELEN    16
+#define SWARM_CTLTIMEOUT 3.0      /* Seconds a CTL connect may take */
+#define SWARM_CTLFLAG    0x80000000u  /* epoll data of CTL sockets */
+
+enum {
+	VC_OFFLINE,
+	VC_ONLINE,
+	VC_PAUSED                 /* Taken offline by churn */
+};
+
+struct vclient {
+	int sock;
+	int state;
+	int ctl;                  /* CTL connection in progress or -1 */
+	int ctl_status;           /* CTL_CLIENT_* it will send */
+	double ctl_start;
+	unsigned short port;
+	char name[SWARM_NAMELEN];
+	double lat, lon, heading; /* Synthetic track */
+	double last_tgr;          /* Monotonic time of last TGR, 0 if none */
+	double last_reg;          /* Monotonic time of last registration */
+	double resume;            /* End of churn pause */
+};
+
+/* ACK waiting for its delay to pass */
+struct pending_ack {
+	double due;
+	double rx;
+	int client;
+	struct sockaddr_in saddr;
+};
+
+struct samples {
+	double *v;
+	size_t n;
+};
+
+/* Options */
+static const char *opt_server = "127.0.0.1";
+static int opt_ctlport = 5000;
+static int opt_clients = 100;
+static int opt_baseport = 20000;
+static const char *opt_prefix = "swarm";
+static double opt_ramp = 500;        /* Registrations per second */
+static double opt_loss;              /* Probability a TGR is not answered */
+static double opt_delay_min, opt_delay_max; /* ACK delay in ms */
+static double opt_churn;             /* Per client probability per second */
+static double opt_pause = 5;         /* Seconds a churned client stays away */
+static int opt_interval = 3000;      /* Server packet-interval in ms */
+static int opt_retry = 10000;        /* Reregister after this silence in ms */
+static double opt_duration;          /* Seconds, 0 runs until interrupted */
+static double opt_report = 5;        /* Seconds between reports */
+static const char *opt_trace;        /* Per-event trace file */
+
+static struct vclient *vc;
+static struct pending_ack *heap;
+static size_t nheap, maxheap;
+static int epfd;
+static struct in_addr server_addr;
+static volatile sig_atomic_t stop;
+static FILE *trace;
+
+/* Counters of the current report period and of the whole run */
+static unsigned long tgrs, acks, invalid, lost, rereg, churned, errors;
+static unsigned long tot_tgrs, tot_acks, tot_invalid, tot_lost, tot_rereg;
+static struct samples turnaround, lag, tot_turnaround, tot_lag;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Same line format as the gpsserver trace-file, see bench/e2e.py */
+static void trace_event(const char *event,
+			const char *name)
+{
+	struct timespec ts;
+
+	if (!trace)
+		return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(trace, "%lld %s %.16s\n", (long long) ts.tv_sec * 1000000000 + ts.tv_nsec,
+		event, name);
+}
+
+static double frand(void)
+{
+	return rand() / (RAND_MAX + 1.0);
+}
+
+static void sample_add(struct samples *s, double v)
+{
+	if (!s->v) {
+		s->v = malloc(SWARM_MAXSAMPLES * sizeof(double));
+		if (!s->v) {
+			debug(DEBUG_ERROR, "out of memory");
+			exit(1);
+		}
+	}
+	if (s->n < SWARM_MAXSAMPLES)
+		s->v[s->n++] = v;
+}
+
+static int dblcmp(const void *a, const void *b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts samples, p in 0..1 */
+static double percentile(struct samples *s, double p)
+{
+	if (!s->n)
+		return NAN;
+	return s->v[(size_t) (p * (s->n - 1) + 0.5)];
+}
+
+static void sample_report(const char *what, struct samples *s)
+{
+	qsort(s->v, s->n, sizeof(double), dblcmp);
+	debug(DEBUG_INFO, "%s ms: n=%lu p50=%.3f p90=%.3f p99=%.3f max=%.3f", what,
+	      (unsigned long) s->n, percentile(s, 0.5), percentile(s, 0.9),
+	      percentile(s, 0.99), percentile(s, 1.0));
+}
+
+/* Min-heap of delayed ACKs ordered by due time */
+static void heap_push(const struct pending_ack *p)
+{
+	size_t i;
+
+	if (nheap == maxheap) {
+		maxheap = maxheap ? maxheap * 2 : 1024;
+		heap = realloc(heap, maxheap * sizeof(*heap));
+		if (!heap) {
+			debug(DEBUG_ERROR, "out of memory");
+			exit(1);
+		}
+	}
+	for (i = nheap++; i && heap[(i - 1) / 2].due > p->due; i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i] = *p;
+}
+
+static void heap_pop(void)
+{
+	struct pending_ack last;
+	size_t i, c;
+
+	last = heap[--nheap];
+	for (i = 0; (c = 2 * i + 1) < nheap; i = c) {
+		if (c + 1 < nheap && heap[c + 1].due < heap[c].due)
+			c++;
+		if (last.due <= heap[c].due)
+			break;
+		heap[i] = heap[c];
+	}
+	heap[i] = last;
+}
+
+/* Send the pending CTL msg of client i once its connection is up */
+static void ctl_finish(int i)
+{
+	struct vclient *c = &vc[i];
+	struct ctl_msg ctl;
+	socklen_t len;
+	int err = 0;
+
+	if (c->ctl == -1)
+		return;
+	len = sizeof(err);
+	if (getsockopt(c->ctl, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+		debug(DEBUG_WARNING, "%s: connect: %s", c->name, strerror(err ? err : errno));
+		goto fail;
+	}
+	memset(&ctl, 0, sizeof(ctl));
+	memcpy(ctl.name, c->name, sizeof(ctl.name));
+	ctl.ctl = c->ctl_status;
+	ctl.uport = ctl.mport = ctl.bport = c->port;
+	msgctl_init(&ctl);
+	msgctl_hton(&ctl);
+	if (send(c->ctl, &ctl, sizeof(ctl), 0) != sizeof(ctl))
+		goto fail;
+	close(c->ctl);
+	c->ctl = -1;
+	return;
+
+fail:
+	close(c->ctl);
+	c->ctl = -1;
+	errors++;
+	if (c->ctl_status == CTL_CLIENT_ONLINE && c->state == VC_ONLINE)
+		c->state = VC_OFFLINE;
+}
+
+/*
+ * Start sending a CTL msg for client i. The connect does not block, the
+ * server accepts one connection per loop round and a full backlog would
+ * otherwise stall every other client of the swarm.
+ */
+static int send_ctl(int i, int status)
+{
+	struct vclient *c = &vc[i];
+	struct sockaddr_in saddr;
+	struct epoll_event ev;
+
+	if (c->ctl != -1) {
+		close(c->ctl);
+		c->ctl = -1;
+		errors++;
+	}
+	c->ctl = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->ctl == -1) {
+		debug(DEBUG_ERROR, "socket: %s", strerror(errno));
+		errors++;
+		return 0;
+	}
+	c->ctl_status = status;
+	c->ctl_start = now();
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(opt_ctlport);
+	saddr.sin_addr = server_addr;
+	if (connect(c->ctl, (struct sockaddr*) &saddr, sizeof(saddr)) == 0) {
+		ctl_finish(i);
+		return c->ctl_status != CTL_CLIENT_ONLINE || c->state != VC_OFFLINE;
+	}
+	if (errno != EINPROGRESS) {
+		debug(DEBUG_WARNING, "connect: %s", strerror(errno));
+		goto fail;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.u32 = i | SWARM_CTLFLAG;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->ctl, &ev) == -1) {
+		debug(DEBUG_ERROR, "epoll_ctl: %s", strerror(errno));
+		goto fail;
+	}
+	return 1;
+
+fail:
+	close(c->ctl);
+	c->ctl = -1;
+	errors++;
+	return 0;
+}
+
+static int vclient_init(int i)
+{
+	struct vclient *c = &vc[i];
+	struct sockaddr_in saddr;
+	struct epoll_event ev;
+	int val;
+
+	memset(c, 0, sizeof(*c));
+	c->ctl = -1;
+	snprintf(c->name, sizeof(c->name), "%.9s%06u", opt_prefix, (unsigned) i % 1000000);
+	c->port = opt_baseport + i;
+	/* Spread clients around the sample drives */
+	c->lat = 40.6375 + (frand() - 0.5) * 0.05;
+	c->lon = -89.4770 + (frand() - 0.5) * 0.05;
+	c->heading = frand() * 360;
+
+	c->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (c->sock == -1) {
+		debug(DEBUG_ERROR, "socket: %s", strerror(errno));
+		return 0;
+	}
+	val = 1;
+	setsockopt(c->sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(c->port);
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(c->sock, (struct sockaddr*) &saddr, sizeof(saddr)) == -1) {
+		debug(DEBUG_ERROR, "bind port %i: %s", c->port, strerror(errno));
+		return 0;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev) == -1) {
+		debug(DEBUG_ERROR, "epoll_ctl: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/* Move along the synthetic track, about 10 m/s with slow turns */
+static void vclient_move(struct vclient *c, double dt)
+{
+	c->heading = fmod(c->heading + (frand() - 0.5) * 20 + 360, 360);
+	c->lat += 10 * dt * cos(c->heading * M_PI / 180) / 111320;
+	c->lon += 10 * dt * sin(c->heading * M_PI / 180) /
+		  (111320 * cos(c->lat * M_PI / 180));
+}
+
+static void send_ack(const struct pending_ack *p, double t)
+{
+	struct vclient *c = &vc[p->client];
+	struct ack_msg ack;
+
+	if (c->state != VC_ONLINE)
+		return;
+	memset(&ack, 0, sizeof(ack));
+	memcpy(ack.name, c->name, sizeof(ack.name));
+	snprintf(ack.latitude, sizeof(ack.latitude), "%f", c->lat);
+	snprintf(ack.longitude, sizeof(ack.longitude), "%f", c->lon);
+	ack.tsp = time(NULL);
+	msgack_init(&ack);
+	msgack_hton(&ack);
+	if (sendto(c->sock, &ack, sizeof(ack), 0, (const struct sockaddr*) &p->saddr,
+		   sizeof(p->saddr)) != sizeof(ack)) {
+		errors++;
+		return;
+	}
+	trace_event("ack_send", c->name);
+	acks++;
+	sample_add(&turnaround, (t - p->rx) * 1000);
+}
+
+static void recv_tgr(int i)
+{
+	struct vclient *c = &vc[i];
+	struct pending_ack p;
+	struct tgr_msg msg;
+	socklen_t len;
+	double t;
+	int ret;
+
+	while (1) {
+		len = sizeof(p.saddr);
+		ret = recvfrom(c->sock, &msg, sizeof(msg), 0, (struct sockaddr*) &p.saddr, &len);
+		if (ret == -1)
+			return;
+		t = now();
+		if (ret != sizeof(msg)) {
+			invalid++;
+			continue;
+		}
+		msgtgr_ntoh(&msg);
+		if (msgtgr_check(&msg) != 0) {
+			invalid++;
+			continue;
+		}
+		tgrs++;
+		if (c->state != VC_ONLINE)
+			continue;
+		trace_event("tgr_recv", c->name);
+		if (c->last_tgr) {
+			sample_add(&lag, (t - c->last_tgr) * 1000 - opt_interval);
+			vclient_move(c, t - c->last_tgr);
+		}
+		c->last_tgr = t;
+		if (frand() < opt_loss) {
+			lost++;
+			continue;
+		}
+		p.client = i;
+		p.rx = t;
+		p.due = t + (opt_delay_min + frand() * (opt_delay_max - opt_delay_min)) / 1000;
+		if (p.due <= t)
+			send_ack(&p, t);
+		else
+			heap_push(&p);
+	}
+}
+
+/* Take client i online, the state is undone if the CTL msg fails */
+static void vclient_register(int i, double t)
+{
+	struct vclient *c = &vc[i];
+
+	c->state = VC_ONLINE;
+	c->last_reg = t;
+	c->last_tgr = 0;
+	if (!send_ctl(i, CTL_CLIENT_ONLINE))
+		c->state = VC_OFFLINE;
+}
+
+/* Registration ramp, churn, CTL timeouts and silence detection */
+static void housekeeping(double t, double start)
+{
+	static int next;
+	struct vclient *c;
+	int i, quota;
+
+	/* Register clients no faster than the ramp allows */
+	quota = (int) ((t - start) * opt_ramp) + 1;
+	for (; next < opt_clients && next < quota; next++)
+		vclient_register(next, t);
+
+	for (i = 0; i < next; i++) {
+		c = &vc[i];
+		if (c->ctl != -1 && t - c->ctl_start > SWARM_CTLTIMEOUT) {
+			debug(DEBUG_WARNING, "%s: connect timed out", c->name);
+			close(c->ctl);
+			c->ctl = -1;
+			errors++;
+			if (c->ctl_status == CTL_CLIENT_ONLINE && c->state == VC_ONLINE)
+				c->state = VC_OFFLINE;
+		}
+		switch (c->state) {
+			case VC_ONLINE:
+				if (opt_churn > 0 && frand() < opt_churn * SWARM_TICK / 1000) {
+					send_ctl(i, CTL_CLIENT_OFFLINE);
+					c->state = VC_PAUSED;
+					c->resume = t + opt_pause;
+					churned++;
+					break;
+				}
+				/* Server gave up on us, register again like gpsclient does */
+				if (t - (c->last_tgr ? c->last_tgr : c->last_reg) > opt_retry / 1000.0) {
+					rereg++;
+					vclient_register(i, t);
+				}
+				break;
+			case VC_PAUSED:
+				if (t >= c->resume)
+					vclient_register(i, t);
+				break;
+			case VC_OFFLINE:
+				if (t - c->last_reg >= opt_retry / 1000.0)
+					vclient_register(i, t);
+				break;
+		}
+	}
+}
+
+static void merge(struct samples *to, struct samples *from)
+{
+	size_t i;
+
+	for (i = 0; i < from->n; i++)
+		sample_add(to, from->v[i]);
+	from->n = 0;
+}
+
+static void report(double period)
+{
+	int i, online = 0;
+
+	for (i = 0; i < opt_clients; i++)
+		online += vc[i].state == VC_ONLINE;
+	debug(DEBUG_INFO, "online=%i tgr/s=%.1f ack/s=%.1f invalid=%lu lost=%lu "
+	      "rereg=%lu churned=%lu errors=%lu pending=%lu", online, tgrs / period,
+	      acks / period, invalid, lost, rereg, churned, errors, (unsigned long) nheap);
+	sample_report("turnaround", &turnaround);
+	sample_report("lag", &lag);
+
+	tot_tgrs += tgrs;
+	tot_acks += acks;
+	tot_invalid += invalid;
+	tot_lost += lost;
+	tot_rereg += rereg;
+	tgrs = acks = invalid = lost = rereg = churned = errors = 0;
+	merge(&tot_turnaround, &turnaround);
+	merge(&tot_lag, &lag);
+}
+
+/* Take every client offline, waits at most SWARM_CTLTIMEOUT */
+static void logout(void)
+{
+	struct epoll_event events[256];
+	double deadline;
+	int i, n, busy;
+
+	for (i = 0; i < opt_clients; i++) {
+		if (vc[i].ctl != -1) {
+			close(vc[i].ctl);
+			vc[i].ctl = -1;
+		}
+		if (vc[i].state == VC_ONLINE)
+			send_ctl(i, CTL_CLIENT_OFFLINE);
+	}
+	deadline = now() + SWARM_CTLTIMEOUT;
+	do {
+		for (i = busy = 0; i < opt_clients; i++)
+			busy += vc[i].ctl != -1;
+		if (!busy)
+			break;
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), SWARM_TICK);
+		for (i = 0; i < n; i++)
+			if (events[i].data.u32 & SWARM_CTLFLAG)
+				ctl_finish(events[i].data.u32 & ~SWARM_CTLFLAG);
+	} while (now() < deadline);
+	if (busy)
+		debug(DEBUG_WARNING, "%i clients could not log out", busy);
+}
+
+static void signal_handler(int signo)
+{
+	stop = 1;
+}
+
+static void parse_delay(const char *arg)
+{
+	char *end;
+
+	opt_delay_min = opt_delay_max = strtod(arg, &end);
+	if (*end == ':')
+		opt_delay_max = strtod(end + 1, NULL);
+	if (opt_delay_max < opt_delay_min)
+		opt_delay_max = opt_delay_min;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -s addr     gpsserver address (127.0.0.1)\n"
+		"  -c port     gpsserver control-port (5000)\n"
+		"  -n count    virtual clients (100)\n"
+		"  -b port     UDP port of the first client (20000)\n"
+		"  -p prefix   client name prefix (swarm)\n"
+		"  -r rate     registrations per second (500)\n"
+		"  -l prob     probability a TGR is left unanswered (0)\n"
+		"  -d ms[:ms]  ACK delay, uniform between the two values (0)\n"
+		"  -C prob     per second probability a client goes offline (0)\n"
+		"  -P seconds  how long a churned client stays offline (5)\n"
+		"  -I ms       server packet-interval, used to compute lag (3000)\n"
+		"  -R ms       register again after this long without TGR (10000)\n"
+		"  -t seconds  run time, 0 until interrupted (0)\n"
+		"  -i seconds  report interval (5)\n"
+		"  -T file     write a timestamp per TGR received and ACK sent\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc,
+	 char **argv)
+{
+	struct epoll_event events[256];
+	struct sigaction sa;
+	struct rlimit rl;
+	double start, t, next_tick, next_report, last_report;
+	int opt, i, n, timeout;
+	char *progname, *tmp;
+
+	progname = argv[0];
+	if ((tmp = strstr(argv[0], "/")))
+		progname = ++tmp;
+
+	while ((opt = getopt(argc, argv, "s:c:n:b:p:r:l:d:C:P:I:R:t:i:T:h")) != -1) {
+		switch (opt) {
+			case 's':
+				opt_server = optarg;
+				break;
+			case 'c':
+				opt_ctlport = atoi(optarg);
+				break;
+			case 'n':
+				opt_clients = atoi(optarg);
+				break;
+			case 'b':
+				opt_baseport = atoi(optarg);
+				break;
+			case 'p':
+				opt_prefix = optarg;
+				break;
+			case 'r':
+				opt_ramp = atof(optarg);
+				break;
+			case 'l':
+				opt_loss = atof(optarg);
+				break;
+			case 'd':
+				parse_delay(optarg);
+				break;
+			case 'C':
+				opt_churn = atof(optarg);
+				break;
+			case 'P':
+				opt_pause = atof(optarg);
+				break;
+			case 'I':
+				opt_interval = atoi(optarg);
+				break;
+			case 'R':
+				opt_retry = atoi(optarg);
+				break;
+			case 't':
+				opt_duration = atof(optarg);
+				break;
+			case 'i':
+				opt_report = atof(optarg);
+				break;
+			case 'T':
+				opt_trace = optarg;
+				break;
+			default:
+				usage(progname);
+		}
+	}
+	if (opt_clients <= 0 || opt_ramp <= 0 || opt_report <= 0 ||
+	    opt_baseport + opt_clients > 65536)
+		usage(progname);
+	if (inet_pton(AF_INET, opt_server, &server_addr) <= 0) {
+		debug(DEBUG_ERROR, "invalid server address %s", opt_server);
+		exit(EXIT_FAILURE);
+	}
+
+	/* One UDP socket per client and one while its CTL msg is sent */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 2 * opt_clients + 64) {
+		rl.rlim_cur = 2 * opt_clients + 64;
+		if (rl.rlim_max < rl.rlim_cur)
+			rl.rlim_max = rl.rlim_cur;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			debug(DEBUG_WARNING, "unable to raise open file limit: %s", strerror(errno));
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (opt_trace) {
+		trace = fopen(opt_trace, "w");
+		if (!trace) {
+			debug(DEBUG_ERROR, "%s: %s", opt_trace, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	srand(getpid());
+	epfd = epoll_create1(0);
+	vc = calloc(opt_clients, sizeof(*vc));
+	if (epfd == -1 || !vc) {
+		debug(DEBUG_ERROR, "unable to initialize");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < opt_clients; i++)
+		if (!vclient_init(i))
+			exit(EXIT_FAILURE);
+	debug(DEBUG_INFO, "%i clients on ports %i-%i, server %s:%i", opt_clients,
+	      opt_baseport, opt_baseport + opt_clients - 1, opt_server, opt_ctlport);
+
+	start = last_report = now();
+	next_tick = start;
+	next_report = start + opt_report;
+	while (!stop) {
+		t = now();
+		if (opt_duration > 0 && t - start >= opt_duration)
+			break;
+		while (nheap && heap[0].due <= t) {
+			send_ack(&heap[0], t);
+			heap_pop();
+		}
+		if (t >= next_tick) {
+			housekeeping(t, start);
+			next_tick += SWARM_TICK / 1000.0;
+			if (next_tick < t)
+				next_tick = t + SWARM_TICK / 1000.0;
+		}
+		if (t >= next_report) {
+			report(t - last_report);
+			last_report = t;
+			next_report += opt_report;
+		}
+
+		timeout = (int) ceil((next_tick - t) * 1000);
+		if (nheap && heap[0].due < next_tick)
+			timeout = (int) ceil((heap[0].due - t) * 1000);
+		if (timeout < 0)
+			timeout = 0;
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			debug(DEBUG_ERROR, "epoll_wait: %s", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u32 & SWARM_CTLFLAG)
+				ctl_finish(events[i].data.u32 & ~SWARM_CTLFLAG);
+			else
+				recv_tgr(events[i].data.u32);
+		}
+	}
+
+	t = now();
+	report(t - last_report);
+	logout();
+
+	debug(DEBUG_INFO, "total %.0fs: tgr=%lu ack=%lu invalid=%lu lost=%lu rereg=%lu "
+	      "tgr/s=%.1f", t - start, tot_tgrs, tot_acks, tot_invalid, tot_lost, tot_rereg,
+	      tot_tgrs / (t - start));
+	sample_report("total turnaround", &tot_turnaround);
+	sample_report("total lag", &tot_lag);
+	if (trace)
+		fclose(trace);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "nmea.h"
+
+/*
+ * nmea_next() finds the next complete line in [pos, end), verifies its
+ * checksum and records where its fields are. The checksum and the field
+ * split are done in one pass over the sentence, 16 bytes at a time when
+ * SSE2 is available. Nothing is copied, the buffer must stay untouched
+ * while the sentence is used.
+ */
+
+static const double pow10_tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+	1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
+static void nmea_field(struct nmea_sentence *s,
+		       const char *start,
+		       const char *end)
+{
+	if (s->nfields == NMEA_MAXFIELDS)
+		return;
+	s->field[s->nfields] = start;
+	s->flen[s->nfields] = end - start > 255 ? 255 : end - start;
+	s->nfields++;
+}
+
+/* Split body at commas, returns XOR of its bytes */
+static unsigned char nmea_split(const char *p,
+				const char *end,
+				struct nmea_sentence *s)
+{
+	const char *fstart = p;
+	unsigned char sum = 0;
+#ifdef __SSE2__
+	__m128i comma, acc, v;
+	unsigned mask;
+
+	comma = _mm_set1_epi8(',');
+	acc = _mm_setzero_si128();
+	while (end - p >= 16) {
+		v = _mm_loadu_si128((const __m128i*) p);
+		acc = _mm_xor_si128(acc, v);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, comma));
+		while (mask) {
+			nmea_field(s, fstart, p + __builtin_ctz(mask));
+			fstart = p + __builtin_ctz(mask) + 1;
+			mask &= mask - 1;
+		}
+		p += 16;
+	}
+	acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+	acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+	acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+	sum = _mm_cvtsi128_si32(acc) & 0xff;
+#endif
+	for (; p < end; p++) {
+		sum ^= *p;
+		if (*p == ',') {
+			nmea_field(s, fstart, p);
+			fstart = p + 1;
+		}
+	}
+	nmea_field(s, fstart, end);
+	return sum;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Parse next sentence of [*pos, end). Returns 1 and advances *pos past it
+ * when a valid sentence was found, -1 when a line was skipped as invalid
+ * and 0 when no complete line is left, *pos then points to the data to
+ * carry over to the next buffer.
+ */
+int nmea_next(const char **pos,
+	      const char *end,
+	      struct nmea_sentence *s)
+{
+	const char *start, *eol;
+	size_t len;
+	int hi, lo;
+
+	start = memchr(*pos, '$', end - *pos);
+	if (!start) {
+		*pos = end;
+		return 0;
+	}
+	eol = memchr(start, '\n', end - start);
+	if (!eol) {
+		if (end - start > NMEA_MAXLEN) {
+			*pos = start + 1;
+			return -1;
+		}
+		*pos = start;
+		return 0;
+	}
+	*pos = eol + 1;
+
+	/* Sentence cut short by a new one, keep the latter */
+	start = memrchr(start, '$', eol - start);
+	len = eol - start;
+	if (len && start[len - 1] == '\r')
+		len--;
+	if (len < 4 || len > NMEA_MAXLEN || start[len - 3] != '*')
+		return -1;
+	hi = hexval(start[len - 2]);
+	lo = hexval(start[len - 1]);
+	if (hi < 0 || lo < 0)
+		return -1;
+
+	s->start = start;
+	s->len = len;
+	s->nfields = 0;
+	if (nmea_split(start + 1, start + len - 3, s) != (hi << 4 | lo))
+		return -1;
+	return 1;
+}
+
+/* Match sentence type regardless of talker, e.g. "RMC" for $GPRMC and $GNRMC */
+int nmea_is(const struct nmea_sentence *s, const char *type)
+{
+	return s->flen[0] == 5 && !memcmp(s->field[0] + 2, type, 3);
+}
+
+/* Decimal number without exponent, NAN when empty or malformed */
+double nmea_double(const char *p, size_t len)
+{
+	const char *end = p + len;
+	unsigned long long ip = 0, fp = 0;
+	int neg = 0, digits = 0, fdigits = 0;
+	double v;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		ip = ip * 10 + (*p - '0');
+	if (p < end && *p == '.')
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+			if (fdigits < 18) {
+				fp = fp * 10 + (*p - '0');
+				fdigits++;
+			}
+	if (!digits || p != end)
+		return NAN;
+	v = ip + fp / pow10_tab[fdigits];
+	return neg ? -v : v;
+}
+
+static double nmea_fdouble(const struct nmea_sentence *s, int f)
+{
+	if (f >= s->nfields)
+		return NAN;
+	return nmea_double(s->field[f], s->flen[f]);
+}
+
+/* ddmm.mmmm in field f and hemisphere in f + 1 to degrees */
+double nmea_coord(const struct nmea_sentence *s, int f)
+{
+	double v, deg;
+
+	v = nmea_fdouble(s, f);
+	if (isnan(v) || f + 1 >= s->nfields || s->flen[f + 1] != 1)
+		return NAN;
+	deg = floor(v / 100);
+	deg += (v - deg * 100) / 60;
+	switch (s->field[f + 1][0]) {
+		case 'N':
+		case 'E':
+			return deg;
+		case 'S':
+		case 'W':
+			return -deg;
+	}
+	return NAN;
+}
+
+/* hhmmss.sss to seconds of day */
+double nmea_tod(const struct nmea_sentence *s, int f)
+{
+	const char *p;
+	double sec;
+
+	if (f >= s->nfields || s->flen[f] < 6)
+		return NAN;
+	p = s->field[f];
+	sec = nmea_double(p + 4, s->flen[f] - 4);
+	if (isnan(sec) || p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9' ||
+	    p[2] < '0' || p[2] > '9' || p[3] < '0' || p[3] > '9')
+		return NAN;
+	return (double) ((p[0] - '0') * 10 + p[1] - '0') * 3600 +
+	       ((p[2] - '0') * 10 + p[3] - '0') * 60 + sec;
+}
+
+/* ddmmyy to UTC midnight */
+double nmea_date(const struct nmea_sentence *s, int f)
+{
+	struct tm tm;
+	double d;
+
+	if (f >= s->nfields || s->flen[f] != 6)
+		return NAN;
+	d = nmea_double(s->field[f], 6);
+	if (isnan(d))
+		return NAN;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_mday = (int) d / 10000;
+	tm.tm_mon = (int) d / 100 % 100 - 1;
+	tm.tm_year = (int) d % 100 + 100;
+	return timegm(&tm);
+}
+
+static void nmea_reset(struct nmea_fix *fix)
+{
+	fix->lat = fix->lon = fix->alt = fix->speed = fix->track = NAN;
+	fix->mode = NMEA_MODE_NOFIX;
+}
+
+void nmea_init(struct nmea_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->date = NAN;
+	nmea_reset(&st->fix);
+}
+
+/*
+ * Switch to the epoch at time of day tod. Returns 1 when the previous
+ * epoch was finished and copied to fix.
+ */
+static int nmea_epoch(struct nmea_state *st,
+		      double tod,
+		      struct nmea_fix *fix)
+{
+	double t;
+
+	t = st->date + tod;
+	if (st->pending) {
+		if (fabs(st->fix.time - t) < 0.001)
+			return 0;
+		/* Past midnight before the next RMC told us */
+		if (t < st->fix.time - 43200) {
+			st->date += 86400;
+			t += 86400;
+		}
+		memcpy(fix, &st->fix, sizeof(*fix));
+	}
+	nmea_reset(&st->fix);
+	st->fix.time = t;
+	if (st->pending)
+		return 1;
+	st->pending = 1;
+	return 0;
+}
+
+/*
+ * Feed one sentence, RMC and GGA sentences of one epoch are merged. Returns
+ * 1 when s started a new epoch and the finished one was stored in fix.
+ * GGA sentences seen before any RMC are dropped as they can not be dated.
+ */
+int nmea_feed(struct nmea_state *st,
+	      const struct nmea_sentence *s,
+	      struct nmea_fix *fix)
+{
+	double tod, date, v;
+	int ret = 0;
+
+	if (nmea_is(s, "RMC") && s->nfields > 9) {
+		tod = nmea_tod(s, 1);
+		date = nmea_date(s, 9);
+		if (isnan(tod) || isnan(date))
+			return 0;
+		st->date = date;
+		ret = nmea_epoch(st, tod, fix);
+		if (s->flen[2] == 1 && s->field[2][0] == 'A') {
+			st->fix.lat = nmea_coord(s, 3);
+			st->fix.lon = nmea_coord(s, 5);
+			if (st->fix.mode < NMEA_MODE_2D)
+				st->fix.mode = NMEA_MODE_2D;
+			if (!isnan(v = nmea_fdouble(s, 7)))
+				st->fix.speed = v * 0.514444;
+			st->fix.track = nmea_fdouble(s, 8);
+		}
+	} else if (nmea_is(s, "GGA") && s->nfields > 9) {
+		tod = nmea_tod(s, 1);
+		if (isnan(tod) || isnan(st->date))
+			return 0;
+		ret = nmea_epoch(st, tod, fix);
+		v = nmea_fdouble(s, 6);
+		if (!isnan(v) && v > 0) {
+			st->fix.lat = nmea_coord(s, 2);
+			st->fix.lon = nmea_coord(s, 4);
+			st->fix.alt = nmea_fdouble(s, 9);
+			if (!isnan(st->fix.alt))
+				st->fix.mode = NMEA_MODE_3D;
+			else if (st->fix.mode < NMEA_MODE_2D)
+				st->fix.mode = NMEA_MODE_2D;
+		}
+	}
+	return ret;
+}
+
+/* Finish last epoch at end of input, returns 1 when fix was stored */
+int nmea_flush(struct nmea_state *st, struct nmea_fix *fix)
+{
+	if (!st->pending)
+		return 0;
+	memcpy(fix, &st->fix, sizeof(*fix));
+	st->pending = 0;
+	return 1;
+}
@@ -0,0 +1,55 @@
+/*
+ * Streaming NMEA 0183 parser. Sentences are parsed in place, fields point
+ * into the caller's buffer and are not null terminated.
+ */
+
+#ifndef _NMEA_H_
+#define _NMEA_H_
+
+#include <stddef.h>
+
+#define NMEA_MAXFIELDS 32
+#define NMEA_MAXLEN    128     /* Longer lines are skipped as garbage */
+
+enum {
+	NMEA_MODE_NOFIX = 1,
+	NMEA_MODE_2D,
+	NMEA_MODE_3D
+};
+
+struct nmea_sentence {
+	const char *start;                      /* '$' of sentence */
+	size_t len;                             /* Including checksum */
+	int nfields;                            /* field[0] is talker and type */
+	const char *field[NMEA_MAXFIELDS];
+	unsigned char flen[NMEA_MAXFIELDS];
+};
+
+struct nmea_fix {
+	double time;            /* UTC seconds since epoch */
+	double lat, lon;        /* NAN when unknown */
+	double alt;             /* Meters, NAN when unknown */
+	double speed;           /* m/s, NAN when unknown */
+	double track;           /* Degrees, NAN when unknown */
+	int mode;               /* NMEA_MODE_* */
+};
+
+/* Merges the sentences of one epoch into a fix */
+struct nmea_state {
+	double date;            /* UTC midnight from last RMC, NAN until known */
+	int pending;            /* fix holds an unfinished epoch */
+	struct nmea_fix fix;
+};
+
+int nmea_next(const char **pos, const char *end, struct nmea_sentence *s);
+int nmea_is(const struct nmea_sentence *s, const char *type);
+double nmea_double(const char *p, size_t len);
+double nmea_coord(const struct nmea_sentence *s, int f);
+double nmea_tod(const struct nmea_sentence *s, int f);
+double nmea_date(const struct nmea_sentence *s, int f);
+
+void nmea_init(struct nmea_state *st);
+int nmea_feed(struct nmea_state *st, const struct nmea_sentence *s, struct nmea_fix *fix);
+int nmea_flush(struct nmea_state *st, struct nmea_fix *fix);
+
+#endif /* _NMEA_H_ */
@@ -0,0 +1,153 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "sink.h"
+
+/*
+ * Sink registry plus the two backends without dependencies: "file" writes
+ * rows as they are in memory after an 8 byte magic, "null" only counts
+ * them and is meant for benchmarks that leave storage out.
+ */
+
+#define SINK_FILEMAGIC "GPSSINK1"
+
+static const struct sink_ops * const sinks[] = {
+	&sink_pgsql,
+	&sink_sqlite,
+	&sink_file,
+	&sink_null,
+	NULL
+};
+
+struct sink *sink_open(const char *type,
+		       const char *target,
+		       const char *table)
+{
+	struct sink *sk;
+	int i;
+
+	for (i = 0; sinks[i] != NULL; i++)
+		if (!strcmp(sinks[i]->name, type))
+			break;
+	if (!sinks[i]) {
+		debug(DEBUG_ERROR, "unknown sink type '%s'", type);
+		return NULL;
+	}
+	sk = calloc(1, sizeof(*sk));
+	if (!sk) {
+		debug(DEBUG_ERROR, "out of memory");
+		return NULL;
+	}
+	sk->ops = sinks[i];
+	snprintf(sk->table, sizeof(sk->table), "%s", table);
+	if (!sk->ops->open(sk, target)) {
+		free(sk);
+		return NULL;
+	}
+	return sk;
+}
+
+int sink_append(struct sink *sk,
+		const struct sink_row *rows,
+		int n)
+{
+	return sk->ops->append(sk, rows, n);
+}
+
+int sink_flush(struct sink *sk)
+{
+	return sk->ops->flush(sk);
+}
+
+int sink_ping(struct sink *sk)
+{
+	return sk->ops->ping ? sk->ops->ping(sk) : 1;
+}
+
+unsigned long sink_dropped(const struct sink *sk)
+{
+	return sk->dropped;
+}
+
+void sink_close(struct sink *sk)
+{
+	sk->ops->close(sk);
+	free(sk);
+}
+
+/* file: fixed size records in host byte order, appended to target */
+static int file_open(struct sink *sk, const char *target)
+{
+	FILE *fp;
+
+	fp = fopen(target, "a");
+	if (!fp) {
+		debug(DEBUG_ERROR, "%s: %s", target, strerror(errno));
+		return 0;
+	}
+	if (ftell(fp) == 0 && fwrite(SINK_FILEMAGIC, 8, 1, fp) != 1) {
+		debug(DEBUG_ERROR, "%s: %s", target, strerror(errno));
+		fclose(fp);
+		return 0;
+	}
+	sk->priv = fp;
+	return 1;
+}
+
+static int file_append(struct sink *sk, const struct sink_row *rows, int n)
+{
+	if (fwrite(rows, sizeof(*rows), n, sk->priv) != n) {
+		debug(DEBUG_ERROR, "could not write to sink file: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+static int file_flush(struct sink *sk)
+{
+	if (fflush(sk->priv) == EOF) {
+		debug(DEBUG_ERROR, "could not write to sink file: %s", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+static void file_close(struct sink *sk)
+{
+	fclose(sk->priv);
+}
+
+const struct sink_ops sink_file = {
+	"file", file_open, file_append, file_flush, NULL, file_close
+};
+
+/* null: drops everything, the row count is logged on close */
+static int null_open(struct sink *sk, const char *target)
+{
+	sk->priv = calloc(1, sizeof(unsigned long long));
+	return sk->priv != NULL;
+}
+
+static int null_append(struct sink *sk, const struct sink_row *rows, int n)
+{
+	*(unsigned long long*) sk->priv += n;
+	return 1;
+}
+
+static int null_flush(struct sink *sk)
+{
+	return 1;
+}
+
+static void null_close(struct sink *sk)
+{
+	debug(DEBUG_INFO, "null sink dropped %llu row(s)", *(unsigned long long*) sk->priv);
+	free(sk->priv);
+}
+
+const struct sink_ops sink_null = {
+	"null", null_open, null_append, null_flush, NULL, null_close
+};
@@ -0,0 +1,68 @@
+/*
+ * Storage sinks for gpsdata rows. A sink is opened by type name, rows are
+ * appended in batches and become durable with sink_flush(), backends may
+ * hold appended rows until then. A flush that fails may keep the rows for
+ * the next one; rows a backend gives up on after they were appended are
+ * counted in dropped.
+ */
+
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/* One gpsdata row, empty strings and seq 0 are stored as NULL */
+struct sink_row {
+	char client_name[16];
+	char client_ip[INET_ADDRSTRLEN];
+	char sender_ip[INET_ADDRSTRLEN];
+	char lat[16];
+	char lon[16];
+	int64_t tsp;
+	uint64_t seq;
+	int32_t event;
+	int32_t pad;
+};
+
+struct sink;
+
+struct sink_ops {
+	const char *name;
+	int (*open)(struct sink *sk, const char *target);
+	int (*append)(struct sink *sk, const struct sink_row *rows, int n);
+	int (*flush)(struct sink *sk);
+	int (*ping)(struct sink *sk);   /* NULL when the sink can not be lost */
+	void (*close)(struct sink *sk);
+};
+
+struct sink {
+	const struct sink_ops *ops;
+	char table[32];
+	unsigned long dropped;  /* Appended rows discarded by the backend */
+	void *priv;
+};
+
+/* Backends, see sink.c for the list by name */
+extern const struct sink_ops sink_pgsql;
+extern const struct sink_ops sink_sqlite;
+extern const struct sink_ops sink_file;
+extern const struct sink_ops sink_null;
+
+struct sink *sink_open(const char *type,
+		       const char *target,
+		       const char *table);
+
+int sink_append(struct sink *sk,
+		const struct sink_row *rows,
+		int n);
+
+int sink_flush(struct sink *sk);
+
+int sink_ping(struct sink *sk);
+
+unsigned long sink_dropped(const struct sink *sk);
+
+void sink_close(struct sink *sk);
+
+#endif /* _SINK_H_ */
@@ -0,0 +1,335 @@
+#include <libpq-fe.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "sink.h"
+
+/*
+ * PostgreSQL sink, target is a libpq connection string. Appended rows are
+ * rendered into one multi-row INSERT that is sent on flush. Rows already
+ * stored under the same (client_name, client_seq) are skipped, so a batch
+ * can be resent when it is not known whether it was committed.
+ *
+ * When the connection is lost the rows are kept, up to PGSQL_MAXROWS, and
+ * the connection is reset without blocking over the following flushes. A
+ * batch the server rejects is sent again row by row and only the rejected
+ * rows are dropped.
+ *
+ * Coordinates and addresses that the typed v2 columns would reject are
+ * written as NULL, one bad ACK must not fail the whole batch. The quoted
+ * values are accepted by both the v1 and the v2 schema.
+ */
+
+#define PGSQL_MAXROWS     65536
+#define PGSQL_RETRY_MIN   1000    /* Reconnect backoff in ms */
+#define PGSQL_RETRY_MAX   30000
+
+struct pgsql {
+	PGconn *conn;
+	char *cmd;
+	size_t len, size;
+	struct sink_row *rows;  /* Rows of the next flush */
+	int nrows, maxrows;
+	int resetting;          /* PQresetStart() issued, polled by flush */
+	long backoff;
+	struct timespec retry;  /* No reset attempt before, CLOCK_MONOTONIC */
+};
+
+static int pg_reserve(struct pgsql *pg, size_t n)
+{
+	char *tmp;
+	size_t size;
+
+	if (pg->len + n < pg->size)
+		return 1;
+	size = pg->size ? pg->size : 4096;
+	while (pg->len + n >= size)
+		size *= 2;
+	tmp = realloc(pg->cmd, size);
+	if (!tmp) {
+		debug(DEBUG_ERROR, "out of memory");
+		return 0;
+	}
+	pg->cmd = tmp;
+	pg->size = size;
+	return 1;
+}
+
+/* Quoted and escaped text, NULL when empty */
+static void pg_text(struct pgsql *pg, const char *s, size_t max)
+{
+	size_t len = strnlen(s, max);
+
+	if (!len) {
+		memcpy(pg->cmd + pg->len, "NULL", 4);
+		pg->len += 4;
+		return;
+	}
+	pg->cmd[pg->len++] = '\'';
+	pg->len += PQescapeStringConn(pg->conn, pg->cmd + pg->len, s, len, NULL);
+	pg->cmd[pg->len++] = '\'';
+}
+
+/* Quoted number, NULL when empty or not a finite number */
+static void pg_number(struct pgsql *pg, const char *s, size_t max)
+{
+	char buf[32], *end;
+	size_t len = strnlen(s, max);
+	double d;
+
+	if (len >= sizeof(buf))
+		len = 0;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	d = strtod(buf, &end);
+	if (end == buf || *end != '\0' || !isfinite(d))
+		buf[0] = '\0';
+	pg_text(pg, buf, sizeof(buf));
+}
+
+/* Quoted IPv4 address, NULL when empty or malformed */
+static void pg_inet(struct pgsql *pg, const char *s, size_t max)
+{
+	char buf[INET_ADDRSTRLEN];
+	struct in_addr addr;
+	size_t len = strnlen(s, max);
+
+	if (len >= sizeof(buf))
+		len = 0;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	if (inet_pton(AF_INET, buf, &addr) != 1)
+		buf[0] = '\0';
+	pg_text(pg, buf, sizeof(buf));
+}
+
+static int pgsql_open(struct sink *sk, const char *target)
+{
+	struct pgsql *pg;
+
+	pg = calloc(1, sizeof(*pg));
+	if (!pg) {
+		debug(DEBUG_ERROR, "out of memory");
+		return 0;
+	}
+	pg->conn = PQconnectdb(target);
+	if (PQstatus(pg->conn) != CONNECTION_OK) {
+		debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage(pg->conn));
+		PQfinish(pg->conn);
+		free(pg);
+		return 0;
+	}
+	sk->priv = pg;
+	return 1;
+}
+
+static int pgsql_append(struct sink *sk, const struct sink_row *rows, int n)
+{
+	struct pgsql *pg = sk->priv;
+	struct sink_row *tmp;
+	int size;
+
+	if (pg->nrows + n > pg->maxrows) {
+		if (pg->nrows + n > PGSQL_MAXROWS) {
+			debug(DEBUG_ERROR, "%i rows waiting for the database, dropped %i more",
+			      pg->nrows, n);
+			return 0;
+		}
+		size = pg->maxrows ? pg->maxrows : 64;
+		while (size < pg->nrows + n)
+			size *= 2;
+		tmp = realloc(pg->rows, size * sizeof(*tmp));
+		if (!tmp) {
+			debug(DEBUG_ERROR, "out of memory");
+			return 0;
+		}
+		pg->rows = tmp;
+		pg->maxrows = size;
+	}
+	memcpy(pg->rows + pg->nrows, rows, n * sizeof(*rows));
+	pg->nrows += n;
+	return 1;
+}
+
+/* Render n rows into one INSERT */
+static int pg_render(struct pgsql *pg, const char *table, const struct sink_row *rows, int n)
+{
+	int i;
+
+	/* Escaping at most doubles the text fields */
+	pg->len = 0;
+	if (!pg_reserve(pg, (256 + 2 * sizeof(*rows)) * n))
+		return 0;
+	pg->len = snprintf(pg->cmd, pg->size,
+			   "insert into %s(client_name,client_ip,sender_ip,"
+			   "client_timestamp,client_lat,client_long,event_type,"
+			   "client_seq) values", table);
+	for (i = 0; i < n; i++, rows++) {
+		if (i)
+			pg->cmd[pg->len++] = ',';
+		pg->cmd[pg->len++] = '(';
+		pg_text(pg, rows->client_name, sizeof(rows->client_name));
+		pg->cmd[pg->len++] = ',';
+		pg_inet(pg, rows->client_ip, sizeof(rows->client_ip));
+		pg->cmd[pg->len++] = ',';
+		pg_inet(pg, rows->sender_ip, sizeof(rows->sender_ip));
+		pg->len += snprintf(pg->cmd + pg->len, pg->size - pg->len, ",%" PRId64 ",",
+				    rows->tsp);
+		pg_number(pg, rows->lat, sizeof(rows->lat));
+		pg->cmd[pg->len++] = ',';
+		pg_number(pg, rows->lon, sizeof(rows->lon));
+		if (rows->seq)
+			pg->len += snprintf(pg->cmd + pg->len, pg->size - pg->len,
+					    ",%" PRId32 ",%" PRIu64 ")", rows->event, rows->seq);
+		else
+			pg->len += snprintf(pg->cmd + pg->len, pg->size - pg->len,
+					    ",%" PRId32 ",NULL)", rows->event);
+	}
+	snprintf(pg->cmd + pg->len, pg->size - pg->len, " on conflict do nothing");
+	return 1;
+}
+
+static int pg_exec(struct pgsql *pg)
+{
+	PGresult *result;
+	int ret;
+
+	result = PQexec(pg->conn, pg->cmd);
+	ret = result && PQresultStatus(result) == PGRES_COMMAND_OK;
+	if (!ret)
+		debug(DEBUG_ERROR, "could not insert to db: %s", result ?
+		      PQresultErrorMessage(result) : PQerrorMessage(pg->conn));
+	PQclear(result);
+	return ret;
+}
+
+/*
+ * Advance a connection reset without blocking, returns 1 once the
+ * connection is usable. A failed reset is started again after a backoff.
+ */
+static int pg_reconnect(struct pgsql *pg)
+{
+	struct timespec now;
+	long delay;
+
+	if (!pg->resetting) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (tsdiff(&pg->retry, &now) < 0)
+			return 0;
+		debug(DEBUG_WARNING, "reconnecting to database");
+		if (!PQresetStart(pg->conn))
+			goto fail;
+		pg->resetting = 1;
+	}
+	switch (PQresetPoll(pg->conn)) {
+		case PGRES_POLLING_OK:
+			debug(DEBUG_INFO, "reconnected to database");
+			pg->resetting = 0;
+			pg->backoff = 0;
+			return 1;
+		case PGRES_POLLING_FAILED:
+			break;
+		default:
+			return 0;
+	}
+
+fail:
+	debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage(pg->conn));
+	pg->resetting = 0;
+	pg->backoff = pg->backoff ? pg->backoff * 2 : PGSQL_RETRY_MIN;
+	if (pg->backoff > PGSQL_RETRY_MAX)
+		pg->backoff = PGSQL_RETRY_MAX;
+	clock_gettime(CLOCK_MONOTONIC, &pg->retry);
+	delay = pg->backoff;
+	pg->retry.tv_sec += delay / 1000;
+	pg->retry.tv_nsec += delay % 1000 * 1000000;
+	if (pg->retry.tv_nsec >= 1000000000) {
+		pg->retry.tv_sec++;
+		pg->retry.tv_nsec -= 1000000000;
+	}
+	return 0;
+}
+
+/* Drop the first n rows, the rest move to the front */
+static void pg_consume(struct pgsql *pg, int n)
+{
+	memmove(pg->rows, pg->rows + n, (pg->nrows - n) * sizeof(*pg->rows));
+	pg->nrows -= n;
+}
+
+static int pgsql_flush(struct sink *sk)
+{
+	struct pgsql *pg = sk->priv;
+	int i;
+
+	if (!pg->nrows)
+		return 1;
+	if ((pg->resetting || PQstatus(pg->conn) != CONNECTION_OK) && !pg_reconnect(pg))
+		return 0;
+	if (!pg_render(pg, sk->table, pg->rows, pg->nrows))
+		return 0;
+	if (pg_exec(pg)) {
+		pg->nrows = 0;
+		return 1;
+	}
+	if (PQstatus(pg->conn) != CONNECTION_OK) {
+		debug(DEBUG_WARNING, "%i rows kept for the next flush", pg->nrows);
+		pg_reconnect(pg);
+		return 0;
+	}
+
+	/* The batch was rejected, find the rows that cause it */
+	for (i = 0; i < pg->nrows; i++) {
+		if (!pg_render(pg, sk->table, pg->rows + i, 1)) {
+			pg_consume(pg, i);
+			return 0;
+		}
+		if (pg_exec(pg))
+			continue;
+		if (PQstatus(pg->conn) != CONNECTION_OK) {
+			pg_consume(pg, i);
+			debug(DEBUG_WARNING, "%i rows kept for the next flush", pg->nrows);
+			pg_reconnect(pg);
+			return 0;
+		}
+		debug(DEBUG_ERROR, "dropped row client='%.16s' tsp=%" PRId64 " event=%" PRId32,
+		      pg->rows[i].client_name, pg->rows[i].tsp, pg->rows[i].event);
+		sk->dropped++;
+	}
+	pg->nrows = 0;
+	return 1;
+}
+
+/* Check that a kept-open connection still works, costs one round trip */
+static int pgsql_ping(struct sink *sk)
+{
+	struct pgsql *pg = sk->priv;
+	PGresult *result;
+	int ret;
+
+	if (pg->resetting)
+		return 0;
+	result = PQexec(pg->conn, "");
+	ret = result && PQresultStatus(result) == PGRES_EMPTY_QUERY;
+	PQclear(result);
+	return ret && PQstatus(pg->conn) == CONNECTION_OK;
+}
+
+static void pgsql_close(struct sink *sk)
+{
+	struct pgsql *pg = sk->priv;
+
+	PQfinish(pg->conn);
+	free(pg->cmd);
+	free(pg->rows);
+	free(pg);
+}
+
+const struct sink_ops sink_pgsql = {
+	"pgsql", pgsql_open, pgsql_append, pgsql_flush, pgsql_ping, pgsql_close
+};
@@ -0,0 +1,201 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "sqlite3.h"
+#include "utils.h"
+#include "sink.h"
+
+/*
+ * SQLite sink, target is the database file. The table is created with the
+ * gpsdata columns when missing. Appends run in a transaction that is
+ * committed on flush. Each row is inserted under a savepoint so that a row
+ * that fails is dropped alone, the rest of the transaction is kept.
+ */
+
+enum { LITE_SAVE, LITE_RELEASE, LITE_UNDO, LITE_NSTMT };
+
+static const char *lite_sql[LITE_NSTMT] = {
+	"SAVEPOINT row", "RELEASE row", "ROLLBACK TO row"
+};
+
+struct sqlite {
+	sqlite3 *db;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *stmt[LITE_NSTMT];
+	int pending;            /* Transaction is open */
+	unsigned long rows;     /* Rows inserted in the open transaction */
+};
+
+static int lite_exec(struct sqlite *lt, const char *sql)
+{
+	char *err;
+
+	if (sqlite3_exec(lt->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "sqlite sink: %s", err);
+		sqlite3_free(err);
+		return 0;
+	}
+	return 1;
+}
+
+static int lite_step(struct sqlite *lt, int which)
+{
+	int ret;
+
+	ret = sqlite3_step(lt->stmt[which]);
+	sqlite3_reset(lt->stmt[which]);
+	if (ret != SQLITE_DONE) {
+		debug(DEBUG_ERROR, "sqlite sink: %s", sqlite3_errmsg(lt->db));
+		return 0;
+	}
+	return 1;
+}
+
+static void lite_finalize(struct sqlite *lt)
+{
+	int i;
+
+	for (i = 0; i < LITE_NSTMT; i++)
+		sqlite3_finalize(lt->stmt[i]);
+	sqlite3_finalize(lt->insert);
+}
+
+static int sqlite_open(struct sink *sk, const char *target)
+{
+	struct sqlite *lt;
+	char sql[512];
+	int i;
+
+	lt = calloc(1, sizeof(*lt));
+	if (!lt) {
+		debug(DEBUG_ERROR, "out of memory");
+		return 0;
+	}
+	if (sqlite3_open(target, &lt->db) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "could not open %s: %s", target, sqlite3_errmsg(lt->db));
+		goto fail;
+	}
+	snprintf(sql, sizeof(sql),
+		 "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL; "
+		 "CREATE TABLE IF NOT EXISTS %s(uid INTEGER PRIMARY KEY, client_name TEXT, "
+		 "client_ip TEXT, sender_ip TEXT, client_timestamp INTEGER, client_lat REAL, "
+		 "client_long REAL, event_type INTEGER, client_seq INTEGER); "
+		 "CREATE UNIQUE INDEX IF NOT EXISTS %s_client_seq ON %s(client_name, client_seq)",
+		 sk->table, sk->table, sk->table);
+	if (!lite_exec(lt, sql))
+		goto fail;
+	snprintf(sql, sizeof(sql),
+		 "INSERT OR IGNORE INTO %s(client_name,client_ip,sender_ip,client_timestamp,"
+		 "client_lat,client_long,event_type,client_seq) VALUES(?,?,?,?,?,?,?,?)", sk->table);
+	if (sqlite3_prepare_v2(lt->db, sql, -1, &lt->insert, NULL) != SQLITE_OK) {
+		debug(DEBUG_ERROR, "sqlite sink: %s", sqlite3_errmsg(lt->db));
+		goto fail;
+	}
+	for (i = 0; i < LITE_NSTMT; i++) {
+		if (sqlite3_prepare_v2(lt->db, lite_sql[i], -1, &lt->stmt[i], NULL) != SQLITE_OK) {
+			debug(DEBUG_ERROR, "sqlite sink: %s", sqlite3_errmsg(lt->db));
+			goto fail;
+		}
+	}
+	sk->priv = lt;
+	return 1;
+
+fail:
+	lite_finalize(lt);
+	sqlite3_close(lt->db);
+	free(lt);
+	return 0;
+}
+
+static void lite_text(sqlite3_stmt *stmt, int col, const char *s, size_t max)
+{
+	size_t len = strnlen(s, max);
+
+	if (len)
+		sqlite3_bind_text(stmt, col, s, len, SQLITE_STATIC);
+	else
+		sqlite3_bind_null(stmt, col);
+}
+
+static int sqlite_append(struct sink *sk, const struct sink_row *rows, int n)
+{
+	struct sqlite *lt = sk->priv;
+	int i;
+
+	if (!lt->pending) {
+		if (!lite_exec(lt, "BEGIN"))
+			return 0;
+		lt->pending = 1;
+	}
+	for (i = 0; i < n; i++, rows++) {
+		if (!lite_step(lt, LITE_SAVE))
+			goto abort;
+		lite_text(lt->insert, 1, rows->client_name, sizeof(rows->client_name));
+		lite_text(lt->insert, 2, rows->client_ip, sizeof(rows->client_ip));
+		lite_text(lt->insert, 3, rows->sender_ip, sizeof(rows->sender_ip));
+		sqlite3_bind_int64(lt->insert, 4, rows->tsp);
+		lite_text(lt->insert, 5, rows->lat, sizeof(rows->lat));
+		lite_text(lt->insert, 6, rows->lon, sizeof(rows->lon));
+		sqlite3_bind_int(lt->insert, 7, rows->event);
+		if (rows->seq)
+			sqlite3_bind_int64(lt->insert, 8, rows->seq);
+		else
+			sqlite3_bind_null(lt->insert, 8);
+		if (sqlite3_step(lt->insert) != SQLITE_DONE) {
+			debug(DEBUG_ERROR, "sqlite sink: %s, dropped row client='%.16s'",
+			      sqlite3_errmsg(lt->db), rows->client_name);
+			sqlite3_reset(lt->insert);
+			sk->dropped++;
+			/* Undo this row only, the earlier ones stay in the transaction */
+			if (!lite_step(lt, LITE_UNDO) || !lite_step(lt, LITE_RELEASE))
+				goto abort;
+			continue;
+		}
+		sqlite3_reset(lt->insert);
+		if (!lite_step(lt, LITE_RELEASE))
+			goto abort;
+		lt->rows++;
+	}
+	return 1;
+
+abort:
+	/* The transaction is lost, so are the rows it held */
+	if (!sqlite3_get_autocommit(lt->db))
+		lite_exec(lt, "ROLLBACK");
+	sk->dropped += lt->rows;
+	lt->rows = 0;
+	lt->pending = 0;
+	return 0;
+}
+
+static int sqlite_flush(struct sink *sk)
+{
+	struct sqlite *lt = sk->priv;
+
+	if (!lt->pending)
+		return 1;
+	lt->pending = 0;
+	if (!lite_exec(lt, "COMMIT")) {
+		if (!sqlite3_get_autocommit(lt->db))
+			lite_exec(lt, "ROLLBACK");
+		sk->dropped += lt->rows;
+		lt->rows = 0;
+		return 0;
+	}
+	lt->rows = 0;
+	return 1;
+}
+
+static void sqlite_close(struct sink *sk)
+{
+	struct sqlite *lt = sk->priv;
+
+	sqlite_flush(sk);
+	lite_finalize(lt);
+	sqlite3_close(lt->db);
+	free(lt);
+}
+
+const struct sink_ops sink_sqlite = {
+	"sqlite", sqlite_open, sqlite_append, sqlite_flush, NULL, sqlite_close
+};
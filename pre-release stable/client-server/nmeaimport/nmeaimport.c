@@ -0,0 +1,318 @@
+#include <libpq-fe.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "nmea.h"
+
+/*
+ * Bulk import of raw NMEA logs into gpsdata. Files are read in large
+ * chunks and parsed in place, every dated fix becomes a location row
+ * (event_type 0) streamed to the server with COPY.
+ */
+
+#define IMPORT_READSIZE (1 << 20)
+#define IMPORT_COPYSIZE (1 << 16)
+#define IMPORT_NAMELEN  100       /* client_name VARCHAR(100) */
+
+struct import_stats {
+	unsigned long long bytes;
+	unsigned long sentences;
+	unsigned long invalid;
+	unsigned long fixes;
+	unsigned long rows;
+};
+
+/* Options */
+static const char *opt_host = "127.0.0.1";
+static const char *opt_port = "5432";
+static const char *opt_dbname = "gps";
+static const char *opt_user = "postgres";
+static const char *opt_passwd = "";
+static const char *opt_table = "gpsdata";
+static const char *opt_client;
+static int opt_dryrun;
+
+static PGconn *conn;
+static char copybuf[IMPORT_COPYSIZE];
+static size_t copylen;
+
+static int copy_flush(void)
+{
+	if (!copylen || opt_dryrun) {
+		copylen = 0;
+		return 1;
+	}
+	if (PQputCopyData(conn, copybuf, copylen) != 1) {
+		debug(DEBUG_ERROR, "COPY failed: %s", PQerrorMessage(conn));
+		return 0;
+	}
+	copylen = 0;
+	return 1;
+}
+
+static int copy_fix(const struct nmea_fix *fix, struct import_stats *st)
+{
+	size_t room;
+	int len;
+
+	st->fixes++;
+	if (fix->mode < NMEA_MODE_2D || isnan(fix->lat) || isnan(fix->lon))
+		return 1;
+	/* Corrupt sentences may still pass the checksum */
+	if (fabs(fix->lat) > 90 || fabs(fix->lon) > 180)
+		return 1;
+	/* Send the buffer and format again when the row does not fit */
+	while (1) {
+		room = sizeof(copybuf) - copylen;
+		len = snprintf(copybuf + copylen, room, "%s\t%li\t%f\t%f\t0\n",
+			       opt_client, (long) fix->time, fix->lat, fix->lon);
+		if (len < 0) {
+			debug(DEBUG_ERROR, "unable to format row");
+			return 0;
+		}
+		if ((size_t) len < room)
+			break;
+		if (!copylen) {
+			debug(DEBUG_ERROR, "row longer than COPY buffer");
+			return 0;
+		}
+		if (!copy_flush())
+			return 0;
+	}
+	copylen += len;
+	st->rows++;
+	return 1;
+}
+
+static int import_file(const char *file, struct import_stats *st)
+{
+	struct nmea_state ns;
+	struct nmea_sentence s;
+	struct nmea_fix fix;
+	const char *pos, *end;
+	char *buf;
+	size_t carry;
+	ssize_t n;
+	int fd, ret;
+
+	fd = strcmp(file, "-") ? open(file, O_RDONLY) : STDIN_FILENO;
+	if (fd == -1) {
+		debug(DEBUG_ERROR, "%s: %s", file, strerror(errno));
+		return 0;
+	}
+	buf = malloc(IMPORT_READSIZE + NMEA_MAXLEN);
+	if (!buf) {
+		debug(DEBUG_ERROR, "out of memory");
+		close(fd);
+		return 0;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	nmea_init(&ns);
+	carry = 0;
+	while ((n = read(fd, buf + carry, IMPORT_READSIZE)) > 0) {
+		st->bytes += n;
+		pos = buf;
+		end = buf + carry + n;
+		while ((ret = nmea_next(&pos, end, &s)) != 0) {
+			if (ret == -1) {
+				st->invalid++;
+				continue;
+			}
+			st->sentences++;
+			if (nmea_feed(&ns, &s, &fix) && !copy_fix(&fix, st))
+				goto fail;
+		}
+		/* Incomplete last line moves to the front of the buffer */
+		carry = end - pos;
+		memmove(buf, pos, carry);
+	}
+	if (n == -1) {
+		debug(DEBUG_ERROR, "%s: %s", file, strerror(errno));
+		goto fail;
+	}
+	/* Last line may lack its newline */
+	if (carry) {
+		buf[carry] = '\n';
+		pos = buf;
+		if (nmea_next(&pos, buf + carry + 1, &s) == 1) {
+			st->sentences++;
+			if (nmea_feed(&ns, &s, &fix) && !copy_fix(&fix, st))
+				goto fail;
+		} else
+			st->invalid++;
+	}
+	if (nmea_flush(&ns, &fix) && !copy_fix(&fix, st))
+		goto fail;
+	free(buf);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return 1;
+
+fail:
+	free(buf);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return 0;
+}
+
+static int copy_start(void)
+{
+	PGresult *result;
+	char cmd[256];
+	int ret;
+
+	snprintf(cmd, sizeof(cmd), "COPY %s (client_name,client_timestamp,client_lat,"
+		 "client_long,event_type) FROM STDIN", opt_table);
+	result = PQexec(conn, cmd);
+	ret = PQresultStatus(result) == PGRES_COPY_IN;
+	if (!ret)
+		debug(DEBUG_ERROR, "%s: %s", cmd, PQerrorMessage(conn));
+	PQclear(result);
+	return ret;
+}
+
+/* Finish COPY, everything is rolled back when error is set */
+static int copy_end(const char *error)
+{
+	PGresult *result;
+	int ret = 1;
+
+	if (PQputCopyEnd(conn, error) != 1) {
+		debug(DEBUG_ERROR, "COPY failed: %s", PQerrorMessage(conn));
+		return 0;
+	}
+	while ((result = PQgetResult(conn))) {
+		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+			if (!error)
+				debug(DEBUG_ERROR, "COPY failed: %s", PQerrorMessage(conn));
+			ret = 0;
+		}
+		PQclear(result);
+	}
+	return ret && !error;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [options] -n <client-name> <nmea-log>... (- for stdin)\n"
+		"  -H host     database host (127.0.0.1)\n"
+		"  -P port     database port (5432)\n"
+		"  -d name     database name (gps)\n"
+		"  -U user     database user (postgres)\n"
+		"  -W passwd   database password\n"
+		"  -t table    data table (gpsdata)\n"
+		"  -n name     client_name stored with the fixes, up to 100 characters\n"
+		"  -x          parse only, do not touch the database\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc,
+	 char **argv)
+{
+	struct import_stats st;
+	char conn_str[512];
+	double t0, t;
+	int opt, i, ret;
+	char *progname, *tmp;
+
+	progname = argv[0];
+	if ((tmp = strstr(argv[0], "/")))
+		progname = ++tmp;
+
+	while ((opt = getopt(argc, argv, "H:P:d:U:W:t:n:xh")) != -1) {
+		switch (opt) {
+			case 'H':
+				opt_host = optarg;
+				break;
+			case 'P':
+				opt_port = optarg;
+				break;
+			case 'd':
+				opt_dbname = optarg;
+				break;
+			case 'U':
+				opt_user = optarg;
+				break;
+			case 'W':
+				opt_passwd = optarg;
+				break;
+			case 't':
+				opt_table = optarg;
+				break;
+			case 'n':
+				opt_client = optarg;
+				break;
+			case 'x':
+				opt_dryrun = 1;
+				break;
+			default:
+				usage(progname);
+		}
+	}
+	if (optind == argc || !opt_client)
+		usage(progname);
+	if (strlen(opt_client) > IMPORT_NAMELEN || strpbrk(opt_client, "\t\n\r\\")) {
+		debug(DEBUG_ERROR, "invalid client name");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!opt_dryrun) {
+		snprintf(conn_str, sizeof(conn_str),
+			 "host=%s port=%s dbname=%s user=%s password=%s connect_timeout=10",
+			 opt_host, opt_port, opt_dbname, opt_user, opt_passwd);
+		conn = PQconnectdb(conn_str);
+		if (PQstatus(conn) != CONNECTION_OK) {
+			debug(DEBUG_ERROR, "could not connect to database: %s", PQerrorMessage(conn));
+			PQfinish(conn);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* One COPY per file, a failing file does not leave partial data */
+	ret = EXIT_SUCCESS;
+	for (i = optind; i < argc; i++) {
+		memset(&st, 0, sizeof(st));
+		copylen = 0;
+		t0 = now();
+		if (!opt_dryrun && !copy_start()) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (!import_file(argv[i], &st) || !copy_flush()) {
+			if (!opt_dryrun)
+				copy_end("import aborted");
+			debug(DEBUG_ERROR, "%s: not imported", argv[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		if (!opt_dryrun && !copy_end(NULL)) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		t = now() - t0;
+		debug(DEBUG_INFO, "%s: %llu bytes, %lu sentences, %lu invalid, %lu fixes, "
+		      "%lu rows in %.2fs (%.1f MB/s)", argv[i], st.bytes, st.sentences,
+		      st.invalid, st.fixes, st.rows, t, t > 0 ? st.bytes / t / 1e6 : 0);
+	}
+
+	if (conn)
+		PQfinish(conn);
+	exit(ret);
+}